@@ -0,0 +1,41 @@
+/*
+ * access_list.h
+ *
+ * List of allowed or refused card UIDs kept in the last two pages of the
+ * internal flash, checked before a swipe touches the SD card.
+ */
+
+#ifndef INC_ACCESS_LIST_H_
+#define INC_ACCESS_LIST_H_
+
+#include <stdint.h>
+
+// Two 2K pages at the end of the 64K flash, left out of the FLASH region in STM32F303K8TX_FLASH.ld
+#define ACCESS_LIST_PAGE_A		0x0800F000UL
+#define ACCESS_LIST_PAGE_B		0x0800F800UL
+#define ACCESS_LIST_PAGE_SIZE	2048
+
+// Longest UID kept, a triple size UID
+#define ACCESS_LIST_UID_MAX		10
+
+// 12 byte entries after the 16 byte page header
+#define ACCESS_LIST_CAPACITY	((ACCESS_LIST_PAGE_SIZE - 16) / 12)
+
+typedef enum
+{
+	ACCESS_LIST_OFF = 0,		// Every card is logged, the list is kept but not used
+	ACCESS_LIST_ALLOW,			// Only the listed cards are logged
+	ACCESS_LIST_DENY			// The listed cards are refused
+} AccessListMode;
+
+void accessListInit(void);
+uint8_t accessListCheck(const uint8_t* uid, uint8_t uid_len);
+AccessListMode accessListMode(void);
+uint16_t accessListCount(void);
+uint8_t accessListGet(uint16_t index, uint8_t* uid, uint8_t* uid_len);
+uint8_t accessListSetMode(AccessListMode mode);
+uint8_t accessListAdd(const uint8_t* uid, uint8_t uid_len);
+uint8_t accessListRemove(const uint8_t* uid, uint8_t uid_len);
+uint8_t accessListClear(void);
+
+#endif /* INC_ACCESS_LIST_H_ */
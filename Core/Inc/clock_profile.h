@@ -0,0 +1,33 @@
+/*
+ * clock_profile.h
+ *
+ * System clock profiles: the terminal idles from the 8 MHz HSI and boosts to
+ * 64 MHz from the PLL while a swipe is read, shown and written.
+ */
+
+#ifndef INC_CLOCK_PROFILE_H_
+#define INC_CLOCK_PROFILE_H_
+
+#include <stdint.h>
+
+typedef enum
+{
+	CLOCK_PROFILE_LOW_POWER = 0,	// HSI 8 MHz, PLL off, no flash wait state; as set by SystemClock_Config()
+	CLOCK_PROFILE_PERFORMANCE,		// HSI/2 x 16 = 64 MHz, PCLK1 32 MHz, 2 flash wait states
+	CLOCK_PROFILE_COUNT
+} ClockProfile;
+
+typedef struct
+{
+	uint32_t boosts;				// Switches to CLOCK_PROFILE_PERFORMANCE
+	uint32_t boosted_ms;			// Time spent in it, by HAL_GetTick()
+	uint32_t switch_max;			// us of the slowest switch
+} ClockProfileStats;
+
+uint8_t clockProfileSet(ClockProfile profile);
+ClockProfile clockProfileGet(void);
+void clockProfileRestore(void);
+const ClockProfileStats* clockProfileStats(void);
+void clockProfileResetStats(void);
+
+#endif /* INC_CLOCK_PROFILE_H_ */
@@ -0,0 +1,31 @@
+/*
+ * employee_directory.h
+ *
+ * Names of the employees read from ZAMESTNANCI.CSV on the SD card when the
+ * volume is mounted, so a swipe can be greeted by name without a file access.
+ */
+
+#ifndef INC_EMPLOYEE_DIRECTORY_H_
+#define INC_EMPLOYEE_DIRECTORY_H_
+
+#include <stdint.h>
+#include "ff.h"
+
+// One line per employee: UID as in the log file names or in plain hex, name, employee ID
+#define EMPLOYEE_DIRECTORY_PATH		"ZAMESTNANCI.CSV"
+
+// Employees kept, 8 bytes each in CCM RAM
+#define EMPLOYEE_DIRECTORY_SIZE		64
+
+// Bytes for all names and IDs, in CCM RAM
+#define EMPLOYEE_DIRECTORY_TEXT		1024
+
+// Longer names are cut to what fits on a display row
+#define EMPLOYEE_NAME_MAX			19
+#define EMPLOYEE_ID_MAX				10
+
+void employeeDirectoryLoad(FIL* fil);
+uint16_t employeeDirectoryCount(void);
+uint8_t employeeDirectoryFind(const uint8_t* uid, uint8_t uid_len, const char** name, const char** id);
+
+#endif /* INC_EMPLOYEE_DIRECTORY_H_ */
@@ -0,0 +1,41 @@
+/*
+ * event_queue.h
+ *
+ * Events of the swipe state machine in main.c, posted by the interrupt
+ * handlers and by timers counted down in the SysTick interrupt.
+ */
+
+#ifndef INC_EVENT_QUEUE_H_
+#define INC_EVENT_QUEUE_H_
+
+#include <stdint.h>
+
+// Events waiting at once, a power of 2
+#define EVENT_QUEUE_SIZE	16
+
+typedef enum
+{
+	EVENT_NONE = 0,
+	EVENT_PRICHOD,				// Button pressed
+	EVENT_ODCHOD,
+	EVENT_CARD,					// Detection found a card in the field
+	EVENT_RFID_DETECT,			// The reader was powered down long enough, time for the next detection burst
+	EVENT_ARMED_TIMEOUT,		// No card after the button press
+	EVENT_CLOCK,				// A second passed while a swipe waits for a card, the time shown is updated
+	EVENT_FEEDBACK_TIMEOUT,		// The result of a swipe was shown long enough
+	EVENT_POWER_HOLD,			// The console was quiet long enough to stop the core again
+	EVENT_COUNT
+} EventType;
+
+uint8_t eventPost(EventType event);
+EventType eventGet(void);
+uint8_t eventPending(void);
+void eventTimerStart(EventType event, uint32_t ms);
+void eventTimerStop(EventType event);
+uint8_t eventTimersRunning(void);
+uint32_t eventTimerLeft(EventType event);
+uint32_t eventTimerNext(void);
+void eventTimerTick(void);
+void eventTimerAdvance(uint32_t ms);
+
+#endif /* INC_EVENT_QUEUE_H_ */
@@ -0,0 +1,20 @@
+/*
+ * log_index.h
+ *
+ * In-RAM index of the daily journal: card UID -> offset of the card's
+ * last record in the journal of the day.
+ */
+
+#ifndef INC_LOG_INDEX_H_
+#define INC_LOG_INDEX_H_
+
+#include <stdint.h>
+
+// Cards indexed per day, a power of 2; 8 bytes each in CCM RAM
+#define LOG_INDEX_SIZE	256
+
+void logIndexClear(void);
+void logIndexPut(const uint8_t* uid, uint8_t uid_len, uint32_t offset);
+uint8_t logIndexGet(const uint8_t* uid, uint8_t uid_len, uint32_t* offset);
+
+#endif /* INC_LOG_INDEX_H_ */
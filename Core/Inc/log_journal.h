@@ -0,0 +1,43 @@
+/*
+ * log_journal.h
+ *
+ * Binary attendance journal: one file per day of fixed 32 byte records,
+ * 16 records per 512 byte sector. The format is plain C so the host
+ * converter (Simulator/Tools/journal2txt.c) shares it.
+ */
+
+#ifndef INC_LOG_JOURNAL_H_
+#define INC_LOG_JOURNAL_H_
+
+#include <stdint.h>
+
+// 1: swipes go to the binary journal, 0: text log per card (default)
+#ifndef LOG_JOURNAL_BINARY
+#define LOG_JOURNAL_BINARY	0
+#endif
+
+// A power of 2, so a record never crosses a sector
+#define LOG_RECORD_SIZE		32
+// Triple size UID (ISO 14443-3)
+#define LOG_RECORD_UID_MAX	10
+
+// Little endian, as stored on the card
+typedef struct __attribute__((packed))
+{
+	uint8_t uid_len;
+	uint8_t uid[LOG_RECORD_UID_MAX];	// Unused bytes are 0
+	uint32_t time;						// Seconds since 1.1.1970 00:00 of the RTC time
+	uint8_t direction;					// 1 prichod, 2 odchod
+	uint8_t status;						// Reader status of the swipe, STATUS_OK
+	uint8_t reserved[13];				// 0
+	uint16_t crc;						// CRC-16/CCITT-FALSE of the bytes before it
+} LogRecord;
+
+typedef char LogRecordSizeCheck[(sizeof(LogRecord) == LOG_RECORD_SIZE) ? 1 : -1];
+
+uint16_t logJournalCrc(const uint8_t* data, uint16_t len);
+uint32_t logJournalTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hours, uint8_t minutes, uint8_t seconds);
+uint8_t logJournalRecord(LogRecord* record, const uint8_t* uid, uint8_t uid_len, uint32_t time, uint8_t direction, uint8_t status);
+uint8_t logJournalCheck(const LogRecord* record);
+
+#endif /* INC_LOG_JOURNAL_H_ */
@@ -0,0 +1,29 @@
+/*
+ * log_session.h
+ *
+ * Attendance log kept open between swipes, built on fatfs_wraper_functions.
+ */
+
+#ifndef INC_LOG_SESSION_H_
+#define INC_LOG_SESSION_H_
+
+#include "fatfs_wraper_functions.h"
+#include "log_journal.h"
+#include "log_index.h"
+
+// Log files kept open at once, each one costs a FIL with its sector buffer
+#define LOG_SESSION_FILES	2
+
+// Bytes allocated to a journal at once as a zeroed, preferably contiguous block, a multiple of LOG_RECORD_SIZE; 0 lets it grow by clusters
+#ifndef LOG_JOURNAL_PREALLOC
+#define LOG_JOURNAL_PREALLOC	8192
+#endif
+
+uint8_t logSessionOpen(void);
+uint8_t logSessionAppend(const char* uid, const char* date, const char* line);
+uint8_t logSessionAppendRecord(const char* date, const LogRecord* record);
+uint8_t logSessionLastRecord(const char* date, const uint8_t* uid, uint8_t uid_len, LogRecord* record);
+uint8_t logSessionFlush(void);
+void logSessionClose(void);
+
+#endif /* INC_LOG_SESSION_H_ */
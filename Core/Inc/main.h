@@ -53,10 +53,14 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+uint8_t parseUid(const char* text, uint8_t* uid, uint8_t* uid_len);
 
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
+#define MFRC522_IRQ_Pin GPIO_PIN_0
+#define MFRC522_IRQ_GPIO_Port GPIOA
+#define MFRC522_IRQ_EXTI_IRQn EXTI0_IRQn
 #define PRICHOD_Pin GPIO_PIN_1
 #define PRICHOD_GPIO_Port GPIOA
 #define PRICHOD_EXTI_IRQn EXTI1_IRQn
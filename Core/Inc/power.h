@@ -0,0 +1,44 @@
+/*
+ * power.h
+ *
+ * Low-power idle of the main loop: the core is stopped between events and
+ * woken by the buttons, the RTC wakeup timer set to the next soft timer, or
+ * the first byte received on the console.
+ */
+
+#ifndef INC_POWER_H_
+#define INC_POWER_H_
+
+#include <stdint.h>
+
+// PA3, USART2 RX: its falling edge wakes the core from STOP, the USART itself is not clocked there
+#define POWER_CONSOLE_WAKE_Pin	GPIO_PIN_3
+
+// A timer closer than this is waited for in SLEEP, the RTC wakeup is not worth setting up
+#define POWER_STOP_MIN_MS		20
+
+// Longest STOP the RTC wakeup timer counts at RTCCLK/16, a longer timer takes several
+#define POWER_STOP_MAX_MS		((uint32_t)(65536ULL * 16000U / LSI_VALUE))
+
+// Regulator and HSI start after the wakeup event, before the first instruction (datasheet)
+#define POWER_STOP_WAKEUP_US	5
+
+// Wakes that take longer than this to get the main loop running are counted
+#define POWER_WAKE_BUDGET_US	200
+
+typedef struct
+{
+	uint32_t stops;				// Times the core was stopped
+	uint32_t timed;				// Stops ended by the RTC wakeup timer
+	uint64_t stop_ms;			// Time in STOP, by the RTC
+	uint32_t wake_max;			// us from the wakeup event to the main loop running again
+	uint32_t wake_over;			// Wakes over POWER_WAKE_BUDGET_US
+} PowerStats;
+
+void powerInit(void);
+void powerIdle(uint8_t stop_allowed);
+void powerHold(uint32_t ms);
+const PowerStats* powerStats(void);
+void powerResetStats(void);
+
+#endif /* INC_POWER_H_ */
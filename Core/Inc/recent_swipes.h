@@ -0,0 +1,25 @@
+/*
+ * recent_swipes.h
+ *
+ * Ring of the last logged swipes, a card tapped again in the same direction
+ * within RECENT_SWIPE_WINDOW is not logged a second time.
+ */
+
+#ifndef INC_RECENT_SWIPES_H_
+#define INC_RECENT_SWIPES_H_
+
+#include <stdint.h>
+
+// Seconds after a logged swipe in which the same card and direction is a repeated tap; 0 logs every tap
+#ifndef RECENT_SWIPE_WINDOW
+#define RECENT_SWIPE_WINDOW		60
+#endif
+
+// Swipes remembered, 16 bytes each
+#define RECENT_SWIPE_COUNT		8
+
+uint8_t recentSwipeSeen(const uint8_t* uid, uint8_t uid_len, uint8_t direction, uint32_t time);
+void recentSwipeAdd(const uint8_t* uid, uint8_t uid_len, uint8_t direction, uint32_t time);
+void recentSwipeForget(const uint8_t* uid, uint8_t uid_len, uint8_t direction);
+
+#endif /* INC_RECENT_SWIPES_H_ */
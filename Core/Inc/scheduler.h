@@ -0,0 +1,43 @@
+/*
+ * scheduler.h
+ *
+ * Run-to-completion scheduler of the main loop: the tasks are kept in
+ * priority order and the first one released runs, with its runtime and
+ * deadline misses counted for the "sched" UART command.
+ */
+
+#ifndef INC_SCHEDULER_H_
+#define INC_SCHEDULER_H_
+
+#include <stdint.h>
+
+#define SCHEDULER_TASKS_MAX		8
+
+typedef struct
+{
+	const char* name;
+	void (*run)(void);
+	uint8_t (*ready)(void);		// Releases the task while it returns non-zero, not used by a periodic task
+	uint32_t period;			// ms between releases, 0: released by ready()
+	uint32_t deadline;			// ms from the release to the end of the run, 0: none
+} SchedulerTask;
+
+typedef struct
+{
+	uint32_t runs;
+	uint32_t misses;			// Runs that ended after their deadline
+	uint64_t runtime;			// us of CPU time in total, the core sleeping in a task is not counted
+	uint32_t runtime_max;		// us from the start to the end of the longest run, the core sleeping in it included
+	uint32_t late_max;			// ms from the release to the end of the slowest run
+} SchedulerStats;
+
+void schedulerInit(const SchedulerTask* tasks, uint8_t count);
+uint8_t schedulerRun(void);
+uint8_t schedulerPending(void);
+uint8_t schedulerCount(void);
+const SchedulerTask* schedulerTask(uint8_t index);
+const SchedulerStats* schedulerStats(uint8_t index);
+uint32_t schedulerElapsed(void);
+void schedulerResetStats(void);
+
+#endif /* INC_SCHEDULER_H_ */
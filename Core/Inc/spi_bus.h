@@ -0,0 +1,77 @@
+/**
+ ******************************************************************************
+  * @file    spi_bus.h
+  * @brief   Queued SPI1 transport shared by the SD card, MFRC522 and ILI9163
+  *          drivers.
+  ******************************************************************************
+  *
+  * Every access to SPI1 is described by an SPI_Transaction: the chip select
+  * and optional D/C line of the slave, the buffers and a completion callback.
+  * Transactions run in the order they were submitted. Short ones are clocked
+  * out by the CPU in a single HAL call, longer ones by DMA1 channel 2/3 while
+  * the CPU is free. A transmit buffer can be repeated without releasing the
+  * chip select, which is how the display is filled from a single line buffer.
+  * A long receive can also be kept on the CPU, it then runs through the SPI
+  * FIFO by register access without a HAL call per byte. Each transaction
+  * names the highest SCLK its slave takes and the prescaler is set for it
+  * from the PCLK2 of the moment, so the slaves keep their speed whichever
+  * clock profile the core runs.
+  */
+
+#ifndef SPI_BUS_H_
+#define SPI_BUS_H_
+
+#include <stdint.h>
+#include "spi.h"
+
+// Transactions of at least this many bytes are moved by DMA
+#define SPI_BUS_DMA_MIN_SIZE	16
+
+// Frames a polled receive keeps in flight, the RX FIFO holds four
+#define SPI_BUS_FIFO_FRAMES		3
+
+// Highest SCLK of SPI1 as master (datasheet), whatever the slave takes
+#define SPI_BUS_SCLK_MAX		18000000U
+
+typedef enum
+{
+	SPI_TRANSACTION_IDLE = 0,
+	SPI_TRANSACTION_QUEUED,
+	SPI_TRANSACTION_ACTIVE,
+	SPI_TRANSACTION_DONE,
+	SPI_TRANSACTION_ERROR
+} SPI_TransactionState;
+
+typedef struct SPI_Transaction SPI_Transaction;
+
+typedef void (*SPI_TransactionCallback)(SPI_Transaction *transaction);
+
+struct SPI_Transaction
+{
+	GPIO_TypeDef *cs_port;				// NULL: the driver drives its chip select itself
+	uint16_t cs_pin;
+	GPIO_TypeDef *dc_port;				// NULL: the slave has no data/command line
+	uint16_t dc_pin;
+	GPIO_PinState dc_state;
+
+	const uint8_t *tx_data;				// NULL: clock out 0xFF
+	uint8_t *rx_data;					// NULL: discard what the slave sends back
+	uint16_t size;
+	uint16_t repeat;					// Extra times tx_data is sent with CS held, counts down to 0
+	uint8_t polled;						// 1: clocked by the CPU even if long enough for DMA
+	uint32_t sclk;						// Highest SCLK in Hz the slave takes, 0: the prescaler is left as it is
+
+	SPI_TransactionCallback complete;	// Called from the DMA interrupt for DMA transfers
+	void *context;
+
+	volatile SPI_TransactionState state;
+	SPI_Transaction *next;
+};
+
+void SPI_Bus_Submit(SPI_Transaction *transaction);
+HAL_StatusTypeDef SPI_Bus_Wait(SPI_Transaction *transaction);
+HAL_StatusTypeDef SPI_Bus_Transfer(SPI_Transaction *transaction);
+void SPI_Bus_Flush(void);
+uint8_t SPI_Bus_IsIdle(void);
+
+#endif /* SPI_BUS_H_ */
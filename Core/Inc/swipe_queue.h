@@ -0,0 +1,33 @@
+/*
+ * swipe_queue.h
+ *
+ * Swipes accepted by the state machine in main.c and waiting to be written
+ * to the SD card, so the result is shown before the card is written.
+ */
+
+#ifndef INC_SWIPE_QUEUE_H_
+#define INC_SWIPE_QUEUE_H_
+
+#include <stdint.h>
+#include "mfrc522.h"
+
+// Swipes waiting at once, a power of 2; a full queue is written out before the next swipe is queued
+#define SWIPE_QUEUE_SIZE	8
+
+typedef struct
+{
+	PICC_Uid uid;
+	uint8_t direction;
+	uint32_t time;			// logJournalTime() of the swipe
+	char date[11];			// YYYY_MM_DD, names the log file
+	char clock[9];			// HH:MM:SS, written to the text log
+	uint16_t swipe;			// Number of the swipe the card was read in, never 0
+	uint8_t shown;			// 1 for the card shown on the display of the swipe
+} SwipeRecord;
+
+uint8_t swipeQueuePush(const SwipeRecord* record);
+const SwipeRecord* swipeQueuePeek(void);
+void swipeQueuePop(void);
+uint8_t swipeQueueCount(void);
+
+#endif /* INC_SWIPE_QUEUE_H_ */
@@ -0,0 +1,19 @@
+/*
+ * uid_table.h
+ *
+ * Helpers shared by the tables of card UIDs: the access list, the employee
+ * directory and the index of the daily journal.
+ */
+
+#ifndef INC_UID_TABLE_H_
+#define INC_UID_TABLE_H_
+
+#include <stdint.h>
+
+// Orders an entry of a table against a search key like memcmp()
+typedef int (*UidTableCompare)(const void* entry, const void* key);
+
+uint32_t uidTableHash(const uint8_t* uid, uint8_t uid_len);
+uint16_t uidTableFind(const void* table, uint16_t count, uint16_t size, const void* key, UidTableCompare compare, uint8_t* found);
+
+#endif /* INC_UID_TABLE_H_ */
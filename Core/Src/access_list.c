@@ -0,0 +1,283 @@
+/*
+ * access_list.c
+ *
+ * The list is an array of UIDs sorted in a flash page and searched in place
+ * by bisection, so a check costs a few reads of the flash and no RAM. A
+ * change writes a new copy to the other page: the entries first and the
+ * header last, so a reset in the middle leaves the old copy in force. Of two
+ * valid pages the one with the higher sequence number is the list.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "stm32f3xx_hal.h"
+#include "access_list.h"
+#include "uid_table.h"
+
+#define ACCESS_LIST_MAGIC		0x314C4341UL	// "ACL1"
+
+// Bytes compared when sorting: the length and the zero padded UID
+#define ACCESS_LIST_KEY_SIZE	(1 + ACCESS_LIST_UID_MAX)
+
+typedef struct
+{
+	uint8_t uid_len;
+	uint8_t uid[ACCESS_LIST_UID_MAX];	// Zero padded, so the entries sort by length and then by bytes
+	uint8_t reserved;					// Left erased
+} AccessListEntry;
+
+typedef struct
+{
+	uint32_t magic;						// Programmed last, the copy is valid once it is set
+	uint16_t sequence;
+	uint16_t count;
+	uint8_t mode;
+	uint8_t reserved[7];
+} AccessListHeader;
+
+typedef struct
+{
+	AccessListHeader header;
+	AccessListEntry entry[ACCESS_LIST_CAPACITY];
+} AccessListPage;
+
+// NULL: no valid copy, every card is accepted
+static const AccessListPage* accessList;
+
+/**
+ * @brief Function checks the header of a copy.\n
+ */
+static uint8_t accessListValid(const AccessListPage* page)
+{
+	return page->header.magic == ACCESS_LIST_MAGIC && page->header.count <= ACCESS_LIST_CAPACITY && page->header.mode <= ACCESS_LIST_DENY;
+}
+
+/**
+ * @brief Function fills the search key of a UID.\n
+ * @retval 0 if the UID cannot be listed
+ */
+static uint8_t accessListKey(AccessListEntry* key, const uint8_t* uid, uint8_t uid_len)
+{
+	if (uid_len == 0 || uid_len > ACCESS_LIST_UID_MAX)
+		return 0;
+
+	memset(key, 0, sizeof(*key));
+	key->uid_len = uid_len;
+	memcpy(key->uid, uid, uid_len);
+	key->reserved = 0xFF;
+	return 1;
+}
+
+/**
+ * @brief Function orders an entry against a search key, for uidTableFind().\n
+ */
+static int accessListCompare(const void* entry, const void* key)
+{
+	return memcmp(entry, key, ACCESS_LIST_KEY_SIZE);
+}
+
+/**
+ * @brief Function bisects the list for a key.\n
+ * @retval index of the entry, or of the entry the key would be inserted before
+ */
+static uint16_t accessListFind(const AccessListEntry* key, uint8_t* found)
+{
+	if (accessList == NULL)
+	{
+		*found = 0;
+		return 0;
+	}
+	return uidTableFind(accessList->entry, accessList->header.count, sizeof(AccessListEntry), key, accessListCompare, found);
+}
+
+/**
+ * @brief Function programs a block of an erased page by half-words, the erased ones are skipped.\n
+ */
+static HAL_StatusTypeDef accessListProgram(uint32_t address, const void* data, uint16_t size)
+{
+	const uint8_t* bytes = data;
+
+	for (uint16_t i = 0; i < size; i += 2)
+	{
+		uint16_t halfword;
+
+		memcpy(&halfword, bytes + i, sizeof(halfword));
+		if (halfword != 0xFFFF && HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i, halfword) != HAL_OK)
+			return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief Function writes a new copy of the list to the spare page and makes it the list.\n
+ * @param count entries of the current copy that are kept
+ * @param at position of the change among them
+ * @param insert entry put before entry at, NULL for none
+ * @param drop 1: entry at is left out
+ * @retval 1 on success
+ */
+static uint8_t accessListWrite(AccessListMode mode, uint16_t count, uint16_t at, const AccessListEntry* insert, uint8_t drop)
+{
+	uint32_t spare = (accessList == (const AccessListPage*)ACCESS_LIST_PAGE_A) ? ACCESS_LIST_PAGE_B : ACCESS_LIST_PAGE_A;
+	const AccessListPage* page = (const AccessListPage*)spare;
+	FLASH_EraseInitTypeDef erase = {0};
+	uint32_t page_error;
+	AccessListHeader header;
+	uint16_t written = 0;
+	HAL_StatusTypeDef status;
+
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = spare;
+	erase.NbPages = 1;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &page_error);
+
+	// The entries are copied from the old page one by one, no page buffer in RAM
+	for (uint16_t src = 0; status == HAL_OK && src <= count; src++)
+	{
+		if (insert != NULL && src == at)
+			status = accessListProgram((uint32_t)&page->entry[written++], insert, sizeof(AccessListEntry));
+		if (src == count || status != HAL_OK)
+			break;
+		if (drop && src == at)
+			continue;
+		status = accessListProgram((uint32_t)&page->entry[written++], &accessList->entry[src], sizeof(AccessListEntry));
+	}
+
+	if (status == HAL_OK)
+	{
+		memset(&header, 0xFF, sizeof(header));
+		header.magic = ACCESS_LIST_MAGIC;
+		header.sequence = (accessList != NULL) ? accessList->header.sequence + 1 : 0;
+		header.count = written;
+		header.mode = mode;
+		status = accessListProgram(spare + offsetof(AccessListHeader, sequence), &header.sequence, sizeof(header) - offsetof(AccessListHeader, sequence));
+		if (status == HAL_OK)
+			status = accessListProgram(spare, &header.magic, sizeof(header.magic));
+	}
+	HAL_FLASH_Lock();
+
+	if (status != HAL_OK || !accessListValid(page))
+		return 0;
+	accessList = page;
+	return 1;
+}
+
+/**
+ * @brief Function finds the current copy of the list, called once at startup.\n
+ */
+void accessListInit(void)
+{
+	const AccessListPage* a = (const AccessListPage*)ACCESS_LIST_PAGE_A;
+	const AccessListPage* b = (const AccessListPage*)ACCESS_LIST_PAGE_B;
+
+	accessList = NULL;
+	if (accessListValid(a))
+		accessList = a;
+	if (accessListValid(b) && (accessList == NULL || (int16_t)(b->header.sequence - a->header.sequence) > 0))
+		accessList = b;
+}
+
+/**
+ * @brief Function decides if a card may be logged.\n
+ * @retval 1 if the card is accepted, 0 if it is refused
+ */
+uint8_t accessListCheck(const uint8_t* uid, uint8_t uid_len)
+{
+	AccessListEntry key;
+	uint8_t found = 0;
+
+	if (accessList == NULL || accessList->header.mode == ACCESS_LIST_OFF)
+		return 1;
+	if (accessListKey(&key, uid, uid_len))
+		accessListFind(&key, &found);
+
+	return (accessList->header.mode == ACCESS_LIST_ALLOW) ? found : !found;
+}
+
+AccessListMode accessListMode(void)
+{
+	return (accessList != NULL) ? (AccessListMode)accessList->header.mode : ACCESS_LIST_OFF;
+}
+
+uint16_t accessListCount(void)
+{
+	return (accessList != NULL) ? accessList->header.count : 0;
+}
+
+/**
+ * @brief Function reads an entry, the entries are in ascending order.\n
+ * @retval 0 if there is no such entry
+ */
+uint8_t accessListGet(uint16_t index, uint8_t* uid, uint8_t* uid_len)
+{
+	if (index >= accessListCount())
+		return 0;
+
+	*uid_len = accessList->entry[index].uid_len;
+	memcpy(uid, accessList->entry[index].uid, *uid_len);
+	return 1;
+}
+
+/**
+ * @brief Function switches between allowing and refusing the listed cards.\n
+ * @retval 1 on success
+ */
+uint8_t accessListSetMode(AccessListMode mode)
+{
+	if (mode > ACCESS_LIST_DENY)
+		return 0;
+	if (mode == accessListMode())
+		return 1;
+	return accessListWrite(mode, accessListCount(), 0, NULL, 0);
+}
+
+/**
+ * @brief Function adds a card to the list.\n
+ * @retval 1 on success or if it is listed already, 0 if the list is full
+ */
+uint8_t accessListAdd(const uint8_t* uid, uint8_t uid_len)
+{
+	AccessListEntry key;
+	uint8_t found;
+	uint16_t at;
+
+	if (!accessListKey(&key, uid, uid_len))
+		return 0;
+	at = accessListFind(&key, &found);
+	if (found)
+		return 1;
+	if (accessListCount() == ACCESS_LIST_CAPACITY)
+		return 0;
+	return accessListWrite(accessListMode(), accessListCount(), at, &key, 0);
+}
+
+/**
+ * @brief Function removes a card from the list.\n
+ * @retval 1 on success or if it is not listed
+ */
+uint8_t accessListRemove(const uint8_t* uid, uint8_t uid_len)
+{
+	AccessListEntry key;
+	uint8_t found;
+	uint16_t at;
+
+	if (!accessListKey(&key, uid, uid_len))
+		return 0;
+	at = accessListFind(&key, &found);
+	if (!found)
+		return 1;
+	return accessListWrite(accessListMode(), accessListCount(), at, NULL, 1);
+}
+
+/**
+ * @brief Function removes every card, the mode is kept.\n
+ * @retval 1 on success
+ */
+uint8_t accessListClear(void)
+{
+	if (accessListCount() == 0)
+		return 1;
+	return accessListWrite(accessListMode(), 0, 0, NULL, 0);
+}
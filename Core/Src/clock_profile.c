@@ -0,0 +1,133 @@
+/*
+ * clock_profile.c
+ *
+ * A switch runs from the main loop with the SPI bus idle. HAL_RCC_ClockConfig()
+ * orders the flash wait states around the change of HCLK and sets SysTick up
+ * again. The SPI slaves need nothing, spi_bus.c sets the prescaler for every
+ * transaction from the PCLK2 of the moment. USART2 is clocked by PCLK1 on the
+ * F303x8, so its baud rate register is computed again; a byte received during
+ * the switch may be lost.
+ */
+#include "stm32f3xx_hal.h"
+#include "usart.h"
+#include "spi_bus.h"
+#include "clock_profile.h"
+
+static ClockProfile clockProfile = CLOCK_PROFILE_LOW_POWER;
+static ClockProfileStats clockProfileStatistics;
+static uint32_t clockProfileBoosted;		// ms, HAL_GetTick() of the last boost
+
+/**
+ * @brief Function switches the system clock, the PLL is started before and stopped after it is used.\n
+ * @retval 1 on success
+ */
+static uint8_t clockProfileApply(ClockProfile profile)
+{
+	RCC_OscInitTypeDef osc = {0};
+	RCC_ClkInitTypeDef clk = {0};
+
+	osc.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+	clk.ClockType = RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_SYSCLK | RCC_CLOCKTYPE_PCLK1 | RCC_CLOCKTYPE_PCLK2;
+	clk.AHBCLKDivider = RCC_SYSCLK_DIV1;
+	clk.APB2CLKDivider = RCC_HCLK_DIV1;
+
+	if (profile == CLOCK_PROFILE_PERFORMANCE)
+	{
+		osc.PLL.PLLState = RCC_PLL_ON;
+		osc.PLL.PLLSource = RCC_PLLSOURCE_HSI;
+		osc.PLL.PLLMUL = RCC_PLL_MUL16;
+		if (HAL_RCC_OscConfig(&osc) != HAL_OK)
+			return 0;
+
+		// PCLK1 may not exceed 36 MHz
+		clk.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+		clk.APB1CLKDivider = RCC_HCLK_DIV2;
+		if (HAL_RCC_ClockConfig(&clk, FLASH_LATENCY_2) != HAL_OK)
+			return 0;
+	}
+	else
+	{
+		clk.SYSCLKSource = RCC_SYSCLKSOURCE_HSI;
+		clk.APB1CLKDivider = RCC_HCLK_DIV1;
+		if (HAL_RCC_ClockConfig(&clk, FLASH_LATENCY_0) != HAL_OK)
+			return 0;
+
+		osc.PLL.PLLState = RCC_PLL_OFF;
+		if (HAL_RCC_OscConfig(&osc) != HAL_OK)
+			return 0;
+	}
+
+	__HAL_UART_DISABLE(&huart2);
+	UART_SetConfig(&huart2);
+	__HAL_UART_ENABLE(&huart2);
+	return 1;
+}
+
+/**
+ * @brief Function switches to a clock profile, it waits for the SPI bus to be idle.\n
+ * @retval 1 on success or if the profile is in use already
+ */
+uint8_t clockProfileSet(ClockProfile profile)
+{
+	uint32_t start, elapsed;
+
+	if (profile >= CLOCK_PROFILE_COUNT)
+		return 0;
+	if (profile == clockProfile)
+		return 1;
+
+	// A transfer in flight would change its SCLK halfway
+	SPI_Bus_Flush();
+
+	start = DWT->CYCCNT;
+	if (!clockProfileApply(profile))
+	{
+		// Back to the state the core is in, the PLL may be half set up
+		clockProfileApply(clockProfile);
+		return 0;
+	}
+	// Counted as HSI cycles: most of a switch runs from HSI, the cycles at 64 MHz make it an upper bound
+	elapsed = (DWT->CYCCNT - start) / (HSI_VALUE / 1000000);
+
+	if (profile == CLOCK_PROFILE_PERFORMANCE)
+	{
+		clockProfileStatistics.boosts++;
+		clockProfileBoosted = HAL_GetTick();
+	}
+	else
+	{
+		clockProfileStatistics.boosted_ms += HAL_GetTick() - clockProfileBoosted;
+	}
+	if (elapsed > clockProfileStatistics.switch_max)
+		clockProfileStatistics.switch_max = elapsed;
+
+	clockProfile = profile;
+	return 1;
+}
+
+ClockProfile clockProfileGet(void)
+{
+	return clockProfile;
+}
+
+/**
+ * @brief Function sets the profile in use up again after STOP, which leaves the core on HSI with the PLL off.\n
+ */
+void clockProfileRestore(void)
+{
+	uint32_t sws = (clockProfile == CLOCK_PROFILE_PERFORMANCE) ? RCC_SYSCLKSOURCE_STATUS_PLLCLK : RCC_SYSCLKSOURCE_STATUS_HSI;
+
+	if ((RCC->CFGR & RCC_CFGR_SWS) != sws)
+		clockProfileApply(clockProfile);
+}
+
+const ClockProfileStats* clockProfileStats(void)
+{
+	return &clockProfileStatistics;
+}
+
+void clockProfileResetStats(void)
+{
+	clockProfileStatistics = (ClockProfileStats){0};
+	clockProfileBoosted = HAL_GetTick();
+}
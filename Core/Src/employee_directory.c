@@ -0,0 +1,143 @@
+/*
+ * employee_directory.c
+ *
+ * The file is parsed once into a table sorted by a 32 bit hash of the UID and
+ * a block of NUL terminated names and IDs, both in CCM RAM. A lookup is a
+ * binary search of the table. Only the hash is kept, so a card that is not in
+ * the directory is taken for an employee with a chance of about
+ * EMPLOYEE_DIRECTORY_SIZE in 2^32.
+ */
+#include <string.h>
+
+#include "main.h"
+#include "employee_directory.h"
+#include "uid_table.h"
+
+typedef struct
+{
+	uint32_t key;
+	uint16_t name;		// Offsets into employeeText
+	uint16_t id;
+} EmployeeEntry;
+
+// Not initialised, only the first employeeCount entries and employeeTextUsed bytes are valid
+static EmployeeEntry employees[EMPLOYEE_DIRECTORY_SIZE] __attribute__((section(".ccmbss")));
+static char employeeText[EMPLOYEE_DIRECTORY_TEXT] __attribute__((section(".ccmbss")));
+static uint16_t employeeCount;
+static uint16_t employeeTextUsed;
+
+/**
+ * @brief Function orders an entry against a key, for uidTableFind().\n
+ */
+static int employeeCompare(const void* entry, const void* key)
+{
+	uint32_t a = ((const EmployeeEntry*)entry)->key;
+	uint32_t b = *(const uint32_t*)key;
+
+	return (a > b) - (a < b);
+}
+
+/**
+ * @brief Function bisects the table for the hash of a UID.\n
+ * @retval index of the entry, or of the entry the key would be inserted before
+ */
+static uint16_t employeeFind(uint32_t key, uint8_t* found)
+{
+	return uidTableFind(employees, employeeCount, sizeof(EmployeeEntry), &key, employeeCompare, found);
+}
+
+/**
+ * @brief Function copies a field to the text block, cut to max characters.\n
+ * @retval offset of the copy, 0xFFFF if the block is full
+ */
+static uint16_t employeeStore(const char* text, uint8_t max)
+{
+	uint16_t offset = employeeTextUsed;
+	size_t len = strlen(text);
+
+	if (len > max)
+		len = max;
+	if (employeeTextUsed + len + 1 > EMPLOYEE_DIRECTORY_TEXT)
+		return 0xFFFF;
+
+	memcpy(&employeeText[offset], text, len);
+	employeeText[offset + len] = '\0';
+	employeeTextUsed += len + 1;
+	return offset;
+}
+
+/**
+ * @brief Function adds the employee of one line, "UID,name,ID".\n
+ * @details Comments, malformed lines and a second line of the same card are skipped.
+ */
+static void employeeParse(char* line)
+{
+	char* uid_text = strtok(line, ",\r\n");
+	char* name = strtok(NULL, ",\r\n");
+	char* id = strtok(NULL, ",\r\n");
+	uint8_t uid[10];		// Up to a triple size UID
+	uint8_t uid_len;
+	uint8_t found;
+	uint16_t at;
+	EmployeeEntry entry;
+
+	if (uid_text == NULL || uid_text[0] == '#' || name == NULL || !parseUid(uid_text, uid, &uid_len))
+		return;
+	if (employeeCount == EMPLOYEE_DIRECTORY_SIZE)
+		return;
+
+	entry.key = uidTableHash(uid, uid_len);
+	at = employeeFind(entry.key, &found);
+	if (found)
+		return;
+
+	entry.name = employeeStore(name, EMPLOYEE_NAME_MAX);
+	entry.id = employeeStore(id != NULL ? id : "", EMPLOYEE_ID_MAX);
+	if (entry.name == 0xFFFF || entry.id == 0xFFFF)
+		return;
+
+	memmove(&employees[at + 1], &employees[at], (employeeCount - at) * sizeof(EmployeeEntry));
+	employees[at] = entry;
+	employeeCount++;
+}
+
+/**
+ * @brief Function reads the directory of the mounted volume, called after every mount.\n
+ * @details Without the file the directory is empty and the display shows the UID.
+ * @param[in] fil -> file object to read with, it is closed again
+ */
+void employeeDirectoryLoad(FIL* fil)
+{
+	char line[80];
+
+	employeeCount = 0;
+	employeeTextUsed = 0;
+
+	if (f_open(fil, EMPLOYEE_DIRECTORY_PATH, FA_READ) != FR_OK)
+		return;
+	while (f_gets(line, sizeof(line), fil) != NULL)
+		employeeParse(line);
+	f_close(fil);
+}
+
+uint16_t employeeDirectoryCount(void)
+{
+	return employeeCount;
+}
+
+/**
+ * @brief Function finds the name and employee ID of a card.\n
+ * 			Returns 1 if the card is in the directory, else returns 0.
+ */
+uint8_t employeeDirectoryFind(const uint8_t* uid, uint8_t uid_len, const char** name, const char** id)
+{
+	uint8_t found;
+	uint16_t at = employeeFind(uidTableHash(uid, uid_len), &found);
+
+	if (!found)
+		return 0;
+
+	*name = &employeeText[employees[at].name];
+	*id = &employeeText[employees[at].id];
+	return 1;
+}
@@ -0,0 +1,147 @@
+/*
+ * event_queue.c
+ *
+ * A ring of event codes shared by the interrupt handlers, which post, and the
+ * main loop, which takes them; both ends run with interrupts off for a few
+ * instructions. A timer posts its event once when it runs out. The timers are
+ * counted in the SysTick interrupt, which is suspended while the terminal
+ * sleeps with no timer running; while the core is in STOP mode they stand
+ * still and are moved on by the time measured on the RTC after the wakeup.
+ */
+#include "stm32f3xx_hal.h"
+#include "event_queue.h"
+
+#if (EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1)) != 0
+#error "EVENT_QUEUE_SIZE must be a power of 2"
+#endif
+
+static volatile uint8_t eventQueue[EVENT_QUEUE_SIZE];
+static volatile uint8_t eventHead;
+static volatile uint8_t eventTail;
+static volatile uint32_t eventTimers[EVENT_COUNT];		// ms left, 0: stopped
+
+/**
+ * @brief Function queues an event, callable from any interrupt priority.\n
+ * 			Returns 1 if the event was queued, 0 if the queue is full.
+ */
+uint8_t eventPost(EventType event)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint8_t queued = 0;
+
+	__disable_irq();
+	if ((uint8_t)(eventHead - eventTail) < EVENT_QUEUE_SIZE)
+	{
+		eventQueue[eventHead % EVENT_QUEUE_SIZE] = event;
+		eventHead++;
+		queued = 1;
+	}
+	__set_PRIMASK(primask);
+	return queued;
+}
+
+/**
+ * @brief Function takes the oldest event.\n
+ * 			Returns EVENT_NONE if the queue is empty.
+ */
+EventType eventGet(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	EventType event = EVENT_NONE;
+
+	__disable_irq();
+	if (eventHead != eventTail)
+	{
+		event = (EventType)eventQueue[eventTail % EVENT_QUEUE_SIZE];
+		eventTail++;
+	}
+	__set_PRIMASK(primask);
+	return event;
+}
+
+uint8_t eventPending(void)
+{
+	return eventHead != eventTail;
+}
+
+/**
+ * @brief Function (re)starts the timer of an event, a running one starts over.\n
+ */
+void eventTimerStart(EventType event, uint32_t ms)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	// SysTick must not write back the count it read before the change
+	__disable_irq();
+	eventTimers[event] = ms > 0 ? ms : 1;
+	__set_PRIMASK(primask);
+}
+
+void eventTimerStop(EventType event)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	eventTimers[event] = 0;
+	__set_PRIMASK(primask);
+}
+
+/**
+ * @brief Function checks if SysTick has to keep running for a timer.\n
+ */
+uint8_t eventTimersRunning(void)
+{
+	for (uint8_t i = 0; i < EVENT_COUNT; i++)
+		if (eventTimers[i] != 0)
+			return 1;
+	return 0;
+}
+
+uint32_t eventTimerLeft(EventType event)
+{
+	return eventTimers[event];
+}
+
+/**
+ * @brief Function returns the ms until the first timer runs out, 0 if none is running.\n
+ */
+uint32_t eventTimerNext(void)
+{
+	uint32_t next = 0;
+
+	for (uint8_t i = 0; i < EVENT_COUNT; i++)
+		if (eventTimers[i] != 0 && (next == 0 || eventTimers[i] < next))
+			next = eventTimers[i];
+	return next;
+}
+
+/**
+ * @brief Function counts the timers down, called from the SysTick interrupt every millisecond.\n
+ */
+void eventTimerTick(void)
+{
+	for (uint8_t i = 0; i < EVENT_COUNT; i++)
+	{
+		if (eventTimers[i] != 0 && --eventTimers[i] == 0)
+			eventPost((EventType)i);
+	}
+}
+
+/**
+ * @brief Function counts the timers down by the time SysTick was stopped, called with interrupts off.\n
+ */
+void eventTimerAdvance(uint32_t ms)
+{
+	for (uint8_t i = 0; i < EVENT_COUNT; i++)
+	{
+		if (eventTimers[i] == 0)
+			continue;
+		if (eventTimers[i] > ms)
+			eventTimers[i] -= ms;
+		else
+		{
+			eventTimers[i] = 0;
+			eventPost((EventType)i);
+		}
+	}
+}
@@ -0,0 +1,97 @@
+/*
+ * log_index.c
+ *
+ * Open addressing hash table with linear probing. Only a hash of the UID is
+ * kept, the caller reads the record at the offset and compares the UID, so
+ * a collision costs a read but never returns another card's record.
+ */
+#include <string.h>
+
+#include "log_index.h"
+#include "uid_table.h"
+
+#if (LOG_INDEX_SIZE & (LOG_INDEX_SIZE - 1)) != 0
+#error "LOG_INDEX_SIZE must be a power of 2"
+#endif
+
+typedef struct
+{
+	uint32_t key;		// 0: free
+	uint32_t offset;
+} LogIndexEntry;
+
+// In CCM RAM that is not cleared at startup, logIndexClear() runs before the first use
+static LogIndexEntry logIndex[LOG_INDEX_SIZE] __attribute__((section(".ccmbss")));
+static uint16_t logIndexUsed;
+
+/**
+ * @brief Function returns the hash of a UID as the key of an entry, never 0.\n
+ */
+static uint32_t logIndexKey(const uint8_t* uid, uint8_t uid_len)
+{
+	uint32_t key = uidTableHash(uid, uid_len);
+
+	return key != 0 ? key : 1;
+}
+
+/**
+ * @brief Function returns the entry of the key, or the free entry where it belongs.\n
+ */
+static LogIndexEntry* logIndexFind(uint32_t key)
+{
+	uint16_t slot = key & (LOG_INDEX_SIZE - 1);
+
+	while (logIndex[slot].key != 0 && logIndex[slot].key != key)
+		slot = (slot + 1) & (LOG_INDEX_SIZE - 1);
+	return &logIndex[slot];
+}
+
+/**
+ * @brief Function empties the index, called when the journal of a day is opened.\n
+ */
+void logIndexClear(void)
+{
+	memset(logIndex, 0, sizeof(logIndex));
+	logIndexUsed = 0;
+}
+
+/**
+ * @brief Function stores the offset of the last record of a card.\n
+ * @details When the index is full, a new card is not indexed and its lookups fail.
+ * 			One entry is always left free, so a lookup ends.
+ * @param[in] uid -> card UID
+ * @param[in] uid_len -> number of UID bytes
+ * @param[in] offset -> offset of the record in the journal
+ */
+void logIndexPut(const uint8_t* uid, uint8_t uid_len, uint32_t offset)
+{
+	uint32_t key = logIndexKey(uid, uid_len);
+	LogIndexEntry* entry = logIndexFind(key);
+
+	if (entry->key == 0)
+	{
+		if (logIndexUsed == LOG_INDEX_SIZE - 1)
+			return;
+		entry->key = key;
+		logIndexUsed++;
+	}
+	entry->offset = offset;
+}
+
+/**
+ * @brief Function finds the offset of the last record of a card.\n
+ * 			Returns 1 if the card has a record, else returns 0.
+ * @param[in] uid -> card UID
+ * @param[in] uid_len -> number of UID bytes
+ * @param[out] offset -> offset of the record in the journal
+ */
+uint8_t logIndexGet(const uint8_t* uid, uint8_t uid_len, uint32_t* offset)
+{
+	LogIndexEntry* entry = logIndexFind(logIndexKey(uid, uid_len));
+
+	if (entry->key == 0)
+		return 0;
+
+	*offset = entry->offset;
+	return 1;
+}
@@ -0,0 +1,81 @@
+/*
+ * log_journal.c
+ *
+ * Records of the binary attendance journal.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "log_journal.h"
+
+/**
+ * @brief Function calculates the CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF) of a buffer.\n
+ * @param[in] data -> data
+ * @param[in] len -> number of bytes
+ */
+uint16_t logJournalCrc(const uint8_t* data, uint16_t len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (len--)
+	{
+		crc ^= (uint16_t)(*data++) << 8;
+		for (uint8_t bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+/**
+ * @brief Function converts a calendar date and time to seconds since 1.1.1970 00:00.\n
+ * @details The time zone is not applied, the RTC keeps local time.\n
+ * @param[in] year -> full year, 1970 or later
+ * @param[in] month -> 1-12
+ * @param[in] day -> 1-31
+ */
+uint32_t logJournalTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hours, uint8_t minutes, uint8_t seconds)
+{
+	// Days from civil, the year starts in March so the leap day is last
+	uint32_t y = year - (month <= 2);
+	uint32_t era = y / 400;
+	uint32_t yoe = y - era * 400;
+	uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	uint32_t days = era * 146097 + doe - 719468;
+
+	return days * 86400UL + hours * 3600UL + minutes * 60UL + seconds;
+}
+
+/**
+ * @brief Function fills a journal record and its CRC.\n
+ * 			Returns 1 if the record was filled, 0 if the UID is longer than LOG_RECORD_UID_MAX.
+ * @param[out] record -> record to fill
+ * @param[in] uid -> card UID
+ * @param[in] time -> from logJournalTime()
+ * @param[in] direction -> 1 prichod, 2 odchod
+ * @param[in] status -> reader status of the swipe
+ */
+uint8_t logJournalRecord(LogRecord* record, const uint8_t* uid, uint8_t uid_len, uint32_t time, uint8_t direction, uint8_t status)
+{
+	if (uid_len > LOG_RECORD_UID_MAX)
+		return 0;
+
+	memset(record, 0, sizeof(*record));
+	record->uid_len = uid_len;
+	memcpy(record->uid, uid, uid_len);
+	record->time = time;
+	record->direction = direction;
+	record->status = status;
+	record->crc = logJournalCrc((const uint8_t*)record, offsetof(LogRecord, crc));
+	return 1;
+}
+
+/**
+ * @brief Function checks the CRC of a record read back from the journal.\n
+ * 			Returns 1 if the record is valid, else returns 0.
+ */
+uint8_t logJournalCheck(const LogRecord* record)
+{
+	return record->uid_len <= LOG_RECORD_UID_MAX
+		&& record->crc == logJournalCrc((const uint8_t*)record, offsetof(LogRecord, crc));
+}
@@ -0,0 +1,452 @@
+/*
+ * log_session.c
+ *
+ * The volume is mounted at the first swipe and stays mounted. The log files
+ * of the last swipes stay open, so an append to one of them needs neither the
+ * directory walk of f_open() nor the cluster chain walk of f_lseek(); only the
+ * data sector and the directory entry are written by f_sync(). Both stay in
+ * the sector cache of the disk driver until the terminal goes idle, the main
+ * loop calls logSessionFlush() then.
+ */
+#include "log_session.h"
+#include "employee_directory.h"
+#include "diskio.h"
+#include "sd_cache.h"
+
+#define LOG_PATH_SIZE	48
+
+#if LOG_JOURNAL_PREALLOC % LOG_RECORD_SIZE != 0
+#error "LOG_JOURNAL_PREALLOC must be a multiple of LOG_RECORD_SIZE"
+#endif
+
+extern Disk_drvTypeDef disk;
+
+typedef struct
+{
+	FIL fil;
+	char path[LOG_PATH_SIZE];
+	uint32_t lastUse;
+	uint8_t open;
+} LogFile;
+
+static FATFS logFs;
+static uint8_t mounted;
+static LogFile files[LOG_SESSION_FILES];
+static uint32_t useCounter;
+static LogFile* indexed;		// Journal described by the UID index
+
+/**
+ * @brief Function forgets the mounted volume and its open files without writing to the card.\n
+ * @details Used when the card was removed or replaced. Mounting again releases the file locks.
+ */
+static void logSessionDrop(void)
+{
+	for (uint8_t i = 0; i < LOG_SESSION_FILES; i++)
+		files[i].open = 0;
+
+	f_mount(NULL, "", 0);
+	mounted = 0;
+	indexed = NULL;
+
+	// disk_initialize() only initializes a drive once, a new card needs it again
+	disk.is_initialized[0] = 0;
+}
+
+/**
+ * @brief Function mounts the volume unless it is mounted and the card is still the same.\n
+ * @details Called at startup so the first swipe does not pay for the mount, and before every append.\n
+ * 			USER_SPI_status() reports STA_NOINIT once the card stops answering or comes back uninitialized,
+ * 			then the volume is mounted again, which initializes the new card.\n
+ * 			Returns 1 if the volume is mounted, else returns 0.
+ */
+uint8_t logSessionOpen(void)
+{
+	if (mounted && (disk_status(0) & STA_NOINIT))
+		logSessionDrop();
+
+	if (!mounted)
+	{
+		if (f_mount(&logFs, "", 1) != FR_OK)
+		{
+			// No card yet, the next attempt has to initialize it again
+			logSessionDrop();
+			return 0;
+		}
+		mounted = 1;
+
+		// No log file is open yet, the first one lends its file object
+		employeeDirectoryLoad(&files[0].fil);
+	}
+	return 1;
+}
+
+/**
+ * @brief Function moves the file pointer behind the last record of a preallocated file.\n
+ * @details The unused part of the file is zeroed and a record never starts with 0,
+ * 			so the end is found by a binary search over the first bytes of the records.
+ */
+static FRESULT logSessionSeekEnd(FIL* fil, uint8_t align)
+{
+	DWORD low = 0;
+	DWORD high = f_size(fil) / align;
+
+	while (low < high)
+	{
+		DWORD middle = (low + high) / 2;
+		BYTE first;
+		UINT got;
+
+		if (f_lseek(fil, middle * align) != FR_OK || f_read(fil, &first, 1, &got) != FR_OK || got != 1)
+			return FR_DISK_ERR;
+
+		if (first == 0)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return f_lseek(fil, low * align);
+}
+
+/**
+ * @brief Function adds a zeroed block behind the end of a preallocated file.\n
+ * @details The first block is a contiguous cluster chain if the card has one free. Appends inside the
+ * 			block only rewrite the data sector and the directory entry, the FAT is written here.\n
+ * 			The file pointer stays where it was.
+ */
+static FRESULT logSessionExtend(FIL* fil, DWORD size)
+{
+	static const BYTE zeros[32];
+	DWORD end = f_tell(fil);
+	FRESULT res;
+	UINT written;
+
+	// Only picks the place, the clusters are allocated by the writes below
+	if (f_size(fil) == 0)
+		f_expand(fil, size, 0);
+
+	res = f_lseek(fil, f_size(fil));
+	for (DWORD left = size; res == FR_OK && left > 0; left -= sizeof(zeros))
+	{
+		res = f_write(fil, zeros, sizeof(zeros), &written);
+		if (res == FR_OK && written != sizeof(zeros))
+			res = FR_DENIED;
+	}
+	if (res == FR_OK)
+		res = f_lseek(fil, end);
+	return res;
+}
+
+/**
+ * @brief Function gives back the unused tail of the preallocated journals of the previous days.\n
+ * @details Called when the journal of a new day is created. The open files are closed first,
+ * 			yesterday's journal is usually one of them. A journal whose size is not a multiple
+ * 			of the block was already trimmed.
+ */
+static void logSessionTrim(FIL* fil)
+{
+	DIR dir;
+	FILINFO info;
+	char path[2 + sizeof(info.fname)];
+	DWORD block = LOG_JOURNAL_PREALLOC;
+
+	for (uint8_t i = 0; i < LOG_SESSION_FILES; i++)
+	{
+		if (files[i].open)
+			f_close(&files[i].fil);
+		files[i].open = 0;
+	}
+	indexed = NULL;
+
+#if _USE_LFN
+	// The short name is enough to open the file
+	info.lfname = NULL;
+	info.lfsize = 0;
+#endif
+	if (f_opendir(&dir, "/") != FR_OK)
+		return;
+
+	while (f_readdir(&dir, &info) == FR_OK && info.fname[0])
+	{
+		if ((info.fattrib & AM_DIR) || strstr(info.fname, ".BIN") == NULL
+			|| info.fsize == 0 || info.fsize % block != 0)
+			continue;
+
+		strcpy(path, "/");
+		strcat(path, info.fname);
+		if (f_open(fil, path, FA_OPEN_EXISTING | FA_READ | FA_WRITE) != FR_OK)
+			continue;
+		if (logSessionSeekEnd(fil, LOG_RECORD_SIZE) == FR_OK)
+			f_truncate(fil);
+		f_close(fil);
+	}
+	f_closedir(&dir);
+}
+
+/**
+ * @brief Function fills the UID index from the records of an open journal.\n
+ * @details Done once when the journal is opened, later appends update the index themselves.
+ */
+static FRESULT logSessionIndex(LogFile* file)
+{
+	DWORD end = f_tell(&file->fil);
+	LogRecord record;
+	FRESULT res;
+	UINT got;
+
+	logIndexClear();
+	indexed = NULL;
+
+	res = f_lseek(&file->fil, 0);
+	for (DWORD offset = 0; res == FR_OK && offset < end; offset += sizeof(record))
+	{
+		res = f_read(&file->fil, &record, sizeof(record), &got);
+		if (res == FR_OK && got == sizeof(record) && logJournalCheck(&record))
+			logIndexPut(record.uid, record.uid_len, offset);
+	}
+	if (res == FR_OK)
+		res = f_lseek(&file->fil, end);
+	if (res == FR_OK)
+		indexed = file;
+	return res;
+}
+
+/**
+ * @brief Function returns the open log file for the path, opening it if needed.\n
+ * @details The least recently used file is closed to make room. Returns NULL if the file cannot be opened.
+ * @param[in] path -> path of the file
+ * @param[in] dir -> directory to create first, NULL if the file is in the root
+ * @param[in] journal -> 1 if the file is a journal of LogRecords, it is opened for reading too and indexed
+ */
+static LogFile* logSessionFile(const char* path, const char* dir, uint8_t journal)
+{
+	LogFile* file = &files[0];
+	FRESULT res;
+
+	for (uint8_t i = 0; i < LOG_SESSION_FILES; i++)
+	{
+		if (files[i].open && strcmp(files[i].path, path) == 0)
+		{
+			file = &files[i];
+			if (journal && indexed != file && logSessionIndex(file) != FR_OK)
+				return NULL;
+			return file;
+		}
+
+		if (!files[i].open)
+			file = &files[i];
+		else if (file->open && files[i].lastUse < file->lastUse)
+			file = &files[i];
+	}
+
+	if (file->open)
+	{
+		f_close(&file->fil);
+		file->open = 0;
+	}
+	if (indexed == file)
+		indexed = NULL;
+
+	if (dir != NULL && !createDirectory((char*)dir))
+		return NULL;
+
+	if (!journal)
+	{
+		if (!openFileForAppend(&file->fil, (char*)path))
+			return NULL;
+	}
+	else
+	{
+		// A new day, the journals of the previous days are complete
+		if (LOG_JOURNAL_PREALLOC > 0 && f_stat(path, NULL) == FR_NO_FILE)
+			logSessionTrim(&file->fil);
+
+		if (f_open(&file->fil, path, FA_OPEN_ALWAYS | FA_READ | FA_WRITE) != FR_OK)
+			return NULL;
+
+		// A torn record at the end is overwritten by the next append
+		if (LOG_JOURNAL_PREALLOC > 0)
+			res = logSessionSeekEnd(&file->fil, LOG_RECORD_SIZE);
+		else
+			res = f_lseek(&file->fil, f_size(&file->fil) - f_size(&file->fil) % LOG_RECORD_SIZE);
+		if (res == FR_OK)
+			res = logSessionIndex(file);
+		if (res != FR_OK)
+		{
+			f_close(&file->fil);
+			return NULL;
+		}
+	}
+
+	strcpy(file->path, path);
+	file->open = 1;
+	return file;
+}
+
+/**
+ * @brief Function appends data to a log file and writes it through to the card.\n
+ * @details If the card fails, it is mounted again and the append is retried once.\n
+ * 			Returns 1 if the data was written, else returns 0.
+ * @param[out] offset -> where the data was written, may be NULL
+ */
+static uint8_t logSessionWrite(const char* path, const char* dir, uint8_t journal, const void* data, UINT len, DWORD* offset)
+{
+	UINT written;
+
+	for (uint8_t attempt = 0; attempt < 2; attempt++)
+	{
+		LogFile* file;
+
+		if (!logSessionOpen())
+			return 0;
+
+		file = logSessionFile(path, dir, journal);
+		if (file != NULL
+			&& (!journal || LOG_JOURNAL_PREALLOC == 0 || f_tell(&file->fil) + len <= f_size(&file->fil)
+				|| logSessionExtend(&file->fil, LOG_JOURNAL_PREALLOC) == FR_OK))
+		{
+			if (offset != NULL)
+				*offset = f_tell(&file->fil);
+			uint8_t synced;
+
+			SD_Cache_DeferSync(1);
+			synced = f_write(&file->fil, data, len, &written) == FR_OK && written == len
+				&& f_sync(&file->fil) == FR_OK;
+			SD_Cache_DeferSync(0);
+			if (synced)
+			{
+				file->lastUse = ++useCounter;
+				return 1;
+			}
+		}
+
+		// The size in the directory entry only grows in f_sync(), so the retry cannot duplicate the data
+		logSessionDrop();
+	}
+	return 0;
+}
+
+/**
+ * @brief Function appends a line to the log file of the card for the date.\n
+ * @details The line is in the sector cache when the function returns, logSessionFlush() puts it on the card.\n
+ * 			Returns 1 if the line was written, else returns 0.
+ * @param[in] uid -> card UID, also the name of the card's directory
+ * @param[in] date -> date in YYYY_MM_DD format
+ * @param[in] line -> text to append
+ */
+uint8_t logSessionAppend(const char* uid, const char* date, const char* line)
+{
+	char dir[LOG_PATH_SIZE];
+	char path[LOG_PATH_SIZE];
+
+	// createPathToFile() appends the date to the directory name
+	strncpy(dir, uid, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	createPathToFile(path, dir, (char*)date);
+
+	return logSessionWrite(path, uid, 0, line, strlen(line), NULL);
+}
+
+/**
+ * @brief Function creates the path of the journal of the date, /YYYY_MM_DD.BIN.\n
+ */
+static void logSessionJournalPath(char* path, const char* date)
+{
+	strcpy(path, "/");
+	strncat(path, date, LOG_PATH_SIZE - 6);
+	strcat(path, ".BIN");
+}
+
+/**
+ * @brief Function appends a record to the binary journal of the date.\n
+ * @details The journal of a day is /YYYY_MM_DD.BIN in the root directory, shared by all cards,
+ * 			so opening it does not depend on the number of cards. Records are 32 bytes,
+ * 			so they never cross a sector and a sector holds 16 of them. The journal is allocated
+ * 			LOG_JOURNAL_PREALLOC bytes at a time and trimmed when the next day starts.\n
+ * 			Returns 1 if the record was written, else returns 0.
+ * @param[in] date -> date in YYYY_MM_DD format
+ * @param[in] record -> filled by logJournalRecord()
+ */
+uint8_t logSessionAppendRecord(const char* date, const LogRecord* record)
+{
+	char path[LOG_PATH_SIZE];
+	DWORD offset;
+
+	logSessionJournalPath(path, date);
+	if (!logSessionWrite(path, NULL, 1, record, sizeof(*record), &offset))
+		return 0;
+
+	logIndexPut(record->uid, record->uid_len, offset);
+	return 1;
+}
+
+/**
+ * @brief Function reads the last record of a card from the journal of the date.\n
+ * @details The UID index gives the offset, so the lookup is one sector read at most
+ * 			whatever the number of cards.\n
+ * 			Returns 1 if the card has a record that day, else returns 0.
+ * @param[in] date -> date in YYYY_MM_DD format
+ * @param[in] uid -> card UID
+ * @param[in] uid_len -> number of UID bytes
+ * @param[out] record -> the record
+ */
+uint8_t logSessionLastRecord(const char* date, const uint8_t* uid, uint8_t uid_len, LogRecord* record)
+{
+	char path[LOG_PATH_SIZE];
+	LogFile* file;
+	uint32_t offset;
+	DWORD end;
+	UINT got;
+	uint8_t found;
+
+	// Such a card has no record, logJournalRecord() refuses it
+	if (uid_len > LOG_RECORD_UID_MAX)
+		return 0;
+
+	logSessionJournalPath(path, date);
+	if (!logSessionOpen() || (file = logSessionFile(path, NULL, 1)) == NULL)
+		return 0;
+	if (!logIndexGet(uid, uid_len, &offset))
+		return 0;
+
+	end = f_tell(&file->fil);
+	found = f_lseek(&file->fil, offset) == FR_OK
+			&& f_read(&file->fil, record, sizeof(*record), &got) == FR_OK && got == sizeof(*record)
+			&& logJournalCheck(record)
+			&& record->uid_len == uid_len && memcmp(record->uid, uid, uid_len) == 0;
+
+	// The next append has to land at the end again
+	if (f_lseek(&file->fil, end) != FR_OK)
+		logSessionDrop();
+	return found;
+}
+
+/**
+ * @brief Function writes the sector cache to the card.\n
+ * @details A card that fails is mounted again before the next append, which drops the sectors it did not take.\n
+ * 			Returns 1 if the appends since the last flush are on the card, else returns 0.
+ */
+uint8_t logSessionFlush(void)
+{
+	if (SD_Cache_Flush(0) == RES_OK)
+		return 1;
+
+	logSessionDrop();
+	return 0;
+}
+
+/**
+ * @brief Function closes the open log files and unmounts the volume.\n
+ */
+void logSessionClose(void)
+{
+	for (uint8_t i = 0; i < LOG_SESSION_FILES; i++)
+	{
+		if (files[i].open)
+			f_close(&files[i].fil);
+		files[i].open = 0;
+	}
+
+	f_mount(NULL, "", 0);
+	mounted = 0;
+	indexed = NULL;
+}
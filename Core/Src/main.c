@@ -18,6 +18,7 @@
 /* USER CODE END Header */
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
+#include "dma.h"
 #include "fatfs.h"
 #include "rtc.h"
 #include "spi.h"
@@ -38,17 +39,52 @@
 #include "time.h"
 #include "stm32f3xx_hal_conf.h"
 #include "stm32f3xx_it.h"
+#include "ili9163.h"
+#include "fatfs_wraper_functions.h"
+#include "log_session.h"
+#include "sd_cache.h"
+#include "access_list.h"
+#include "employee_directory.h"
+#include "recent_swipes.h"
+#include "event_queue.h"
+#include "swipe_queue.h"
+#include "scheduler.h"
+#include "power.h"
+#include "clock_profile.h"
+#include "spi_bus.h"
+#include "ctype.h"
 
 #include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
 /* USER CODE BEGIN PTD */
+typedef enum
+{
+	SWIPE_IDLE = 0,		// Waiting for a button, the reader is powered down
+	SWIPE_ARMED,		// Waiting for a card
+	SWIPE_READING,		// Selecting the cards in the field
+	SWIPE_COMMITTING,	// Checking them and queueing them for the SD card
+	SWIPE_FEEDBACK		// Showing the result, a press starts the next swipe
+} SwipeState;
 
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+// Cards logged from one swipe, e.g. a wallet with several badges
+#define SWIPE_CARDS_MAX 4
+
+// Shown instead of the direction when no card of a swipe is logged
+#define SWIPE_REFUSED	0xFF
+#define SWIPE_REPEATED	0xFE
+
+// A swipe waits this long for a card, the result is shown this long
+#define SWIPE_ARMED_TIMEOUT_MS		180000
+#define SWIPE_FEEDBACK_MS			5000
+
+// The core is not stopped for this long after the console was used, the first byte after STOP is lost
+#define CONSOLE_HOLD_MS				60000
 
 /* USER CODE END PD */
 
@@ -62,9 +98,7 @@
 /* USER CODE BEGIN PV */
 char version_buffer[128];
 char message_buffer[128];
-char buf_hex[12];
-
-uint8_t uid_card_found = 0;
+char buf_hex[3 * PICC_UID_MAX];
 
 RTC_TimeTypeDef curTime;
 RTC_DateTypeDef curDate;
@@ -85,31 +119,78 @@ char bufftest[BUFFER_SIZE];
 
 char path[BUFFER_SIZE];
 
-uint8_t testMinutes = 0;
-uint8_t compareMinutes = 0;
-
-FATFS fs;
 FATFS *pfs;
-FIL fil;
 FRESULT fres;
 DWORD fre_clust;
 uint32_t totalSpace, freeSpace;
 uint32_t uart_buf_len;
+uint8_t uart_rx_byte;
+volatile uint8_t uart_line_ready = 0;
 
-uint8_t r;
 uint8_t buttonState = 0;
 uint8_t failedCard = 0;
+
+SwipeState swipeState = SWIPE_IDLE;
+uint8_t lcd_dirty = 0;
+uint8_t sd_flush_pending = 0;
+uint16_t swipe_number = 0;		// Number of the last swipe
+uint16_t swipe_shown = 0;		// Number of the swipe on the display, 0 for none
+uint16_t swipes_lost = 0;		// Swipes the SD card did not take since the reset
+SwipeRecord unflushed[SWIPE_QUEUE_SIZE];	// Swipes written to the sector cache since the last flush
+uint8_t unflushed_count = 0;
+uint32_t cache_dropped = 0;		// SD_Cache_Dropped() when unflushed[] was last checked
+volatile uint8_t power_failed = 0;
+uint8_t rfid_detect_due = 0;
+uint8_t card_buffer[MAX_LEN];
+PICC_Uid tags[SWIPE_CARDS_MAX];
+uint8_t tag_count = 0;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 /* USER CODE BEGIN PFP */
+void resetBuffer(char* buffer, uint32_t buff_size);
+void setBuildTime(RTC_DateTypeDef *date, RTC_TimeTypeDef *time);
+int str2month(const char *str);
+void formatUid(char* buffer, uint32_t buff_size, const PICC_Uid* uid, char separator);
+void showClock(int seconds);
+void showLost(void);
+void uartCommand(char* line);
+uint8_t mifareDump(uint8_t block, uint8_t count);
+void swipeHandle(EventType event);
+void swipeWrite(void);
+void swipeLost(const SwipeRecord* record);
+void swipeFlush(void);
+void swipeTask(void);
+void powerFailTask(void);
+uint8_t powerFailTaskReady(void);
+void lcdTask(void);
+uint8_t lcdTaskReady(void);
+void clockTask(void);
+void swipeShowClock(void);
+void sdFlushTask(void);
+uint8_t sdFlushTaskReady(void);
+void uartTask(void);
+uint8_t uartTaskReady(void);
+void rfidTask(void);
+uint8_t rfidTaskReady(void);
 
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
-
+// Tasks of the main loop in priority order: a power failure first, the display before the SD card, the reader last as it is ready while a swipe waits
+const SchedulerTask tasks[] = {
+	// name		run				ready				period	deadline [ms]
+	{ "pvd",	powerFailTask,	powerFailTaskReady,	0,		20 },
+	{ "events",	swipeTask,		eventPending,		0,		100 },
+	{ "lcd",	lcdTask,		lcdTaskReady,		0,		100 },
+	{ "clock",	clockTask,		NULL,				1000,	50 },
+	{ "sd",		swipeWrite,		swipeQueueCount,	0,		500 },
+	{ "flush",	sdFlushTask,	sdFlushTaskReady,	0,		1000 },
+	{ "uart",	uartTask,		uartTaskReady,		0,		200 },
+	{ "rfid",	rfidTask,		rfidTaskReady,		0,		200 },
+};
 /* USER CODE END 0 */
 
 /**
@@ -140,6 +221,7 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_SPI1_Init();
   MX_USART2_UART_Init();
   MX_FATFS_Init();
@@ -151,17 +233,16 @@ int main(void)
   resetBuffer(path, BUFFER_SIZE);
 
 
-  uint8_t not_vypis = 0;
   HAL_Delay(1000);
 
 
 
-  ILI9163_RegisterCallback(SPI_TransmitData);
   HAL_Delay(50);
 
   lcdInitialise(192);
   lcdClearDisplay(decodeRgbValue(0, 0, 0));
-  lcdPutS("Stlacte tlacidlo...", lcdTextX(2), lcdTextY(8), decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+  lcdTextPutS("Stlacte tlacidlo...", 2, 8, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+  lcdTextUpdate();
 
   HAL_Delay(1000);
 
@@ -192,21 +273,31 @@ int main(void)
   }
 
   // Initialize MFRC522 and read the version
-  uint8_t status;
-  char card_buffer[4];
+  MFRC522_PCD_Init();
+  HAL_Delay(1000);
+  // The RF field is only on while a swipe waits for a card
+  MFRC522_PCD_SoftPowerDown();
 
-  uint8_t testCardFlag = 0;
-  int diffMinutes;
+  // Mount the SD card now, a missing card is mounted at the first swipe
+  logSessionOpen();
 
+  // Supply below 2.9 V: the PVD interrupt has the SD sector cache written out while the capacitors still hold
+  PWR_PVDTypeDef pvd = {0};
+  pvd.PVDLevel = PWR_PVDLEVEL_7;
+  pvd.Mode = PWR_PVD_MODE_IT_RISING;
+  HAL_PWR_ConfigPVD(&pvd);
+  HAL_PWR_EnablePVD();
+  HAL_NVIC_SetPriority(PVD_IRQn, 2, 0);
+  HAL_NVIC_EnableIRQ(PVD_IRQn);
 
-  MFRC522_PCD_Init();
-  HAL_Delay(1000);
+  // Cards refused before the SD card is touched, the list is changed by commands on the UART
+  accessListInit();
+  HAL_UART_Receive_IT(&huart2, &uart_rx_byte, 1);
 
+  schedulerInit(tasks, sizeof(tasks) / sizeof(tasks[0]));
+  powerInit();
 
   /* USER CODE END 2 */
-  // Enter sleep mode
-   HAL_SuspendTick();
-   HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
@@ -215,150 +306,19 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-	  showClock(1);
-
-	  if (buttonState > 0)
-	  {
-		  if (not_vypis == 0)
-		  {
-			  HAL_Delay(100);
-			  lcdClearDisplay(decodeRgbValue(0, 0, 0));
-			  lcdPutS("Prilozte kartu...", lcdTextX(2), lcdTextY(8), decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
-			  HAL_Delay(100);
-			  not_vypis = 1;
-		  }
-
-		  // Read card
-		  if (uid_card_found == 0)
-		  {
-			  status = STATUS_ERROR;
-			  status = MFRC522_PICC_RequestA(PICC_CMD_REQA, card_buffer);
-
-			  if(status != STATUS_OK && !testCardFlag){
-				  showClock(1);
-				  compareMinutes = curTime.Minutes;
-				  testCardFlag = 1;
-			  }
-
-			  else if(testCardFlag){
-				  diffMinutes = testMinutes - compareMinutes;
-				  if( diffMinutes < 0){
-				  		diffMinutes = diffMinutes + 60;
-				  }
-				  if(diffMinutes >= 3){
-					  buttonState = 0;
-					  uid_card_found = 0;
-					  not_vypis = 0;
-					  testCardFlag = 0;
-					  lcdClearDisplay(decodeRgbValue(0, 0, 0));
-					  lcdPutS("Stlacte tlacidlo...", lcdTextX(2), lcdTextY(8), decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
-		  			  // Enter sleep mode
-					  HAL_SuspendTick();
-					  HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
-				  }
-			  }
-
-			  if (status == STATUS_OK)
-		  		  {
-		  			  memset(message_buffer, 0, sizeof(message_buffer));
-		  			  snprintf(message_buffer, sizeof(message_buffer), "\n\r%X,%X,%X", card_buffer[0], card_buffer[1], card_buffer[2]);
-
-		  			  HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, sizeof(message_buffer), 250);
-
-		  			  status = MFRC522_PICC_Anticollision(card_buffer);
-		  			  if (status == STATUS_OK)
-		  			  {
-		  				  memset(message_buffer, 0, sizeof(message_buffer));
-		  				  snprintf(message_buffer, sizeof(message_buffer), "\n\rUID: %X %X %X %X", card_buffer[0], card_buffer[1], card_buffer[2], card_buffer[3]);
-
-		  				  uid_card_found = 1;
-
-		  				  HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, sizeof(message_buffer), 250);
-
-		  			  }
-		  		  }
-		  }
-
-		  	  if (uid_card_found == 1)
-		  	  {
-		  		  snprintf(buf_hex, sizeof(buf_hex), "%X_%X_%X_%X", card_buffer[0], card_buffer[1], card_buffer[2], card_buffer[3]);
-
-  				  if(f_mount(&fs, "", 1) != FR_OK)
-  					  Error_Handler();
-
-		  		  r = createDirectory(buf_hex);
-		  		  if(r == 0) {
-		  			  Error_Handler();
-		  		  }
-
-		  		 char buf_hex_copy[12];
-		  		 strcpy(buf_hex_copy,buf_hex);
-
-				  if(strlen(bld) > 0)
-					  createPathToFile(path, buf_hex, bld);
-
-				  resetBuffer(buf_hex, sizeof(buf_hex));
-				  strcpy(buf_hex, buf_hex_copy);
-
-  				  HAL_Delay(1000);
-
-				  r = openFileForAppend(&fil, path);
-				  if(r == 0){
-					  Error_Handler();
-				  }
-
-				  f_printf(&fil,"%s,%s,%s,%d;\n", buf_hex, bld, tm, buttonState);
-
-				  // Output to LCD display
-				  HAL_Delay(100);
-				  lcdClearDisplay(decodeRgbValue(0, 0, 0));
-
-				  switch (buttonState)
-				  {
-				  	  case 1:
-						strcpy(buff,"Prichod: ");
-						strcat(buff, tm);
-						break;
-				  	  case 2:
-				  		strcpy(buff,"Odchod: ");
-				  		strcat(buff, tm);
-				  		break;
-				  	  default:
-				  		strcpy(buff,"Chyba");
-		  		 		break;
-				  	}
-
-				  lcdPutS(buf_hex, lcdTextX(2), lcdTextY(1), decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
-		 		  lcdPutS(buff, lcdTextX(2), lcdTextY(4), decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
-
-		 		  // Close file
-  				  fres = f_close(&fil);
- 				  if (fres != FR_OK)
-  					  Error_Handler();
-
- 				  // Unmount SDCARD
-  				  fres = f_mount(NULL, "", 1);
-  				  if (fres != FR_OK)
-  				      Error_Handler();
-
-  				  // Clear display
-  				  HAL_Delay(5000);
-  				  lcdClearDisplay(decodeRgbValue(0, 0, 0));
-  				  lcdPutS("Stlacte tlacidlo...", lcdTextX(2), lcdTextY(6), decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
-  				  uid_card_found = 0;
-  				  buttonState = 0;
-  				  not_vypis = 0;
-
-  				  resetBuffer(buff, BUFFER_SIZE);
-  				  resetBuffer(bld, sizeof(bld));
-  				  resetBuffer(tm, sizeof(tm));
-  				  resetBuffer(buf_hex, sizeof(buf_hex));
-  				 // Enter sleep mode
-				   HAL_SuspendTick();
-				   HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
-		  	  }
-	  }
-
+	  if (schedulerRun())
+		  continue;
+
+	  // The swipe is done, back to the low-power clock before waiting
+	  clockProfileSet(CLOCK_PROFILE_LOW_POWER);
+
+	  // Nothing to do until an interrupt or a timer releases a task; the core is stopped unless a transfer or a command line
+	  // is under way. While a swipe is armed the reader is powered down between the detection bursts, the RTC wakes the core
+	  // for the next one
+	  __disable_irq();
+	  if (!schedulerPending())
+		  powerIdle(SPI_Bus_IsIdle() && uart_buf_len == 0 && (swipeState != SWIPE_ARMED || eventTimerLeft(EVENT_RFID_DETECT) > 0));
+	  __enable_irq();
   }
   /* USER CODE END 3 */
 }
@@ -409,6 +369,16 @@ void SystemClock_Config(void)
 
 /* USER CODE BEGIN 4 */
 
+/**
+  * @brief  PVD callback, the supply is failing.
+  * @retval None
+  */
+void HAL_PWR_PVDCallback(void)
+{
+	power_failed = 1;
+	SD_Cache_PowerFail();
+}
+
 /**
   * @brief  EXTI line detection callback.
   * @param  GPIO_Pin Specifies the port pin connected to corresponding EXTI line.
@@ -416,33 +386,778 @@ void SystemClock_Config(void)
   */
 void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
-	// Wake up from sleep mode
-	HAL_ResumeTick();
-
-	if(buttonState > 0)
+	if (GPIO_Pin == MFRC522_IRQ_Pin)
+	{
+		MFRC522_PCD_IrqCallback();
 		return;
+	}
 
+	// The press is handled by the main loop, also while the previous swipe is being shown
 	if (GPIO_Pin == PRICHOD_Pin)
 	{
-		buttonState = 1;
+		eventPost(EVENT_PRICHOD);
 	}
 	else if (GPIO_Pin == ODCHOD_Pin)
 	{
-		buttonState = 2;
+		eventPost(EVENT_ODCHOD);
+	}
+	else if (GPIO_Pin == POWER_CONSOLE_WAKE_Pin)
+	{
+		// A byte woke the core from STOP and was lost, the console is kept awake for the next ones
+		powerHold(CONSOLE_HOLD_MS);
 	}
 	else
 	{
-		buttonState = 0;
 		__NOP();
 	}
 }
 
+/**
+  * @brief  Arms a swipe, or changes its direction if the other button is pressed while the card is awaited.
+  * @param  direction 1: prichod, 2: odchod
+  * @retval None
+  */
+void swipeArm(uint8_t direction)
+{
+	buttonState = direction;
+	swipe_shown = 0;
+	eventTimerStop(EVENT_FEEDBACK_TIMEOUT);
+	eventTimerStart(EVENT_ARMED_TIMEOUT, SWIPE_ARMED_TIMEOUT_MS);
+	if (swipeState == SWIPE_ARMED)
+		return;
+
+	swipeState = SWIPE_ARMED;
+	lcdTextClear(decodeRgbValue(0, 0, 0));
+	lcdTextPutS("Prilozte kartu...", 2, 8, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+	swipeShowClock();
+	MFRC522_PICC_DetectRestart();
+	eventTimerStop(EVENT_RFID_DETECT);
+	rfid_detect_due = 1;
+}
+
+/**
+  * @brief  Shows the time while a swipe waits for a card, again every second by EVENT_CLOCK.
+  * @note   An event timer, unlike the period of the clock task, wakes the core from STOP.
+  * @retval None
+  */
+void swipeShowClock(void)
+{
+	showClock(1);
+	lcdTextPutS(tm, 2, 10, decodeRgbValue(128, 128, 128), decodeRgbValue(0, 0, 0));
+	lcd_dirty = 1;
+	eventTimerStart(EVENT_CLOCK, 1000);
+}
+
+/**
+  * @brief  Ends a swipe or its feedback and shows the idle screen.
+  * @retval None
+  */
+void swipeIdle(void)
+{
+	eventTimerStop(EVENT_ARMED_TIMEOUT);
+	eventTimerStop(EVENT_FEEDBACK_TIMEOUT);
+	eventTimerStop(EVENT_CLOCK);
+	if (swipeState == SWIPE_ARMED)
+		MFRC522_PCD_SoftPowerDown();
+
+	swipeState = SWIPE_IDLE;
+	swipe_shown = 0;
+	buttonState = 0;
+	lcdTextClear(decodeRgbValue(0, 0, 0));
+	lcdTextPutS("Stlacte tlacidlo...", 2, 8, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+	showLost();
+	lcd_dirty = 1;
+
+	resetBuffer(buff, BUFFER_SIZE);
+	resetBuffer(bld, sizeof(bld));
+	resetBuffer(tm, sizeof(tm));
+	resetBuffer(buf_hex, sizeof(buf_hex));
+}
+
+/**
+  * @brief  Selects every card of the field found by the detection.
+  * @retval Number of cards read, 0 if the card left the field before it was selected
+  */
+uint8_t swipeRead(void)
+{
+	swipeState = SWIPE_READING;
+
+	memset(message_buffer, 0, sizeof(message_buffer));
+	snprintf(message_buffer, sizeof(message_buffer), "\n\r%X,%X,%X", card_buffer[0], card_buffer[1], card_buffer[2]);
+	HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, sizeof(message_buffer), 250);
+
+	// Every card in the field is selected and halted in one pass
+	tag_count = MFRC522_PICC_Inventory(card_buffer, tags, SWIPE_CARDS_MAX);
+	for (uint8_t t = 0; t < tag_count; t++)
+	{
+		memset(message_buffer, 0, sizeof(message_buffer));
+		strcpy(message_buffer, "\n\rUID: ");
+		formatUid(message_buffer + strlen(message_buffer), sizeof(message_buffer) - strlen(message_buffer), &tags[t], ' ');
+		HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, sizeof(message_buffer), 250);
+	}
+
+	if (tag_count == 0)
+	{
+		swipeState = SWIPE_ARMED;
+		return 0;
+	}
+
+	// The UIDs are known, the field is not needed until the next swipe
+	MFRC522_PCD_SoftPowerDown();
+	return tag_count;
+}
+
+/**
+  * @brief  Checks the cards read, queues them for the SD card and shows the result at once.
+  * @retval None
+  */
+void swipeCommit(void)
+{
+	uint8_t accepted = 0;
+	uint8_t refused = 0;
+	uint8_t shown_state = SWIPE_REPEATED;
+	PICC_Uid first = tags[0];
+	const PICC_Uid* shown;
+	const char* name;
+	const char* employee_id;
+	uint32_t now;
+
+	swipeState = SWIPE_COMMITTING;
+	eventTimerStop(EVENT_ARMED_TIMEOUT);
+	eventTimerStop(EVENT_CLOCK);
+	showClock(1);
+	now = logJournalTime(curDate.Year + 2000, curDate.Month, curDate.Date, curTime.Hours, curTime.Minutes, curTime.Seconds);
+
+	// Refused cards and repeated taps are only shown, the SD card is not touched for them
+	for (uint8_t t = 0; t < tag_count; t++)
+	{
+		if (!accessListCheck(tags[t].uid_byte, tags[t].size))
+		{
+			refused++;
+			if (t == 0)
+				shown_state = SWIPE_REFUSED;
+		}
+		else if (!recentSwipeSeen(tags[t].uid_byte, tags[t].size, buttonState, now))
+		{
+			tags[accepted++] = tags[t];
+		}
+	}
+	tag_count = accepted;
+	if (tag_count > 0)
+		shown_state = buttonState;
+	else
+		formatUid(buf_hex, sizeof(buf_hex), &first, '_');
+	shown = (tag_count > 0) ? &tags[0] : &first;
+	if (++swipe_number == 0)
+		swipe_number = 1;
+
+	// Every card gets its own record, the first one found is logged last and shown on the display
+	for (int8_t t = tag_count - 1; t >= 0; t--)
+	{
+		SwipeRecord record;
+
+		formatUid(buf_hex, sizeof(buf_hex), &tags[t], '_');
+
+		record.uid = tags[t];
+		record.direction = buttonState;
+		record.time = now;
+		strncpy(record.date, bld, sizeof(record.date) - 1);
+		record.date[sizeof(record.date) - 1] = '\0';
+		strncpy(record.clock, tm, sizeof(record.clock) - 1);
+		record.clock[sizeof(record.clock) - 1] = '\0';
+		record.swipe = swipe_number;
+		record.shown = (t == 0);
+
+		// Written by swipeWrite() once the result is shown, a full queue is written out first
+		while (!swipeQueuePush(&record))
+			swipeWrite();
+		recentSwipeAdd(tags[t].uid_byte, tags[t].size, buttonState, now);
+	}
+
+	// Output to LCD display, swipeWrite() adds what the SD card tells about the shown card
+	swipeState = SWIPE_FEEDBACK;
+	swipe_shown = (tag_count > 0) ? swipe_number : 0;
+	lcdTextClear(decodeRgbValue(0, 0, 0));
+
+	switch (shown_state)
+	{
+		case SWIPE_REFUSED:
+			strcpy(buff, "Pristup zamietnuty");
+			break;
+		case SWIPE_REPEATED:
+			strcpy(buff, "Uz zaznamenane");
+			break;
+		case 1:
+			strcpy(buff,"Prichod: ");
+			strcat(buff, tm);
+			break;
+		case 2:
+			strcpy(buff,"Odchod: ");
+			strcat(buff, tm);
+			break;
+		default:
+			strcpy(buff,"Chyba");
+			break;
+	}
+
+	// Known employees are greeted by name, the directory was read from the SD card at mount
+	if (employeeDirectoryFind(shown->uid_byte, shown->size, &name, &employee_id))
+	{
+		lcdTextPutS(name, 2, 1, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+		snprintf(message_buffer, sizeof(message_buffer), "Os. cislo: %s", employee_id);
+		lcdTextPutS(message_buffer, 2, 2, decodeRgbValue(128, 128, 128), decodeRgbValue(0, 0, 0));
+	}
+	else
+	{
+		lcdTextPutS(buf_hex, 2, 1, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+	}
+	lcdTextPutS(buff, 2, 4, shown_state == SWIPE_REFUSED ? decodeRgbValue(255, 0, 0) :
+			shown_state == SWIPE_REPEATED ? decodeRgbValue(255, 255, 0) : decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+	if (tag_count > 1)
+	{
+		snprintf(buff, BUFFER_SIZE, "+%d dalsie karty", tag_count - 1);
+		lcdTextPutS(buff, 2, 7, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+	}
+	if (refused > 0 && tag_count > 0)
+	{
+		snprintf(buff, BUFFER_SIZE, "Zamietnute karty: %d", refused);
+		lcdTextPutS(buff, 2, 5, decodeRgbValue(255, 0, 0), decodeRgbValue(0, 0, 0));
+	}
+	lcd_dirty = 1;
+
+	eventTimerStart(EVENT_FEEDBACK_TIMEOUT, SWIPE_FEEDBACK_MS);
+}
+
+/**
+  * @brief  Writes the oldest queued swipe to the SD card, the background stage of a swipe.
+  * @retval None
+  */
+void swipeWrite(void)
+{
+	const SwipeRecord* record = swipeQueuePeek();
+	uint8_t stored;
+
+	if (record == NULL)
+		return;
+
+	// unflushed[] is full, the swipes in the cache go to the card first
+	if (unflushed_count == SWIPE_QUEUE_SIZE)
+		swipeFlush();
+
+#if LOG_JOURNAL_BINARY
+	LogRecord entry;
+	LogRecord previous;
+
+	// The card's previous swipe of the day while the result of the record's own swipe is on the display,
+	// its earlier queued swipes are written by now
+	if (record->shown && record->swipe == swipe_shown && swipeState == SWIPE_FEEDBACK && !power_failed && logSessionLastRecord(record->date, record->uid.uid_byte, record->uid.size, &previous))
+	{
+		uint32_t seconds = previous.time % 86400UL;
+		char line[24];
+
+		snprintf(line, sizeof(line), "%s %02lu:%02lu:%02lu", previous.direction == 1 ? "Prichod:" : "Odchod:",
+				(unsigned long)(seconds / 3600), (unsigned long)(seconds / 60 % 60), (unsigned long)(seconds % 60));
+		lcdTextPutS(line, 2, 3, decodeRgbValue(128, 128, 128), decodeRgbValue(0, 0, 0));
+		lcd_dirty = 1;
+	}
+
+	stored = logJournalRecord(&entry, record->uid.uid_byte, record->uid.size, record->time, record->direction, STATUS_OK)
+			&& logSessionAppendRecord(record->date, &entry);
+#else
+	char uid[3 * PICC_UID_MAX];
+	char log_line[BUFFER_SIZE];
+
+	formatUid(uid, sizeof(uid), &record->uid, '_');
+	snprintf(log_line, sizeof(log_line), "%s,%s,%s,%d;\n", uid, record->date, record->clock, record->direction);
+	stored = logSessionAppend(uid, record->date, log_line);
+#endif
+
+	// A card mounted again for this record dropped the sectors of the earlier ones that were not flushed yet
+	if (SD_Cache_Dropped() != cache_dropped)
+	{
+		cache_dropped = SD_Cache_Dropped();
+		while (unflushed_count > 0)
+			swipeLost(&unflushed[--unflushed_count]);
+	}
+
+	if (stored)
+		unflushed[unflushed_count++] = *record;
+	else
+		swipeLost(record);
+	swipeQueuePop();
+	sd_flush_pending = 1;
+}
+
+/**
+  * @brief  A swipe did not reach the SD card, the card is missing or broken.
+  * @note   A lost swipe is not remembered, tapping again retries it. The error is shown with the swipe if its result
+  *         is still on the display, else counted on the idle screen.
+  * @retval None
+  */
+void swipeLost(const SwipeRecord* record)
+{
+	recentSwipeForget(record->uid.uid_byte, record->uid.size, record->direction);
+	swipes_lost++;
+	if (record->shown && record->swipe == swipe_shown && swipeState == SWIPE_FEEDBACK)
+		lcdTextPutS("Chyba SD karty", 2, 6, decodeRgbValue(255, 255, 255), decodeRgbValue(0, 0, 0));
+	else if (swipeState == SWIPE_IDLE)
+		showLost();
+	lcd_dirty = 1;
+}
+
+/**
+  * @brief  Writes the sector cache to the SD card, the swipes in it are lost if the card fails.
+  * @retval None
+  */
+void swipeFlush(void)
+{
+	if (!logSessionFlush())
+	{
+		while (unflushed_count > 0)
+			swipeLost(&unflushed[--unflushed_count]);
+	}
+	unflushed_count = 0;
+}
+
+/**
+  * @brief  Shows on the idle screen how many swipes the SD card did not take.
+  * @retval None
+  */
+void showLost(void)
+{
+	if (swipes_lost == 0)
+		return;
+	snprintf(buff, BUFFER_SIZE, "Nezapisane: %u", swipes_lost);
+	lcdTextPutS(buff, 2, 6, decodeRgbValue(255, 0, 0), decodeRgbValue(0, 0, 0));
+}
+
+/**
+  * @brief  Task writing the sector cache and then the queued swipes out after the PVD interrupt, where the HAL tick
+  *         runs for the timeouts of the driver. The cache writes through after a power failure.
+  * @retval None
+  */
+void powerFailTask(void)
+{
+	swipeFlush();
+	while (swipeQueueCount() > 0)
+		swipeWrite();
+}
+
+uint8_t powerFailTaskReady(void)
+{
+	return SD_Cache_FlushPending() || (power_failed && swipeQueueCount() > 0);
+}
+
+/**
+  * @brief  Task of the swipe state machine, takes one event.
+  * @retval None
+  */
+void swipeTask(void)
+{
+	swipeHandle(eventGet());
+}
+
+/**
+  * @brief  Task drawing the text changed since the last run.
+  * @retval None
+  */
+void lcdTask(void)
+{
+	lcd_dirty = 0;
+	lcdTextUpdate();
+}
+
+uint8_t lcdTaskReady(void)
+{
+	return lcd_dirty;
+}
+
+/**
+  * @brief  Task reading the RTC every second while the core is awake, swipeShowClock() shows it while a swipe waits.
+  * @retval None
+  */
+void clockTask(void)
+{
+	showClock(1);
+}
+
+/**
+  * @brief  Task writing the sector cache out once the queued swipes are written.
+  * @retval None
+  */
+void sdFlushTask(void)
+{
+	sd_flush_pending = 0;
+	swipeFlush();
+}
+
+uint8_t sdFlushTaskReady(void)
+{
+	return sd_flush_pending && swipeQueueCount() == 0;
+}
+
+/**
+  * @brief  Task of the UART console, runs a received line.
+  * @retval None
+  */
+void uartTask(void)
+{
+	uartCommand(uart_buf);
+	resetBuffer(uart_buf, UART_BUFFER_SIZE);
+	uart_buf_len = 0;
+	uart_line_ready = 0;
+}
+
+uint8_t uartTaskReady(void)
+{
+	return uart_line_ready;
+}
+
+/**
+  * @brief  Task of the reader, one detection burst; the pause to the next one is an event timer, the core sleeps meanwhile.
+  * @retval None
+  */
+void rfidTask(void)
+{
+	rfid_detect_due = 0;
+	if (MFRC522_PICC_Detect(card_buffer) == STATUS_OK)
+		eventPost(EVENT_CARD);
+	else
+		eventTimerStart(EVENT_RFID_DETECT, MFRC522_PICC_DetectNextMs());
+}
+
+uint8_t rfidTaskReady(void)
+{
+	return swipeState == SWIPE_ARMED && rfid_detect_due;
+}
+
+/**
+  * @brief  Moves the swipe state machine on by one event.
+  * @retval None
+  */
+void swipeHandle(EventType event)
+{
+	switch (event)
+	{
+		case EVENT_PRICHOD:
+		case EVENT_ODCHOD:
+			// A press during the feedback of the previous swipe starts the next one at once
+			swipeArm(event == EVENT_PRICHOD ? 1 : 2);
+			break;
+		case EVENT_RFID_DETECT:
+			rfid_detect_due = 1;
+			break;
+		case EVENT_CLOCK:
+			if (swipeState == SWIPE_ARMED)
+				swipeShowClock();
+			break;
+		case EVENT_CARD:
+			if (swipeState != SWIPE_ARMED)
+				break;
+			// 64 MHz until the swipe is shown and written, the main loop drops back before it sleeps
+			clockProfileSet(CLOCK_PROFILE_PERFORMANCE);
+			if (swipeRead() > 0)
+				swipeCommit();
+			else
+			{
+				// The card left before it was selected, detection goes on
+				clockProfileSet(CLOCK_PROFILE_LOW_POWER);
+				rfid_detect_due = 1;
+			}
+			break;
+		case EVENT_ARMED_TIMEOUT:
+			// No card within the timeout, the reader is left powered down
+			if (swipeState == SWIPE_ARMED)
+				swipeIdle();
+			break;
+		case EVENT_FEEDBACK_TIMEOUT:
+			if (swipeState == SWIPE_FEEDBACK)
+				swipeIdle();
+			break;
+		default:
+			break;
+	}
+}
+
 void resetBuffer(char* buffer, uint32_t buff_size)
 {
 	for(int i = 0; i < buff_size; i++)
 		buffer[i] = '\0';
 }
 
+/**
+  * @brief  Writes the UID bytes in hex, as 4_11_22_33_44_55_66 for a 7 byte UID.
+  * @param  separator character put between the bytes
+  * @retval None
+  */
+void formatUid(char* buffer, uint32_t buff_size, const PICC_Uid* uid, char separator)
+{
+	uint32_t len = 0;
+
+	buffer[0] = '\0';
+	for (uint8_t i = 0; i < uid->size && len < buff_size; i++)
+	{
+		if (i > 0)
+			len += snprintf(buffer + len, buff_size - len, "%c", separator);
+		if (len < buff_size)
+			len += snprintf(buffer + len, buff_size - len, "%X", uid->uid_byte[i]);
+	}
+}
+
+
+/**
+  * @brief  Reads a UID typed as 0411223344556A or as the log writes it, 4_11_22_33_44_55_6A.
+  * @retval 1 if it is a 4, 7 or 10 byte UID
+  */
+uint8_t parseUid(const char* text, uint8_t* uid, uint8_t* uid_len)
+{
+	uint8_t separated = (strpbrk(text, "_:") != NULL);
+	uint8_t len = 0;
+
+	while (*text != '\0')
+	{
+		char* end;
+		unsigned long value;
+
+		if (len == PICC_UID_MAX)
+			return 0;
+		if (separated)
+		{
+			value = strtoul(text, &end, 16);
+			if (end == text || value > 0xFF || (*end != '\0' && *end != '_' && *end != ':'))
+				return 0;
+			text = (*end != '\0') ? end + 1 : end;
+		}
+		else
+		{
+			char byte[3] = { text[0], text[1], '\0' };
+
+			if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1]))
+				return 0;
+			value = strtoul(byte, NULL, 16);
+			text += 2;
+		}
+		uid[len++] = (uint8_t)value;
+	}
+	*uid_len = len;
+	return len == 4 || len == 7 || len == 10;
+}
+
+/**
+  * @brief  Reads blocks of the MIFARE Classic card on the reader with the transport key A and sends them in hex.
+  * @note   The blocks are read in one session, a sector is authenticated once for all of its blocks.
+  * @param  block first block
+  * @param  count number of blocks
+  * @retval 1 if every block was read
+  */
+uint8_t mifareDump(uint8_t block, uint8_t count)
+{
+	static const MIFARE_Key transport_key = { { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } };
+	uint8_t data[MAX_LEN];
+	PICC_Uid uid;
+	uint8_t ok = 0;
+
+	if (MFRC522_PICC_Detect(card_buffer) == STATUS_OK && MFRC522_PICC_Select(&uid) == STATUS_OK)
+	{
+		MFRC522_MIFARE_BeginSession(&uid, PICC_CMD_MF_AUTH_KEY_A, &transport_key);
+		for (ok = 1; ok && count > 0; block++, count--)
+		{
+			ok = (MFRC522_MIFARE_Read(block, data) == STATUS_OK);
+			if (ok)
+			{
+				uint32_t len = snprintf(message_buffer, sizeof(message_buffer), "%3u:", block);
+
+				for (uint8_t i = 0; i < MF_BLOCK_SIZE; i++)
+					len += snprintf(message_buffer + len, sizeof(message_buffer) - len, " %02X", data[i]);
+				strcat(message_buffer, "\r\n");
+				HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			}
+		}
+		MFRC522_MIFARE_EndSession();
+		MFRC522_PICC_HaltA();
+	}
+
+	MFRC522_PCD_SoftPowerDown();
+	return ok;
+}
+
+/**
+  * @brief  Runs a command line received on the UART and answers OK or ERR.
+  * @note   acl                          mode and size of the access list
+  *         acl off | allow | deny       log every card, only the listed ones, all but the listed ones
+  *         acl add <UID> | del <UID>    change the list
+  *         acl clear | list
+  *         sched [reset]                runtime of the main loop tasks
+  *         power [reset]                time in STOP and the slowest wakeup
+  *         clock [reset]                clock profile and the time spent at 64 MHz
+  *         mifare <block> [count]       blocks of the card on the reader, between swipes
+  * @retval None
+  */
+void uartCommand(char* line)
+{
+	char* command = strtok(line, " \r\n");
+	char* action = strtok(NULL, " \r\n");
+	char* argument = strtok(NULL, " \r\n");
+	static const char* const modes[] = { "off", "allow", "deny" };
+	PICC_Uid uid;
+	uint8_t ok = 0;
+
+	if (command != NULL && strcmp(command, "acl") == 0)
+	{
+		if (action == NULL)
+		{
+			snprintf(message_buffer, sizeof(message_buffer), "acl %s %u/%u\r\n",
+					modes[accessListMode()], accessListCount(), (unsigned)ACCESS_LIST_CAPACITY);
+			HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			ok = 1;
+		}
+		else if (strcmp(action, "off") == 0 || strcmp(action, "allow") == 0 || strcmp(action, "deny") == 0)
+		{
+			ok = accessListSetMode(action[0] == 'o' ? ACCESS_LIST_OFF : action[0] == 'a' ? ACCESS_LIST_ALLOW : ACCESS_LIST_DENY);
+		}
+		else if (strcmp(action, "add") == 0 && argument != NULL && parseUid(argument, uid.uid_byte, &uid.size))
+		{
+			ok = accessListAdd(uid.uid_byte, uid.size);
+		}
+		else if (strcmp(action, "del") == 0 && argument != NULL && parseUid(argument, uid.uid_byte, &uid.size))
+		{
+			ok = accessListRemove(uid.uid_byte, uid.size);
+		}
+		else if (strcmp(action, "clear") == 0)
+		{
+			ok = accessListClear();
+		}
+		else if (strcmp(action, "list") == 0)
+		{
+			for (uint16_t i = 0; accessListGet(i, uid.uid_byte, &uid.size); i++)
+			{
+				formatUid(message_buffer, sizeof(message_buffer) - 2, &uid, '_');
+				strcat(message_buffer, "\r\n");
+				HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			}
+			ok = 1;
+		}
+	}
+
+	else if (command != NULL && strcmp(command, "sched") == 0)
+	{
+		if (action == NULL)
+		{
+			uint32_t elapsed = schedulerElapsed();
+
+			// us of runtime per ms awake is the CPU share in per mille
+			snprintf(message_buffer, sizeof(message_buffer), "sched awake %lu ms\r\n", (unsigned long)elapsed);
+			HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			for (uint8_t i = 0; i < schedulerCount(); i++)
+			{
+				const SchedulerStats* stats = schedulerStats(i);
+				uint32_t permille = elapsed > 0 ? (uint32_t)(stats->runtime / elapsed) : 0;
+
+				snprintf(message_buffer, sizeof(message_buffer), "%-6s runs %lu cpu %lu.%lu%% max %lu us late %lu ms miss %lu\r\n",
+						schedulerTask(i)->name, (unsigned long)stats->runs, (unsigned long)(permille / 10), (unsigned long)(permille % 10),
+						(unsigned long)stats->runtime_max, (unsigned long)stats->late_max, (unsigned long)stats->misses);
+				HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			}
+			ok = 1;
+		}
+		else if (strcmp(action, "reset") == 0)
+		{
+			schedulerResetStats();
+			ok = 1;
+		}
+	}
+
+	else if (command != NULL && strcmp(command, "power") == 0)
+	{
+		if (action == NULL)
+		{
+			const PowerStats* stats = powerStats();
+
+			snprintf(message_buffer, sizeof(message_buffer), "power stop %lu (rtc %lu) %lu ms wake max %lu us over %lu\r\n",
+					(unsigned long)stats->stops, (unsigned long)stats->timed, (unsigned long)stats->stop_ms,
+					(unsigned long)stats->wake_max, (unsigned long)stats->wake_over);
+			HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			ok = 1;
+		}
+		else if (strcmp(action, "reset") == 0)
+		{
+			powerResetStats();
+			ok = 1;
+		}
+	}
+
+	else if (command != NULL && strcmp(command, "clock") == 0)
+	{
+		if (action == NULL)
+		{
+			const ClockProfileStats* stats = clockProfileStats();
+
+			snprintf(message_buffer, sizeof(message_buffer), "clock %lu MHz boosts %lu %lu ms switch max %lu us\r\n",
+					(unsigned long)(SystemCoreClock / 1000000), (unsigned long)stats->boosts,
+					(unsigned long)stats->boosted_ms, (unsigned long)stats->switch_max);
+			HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+			ok = 1;
+		}
+		else if (strcmp(action, "reset") == 0)
+		{
+			clockProfileResetStats();
+			ok = 1;
+		}
+	}
+
+	else if (command != NULL && strcmp(command, "mifare") == 0 && action != NULL)
+	{
+		unsigned long block = strtoul(action, NULL, 10);
+		unsigned long count = (argument != NULL) ? strtoul(argument, NULL, 10) : 1;
+
+		// The reader belongs to the swipe while one is armed or shown
+		if (swipeState == SWIPE_IDLE && block < 256 && count > 0 && block + count <= 256)
+			ok = mifareDump((uint8_t)block, (uint8_t)count);
+	}
+
+	strcpy(message_buffer, ok ? "OK\r\n" : "ERR\r\n");
+	HAL_UART_Transmit(&huart2, (uint8_t *)message_buffer, strlen(message_buffer), 250);
+}
+
+/**
+  * @brief  One byte received on USART2, collects a command line for the main loop.
+  * @retval None
+  */
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+	if (huart != &huart2)
+		return;
+
+	powerHold(CONSOLE_HOLD_MS);
+
+	// Bytes arriving while the main loop runs the previous line are dropped
+	if (!uart_line_ready)
+	{
+		if (uart_rx_byte == '\r' || uart_rx_byte == '\n')
+		{
+			if (uart_buf_len > 0)
+			{
+				uart_buf[uart_buf_len] = '\0';
+				uart_line_ready = 1;
+			}
+		}
+		else if (uart_buf_len < UART_BUFFER_SIZE - 1)
+		{
+			uart_buf[uart_buf_len++] = uart_rx_byte;
+		}
+	}
+	HAL_UART_Receive_IT(&huart2, &uart_rx_byte, 1);
+}
+
+/**
+  * @brief  Receive error (overrun, framing), the reception is started again.
+  * @retval None
+  */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if (huart == &huart2)
+		HAL_UART_Receive_IT(&huart2, &uart_rx_byte, 1);
+}
 
 /**
   * @brief  RTC build funcion.
@@ -513,7 +1228,6 @@ void showClock(int seconds)
 
   snprintf(bld, 40, "%02d_%02d_%02d", curDate.Year + 2000, curDate.Month, curDate.Date);
   snprintf(tm, 40, "%02d:%02d:%02d", curTime.Hours, curTime.Minutes, curTime.Seconds);
-  testMinutes = curTime.Minutes;
 }
 
 /* USER CODE END 4 */
@@ -0,0 +1,171 @@
+/*
+ * power.c
+ *
+ * The main loop calls powerIdle() with interrupts off when no task is
+ * released. The core is stopped if nothing clocked has to run on: the SPI bus
+ * is idle and the console is quiet. SysTick stops with the core, so the RTC
+ * wakeup timer is set to the nearest soft timer, and the soft timers are
+ * moved on by the time the RTC saw pass once the core runs again. SPI1, DMA
+ * and the GPIOs keep their registers through STOP, only the clock profile has
+ * to be restored. The time from the wakeup to the main loop running again is
+ * measured by the DWT cycle counter, which stands still in STOP.
+ */
+#include "stm32f3xx_hal.h"
+#include "rtc.h"
+#include "event_queue.h"
+#include "clock_profile.h"
+#include "power.h"
+
+static PowerStats powerStatistics;
+
+/**
+ * @brief Function reads the RTC as sub-second ticks since midnight.\n
+ */
+static uint32_t powerRtcTicks(uint32_t* ticks_per_second)
+{
+	RTC_TimeTypeDef time;
+	RTC_DateTypeDef date;
+
+	HAL_RTC_GetTime(&hrtc, &time, RTC_FORMAT_BIN);
+	// Reading the date unlocks the shadow registers again
+	HAL_RTC_GetDate(&hrtc, &date, RTC_FORMAT_BIN);
+
+	*ticks_per_second = time.SecondFraction + 1;
+	return ((time.Hours * 60UL + time.Minutes) * 60UL + time.Seconds) * *ticks_per_second + (time.SecondFraction - time.SubSeconds);
+}
+
+/**
+ * @brief Function returns the ms the RTC counted since a reading taken before STOP.\n
+ */
+static uint32_t powerRtcElapsed(uint32_t before)
+{
+	uint32_t ticks_per_second;
+	uint32_t now, day;
+
+	// The shadow registers kept the time the core was stopped at until they are copied again
+	HAL_RTC_WaitForSynchro(&hrtc);
+	now = powerRtcTicks(&ticks_per_second);
+	day = 86400UL * ticks_per_second;
+	return (uint32_t)((uint64_t)((now + day - before) % day) * 1000 / ticks_per_second);
+}
+
+/**
+ * @brief Function lets a falling edge on the USART2 RX pin wake the core, on EXTI line 3.\n
+ */
+static void powerConsoleWake(uint8_t enable)
+{
+	if (enable)
+	{
+		MODIFY_REG(SYSCFG->EXTICR[0], SYSCFG_EXTICR1_EXTI3, SYSCFG_EXTICR1_EXTI3_PA);
+		SET_BIT(EXTI->FTSR, EXTI_FTSR_TR3);
+		EXTI->PR = EXTI_PR_PR3;
+		SET_BIT(EXTI->IMR, EXTI_IMR_MR3);
+	}
+	else
+	{
+		CLEAR_BIT(EXTI->IMR, EXTI_IMR_MR3);
+	}
+}
+
+/**
+ * @brief Function stops the core until an EXTI line or the RTC wakes it.\n
+ * @param next ms to the nearest soft timer, 0 if none is running
+ */
+static void powerStop(uint32_t next)
+{
+	uint32_t period = 0;
+	uint32_t elapsed = 0;
+	uint32_t before, ticks_per_second, start, wake;
+	uint8_t timed = 0;
+
+	if (next != 0)
+	{
+		// Rounded down, the rest of the timer runs on SysTick after the wakeup
+		uint32_t counts = (uint32_t)((uint64_t)(next < POWER_STOP_MAX_MS ? next : POWER_STOP_MAX_MS) * LSI_VALUE / 16000U);
+
+		period = (uint32_t)((uint64_t)counts * 16000U / LSI_VALUE);
+		HAL_RTCEx_SetWakeUpTimer_IT(&hrtc, counts - 1, RTC_WAKEUPCLOCK_RTCCLK_DIV16);
+	}
+	before = powerRtcTicks(&ticks_per_second);
+	powerConsoleWake(1);
+
+	HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+
+	// Awake with interrupts still off, running from HSI; the handler of the wakeup runs when the main loop enables them
+	start = DWT->CYCCNT;
+	clockProfileRestore();
+	if (period != 0)
+	{
+		timed = __HAL_RTC_WAKEUPTIMER_GET_FLAG(&hrtc, RTC_FLAG_WUTF) ? 1 : 0;
+		elapsed = timed ? period : powerRtcElapsed(before);
+		// A clock set during STOP must not run the timers out
+		if (elapsed > period)
+			elapsed = period;
+		eventTimerAdvance(elapsed);
+	}
+	wake = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000) + POWER_STOP_WAKEUP_US;
+
+	// Left until the timers are going again, they need none of it
+	powerConsoleWake(0);
+	if (period != 0)
+		HAL_RTCEx_DeactivateWakeUpTimer(&hrtc);
+	else
+		elapsed = powerRtcElapsed(before);
+
+	powerStatistics.stops++;
+	powerStatistics.timed += timed;
+	powerStatistics.stop_ms += elapsed;
+	if (wake > powerStatistics.wake_max)
+		powerStatistics.wake_max = wake;
+	if (wake > POWER_WAKE_BUDGET_US)
+		powerStatistics.wake_over++;
+}
+
+/**
+ * @brief Function sets up the wakeup sources that are not configured by CubeMX, called once at startup.\n
+ */
+void powerInit(void)
+{
+	HAL_NVIC_SetPriority(EXTI3_IRQn, 3, 0);
+	HAL_NVIC_EnableIRQ(EXTI3_IRQn);
+	powerResetStats();
+}
+
+/**
+ * @brief Function waits for the next interrupt, called by the main loop with interrupts off.\n
+ * @param stop_allowed 0: nothing may be stopped in the middle, e.g. an SPI transfer, the core only sleeps
+ */
+void powerIdle(uint8_t stop_allowed)
+{
+	uint32_t next = eventTimerNext();
+
+	if (stop_allowed && eventTimerLeft(EVENT_POWER_HOLD) == 0 && (next == 0 || next >= POWER_STOP_MIN_MS))
+	{
+		powerStop(next);
+		return;
+	}
+
+	// SysTick only runs for a timer
+	if (next == 0)
+		HAL_SuspendTick();
+	HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+	HAL_ResumeTick();
+}
+
+/**
+ * @brief Function keeps the core out of STOP for a while, callable from an interrupt.\n
+ */
+void powerHold(uint32_t ms)
+{
+	eventTimerStart(EVENT_POWER_HOLD, ms);
+}
+
+const PowerStats* powerStats(void)
+{
+	return &powerStatistics;
+}
+
+void powerResetStats(void)
+{
+	powerStatistics = (PowerStats){0};
+}
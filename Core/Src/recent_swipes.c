@@ -0,0 +1,93 @@
+/*
+ * recent_swipes.c
+ *
+ * A handful of entries searched linearly, the oldest one is overwritten. The
+ * time is the RTC time in seconds, SysTick is stopped while the terminal
+ * sleeps between swipes.
+ */
+#include <string.h>
+
+#include "recent_swipes.h"
+
+#define RECENT_SWIPE_UID_MAX	10
+
+typedef struct
+{
+	uint8_t uid_len;					// 0: free
+	uint8_t uid[RECENT_SWIPE_UID_MAX];
+	uint8_t direction;
+	uint32_t time;
+} RecentSwipe;
+
+static RecentSwipe recentSwipes[RECENT_SWIPE_COUNT];
+static uint8_t recentSwipeNext;
+
+/**
+ * @brief Function finds the swipe of a card in a direction.\n
+ */
+static RecentSwipe* recentSwipeFind(const uint8_t* uid, uint8_t uid_len, uint8_t direction)
+{
+	for (uint8_t i = 0; i < RECENT_SWIPE_COUNT; i++)
+	{
+		RecentSwipe* swipe = &recentSwipes[i];
+
+		if (swipe->uid_len == uid_len && swipe->direction == direction && memcmp(swipe->uid, uid, uid_len) == 0)
+			return swipe;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Function checks if the card was logged in the same direction a moment ago.\n
+ * 			Returns 1 for a repeated tap, else returns 0.
+ * @param[in] time -> RTC time of the tap in seconds
+ */
+uint8_t recentSwipeSeen(const uint8_t* uid, uint8_t uid_len, uint8_t direction, uint32_t time)
+{
+	RecentSwipe* swipe;
+
+	if (RECENT_SWIPE_WINDOW == 0 || uid_len == 0 || uid_len > RECENT_SWIPE_UID_MAX)
+		return 0;
+
+	swipe = recentSwipeFind(uid, uid_len, direction);
+	// A clock set back makes the difference negative, the tap is logged then
+	return swipe != NULL && time >= swipe->time && time - swipe->time < RECENT_SWIPE_WINDOW;
+}
+
+/**
+ * @brief Function remembers a logged swipe.\n
+ */
+void recentSwipeAdd(const uint8_t* uid, uint8_t uid_len, uint8_t direction, uint32_t time)
+{
+	RecentSwipe* swipe;
+
+	if (uid_len == 0 || uid_len > RECENT_SWIPE_UID_MAX)
+		return;
+
+	swipe = recentSwipeFind(uid, uid_len, direction);
+	if (swipe == NULL)
+	{
+		swipe = &recentSwipes[recentSwipeNext];
+		recentSwipeNext = (recentSwipeNext + 1) % RECENT_SWIPE_COUNT;
+	}
+	swipe->uid_len = uid_len;
+	memcpy(swipe->uid, uid, uid_len);
+	swipe->direction = direction;
+	swipe->time = time;
+}
+
+/**
+ * @brief Function forgets a swipe that could not be logged, so tapping again retries it.
+
+ */
+void recentSwipeForget(const uint8_t* uid, uint8_t uid_len, uint8_t direction)
+{
+	RecentSwipe* swipe;
+
+	if (uid_len == 0 || uid_len > RECENT_SWIPE_UID_MAX)
+		return;
+
+	swipe = recentSwipeFind(uid, uid_len, direction);
+	if (swipe != NULL)
+		swipe->uid_len = 0;
+}
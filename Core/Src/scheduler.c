@@ -0,0 +1,184 @@
+/*
+ * scheduler.c
+ *
+ * Every pass releases the tasks that became ready or whose period came up,
+ * then runs the released task of the highest priority to its end. Periods
+ * and deadlines are counted by HAL_GetTick(), which stops while the terminal
+ * sleeps idle with SysTick suspended or is in STOP, so periods only run out while it is
+ * awake. The CPU time is counted by the DWT cycle counter, which stops while
+ * the core sleeps: a task waiting for the SPI bus or for the reader does not
+ * use the CPU. The cycles of a run are turned into time at the clock the run
+ * ends with, which is the clock of most of the run when it switches the clock
+ * profile. The longest run is timed by HAL_GetTick() and the SysTick counter
+ * instead, SysTick runs while a task sleeps, so the wait holds up the tasks
+ * behind it and is counted.
+ */
+#include <string.h>
+
+#include "stm32f3xx_hal.h"
+#include "scheduler.h"
+
+static const SchedulerTask* schedulerTasks;
+static uint8_t schedulerTaskCount;
+static SchedulerStats schedulerTaskStats[SCHEDULER_TASKS_MAX];
+static uint8_t schedulerReleased[SCHEDULER_TASKS_MAX];
+static uint32_t schedulerRelease[SCHEDULER_TASKS_MAX];		// ms, release of the pending run
+static uint32_t schedulerNext[SCHEDULER_TASKS_MAX];			// ms, next release of a periodic task
+static uint32_t schedulerSince;								// ms, last reset of the statistics
+
+/**
+ * @brief Function returns the time in us from HAL_GetTick() and the SysTick counter, wrapping around.\n
+ */
+static uint32_t schedulerMicros(void)
+{
+	uint32_t tick, count, reload;
+
+	// A tick interrupt between the two reads would pair a new count with the old tick
+	do
+	{
+		tick = HAL_GetTick();
+		count = SysTick->VAL;
+	}
+	while (tick != HAL_GetTick());
+
+	reload = (SysTick->LOAD & SysTick_LOAD_RELOAD_Msk) + 1;
+	return tick * 1000 + (uint32_t)((uint64_t)(reload - 1 - count) * 1000 / reload);
+}
+
+/**
+ * @brief Function checks if the period of a task has run out.\n
+ */
+static uint8_t schedulerDue(uint8_t i, uint32_t now)
+{
+	return schedulerTasks[i].period != 0 && (int32_t)(now - schedulerNext[i]) >= 0;
+}
+
+/**
+ * @brief Function takes the task table, index 0 has the highest priority.\n
+ */
+void schedulerInit(const SchedulerTask* tasks, uint8_t count)
+{
+	uint32_t now = HAL_GetTick();
+
+	// The cycle counter runs without a debugger attached once the trace block is on
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	schedulerTasks = tasks;
+	schedulerTaskCount = count < SCHEDULER_TASKS_MAX ? count : SCHEDULER_TASKS_MAX;
+	for (uint8_t i = 0; i < schedulerTaskCount; i++)
+	{
+		schedulerReleased[i] = 0;
+		schedulerNext[i] = now + schedulerTasks[i].period;
+	}
+	schedulerResetStats();
+}
+
+/**
+ * @brief Function runs the released task of the highest priority.\n
+ * 			Returns 1 if a task ran, 0 if none is released.
+ */
+uint8_t schedulerRun(void)
+{
+	uint32_t now = HAL_GetTick();
+	int8_t chosen = -1;
+	uint32_t start, start_us, runtime, duration, late, cycles_per_us;
+	SchedulerStats* stats;
+
+	for (uint8_t i = 0; i < schedulerTaskCount; i++)
+	{
+		const SchedulerTask* task = &schedulerTasks[i];
+
+		if (task->period == 0)
+		{
+			// Released while ready() holds, from the first pass it was seen ready
+			if (task->ready == NULL || !task->ready())
+				schedulerReleased[i] = 0;
+			else if (!schedulerReleased[i])
+			{
+				schedulerReleased[i] = 1;
+				schedulerRelease[i] = now;
+			}
+		}
+		else if (!schedulerReleased[i] && schedulerDue(i, now))
+		{
+			schedulerReleased[i] = 1;
+			schedulerRelease[i] = schedulerNext[i];
+			schedulerNext[i] += task->period;
+			// Periods missed while asleep or behind are skipped, not run back to back
+			if (schedulerDue(i, now))
+				schedulerNext[i] = now + task->period;
+		}
+		if (schedulerReleased[i] && chosen < 0)
+			chosen = i;
+	}
+	if (chosen < 0)
+		return 0;
+
+	schedulerReleased[chosen] = 0;
+	start_us = schedulerMicros();
+	start = DWT->CYCCNT;
+	schedulerTasks[chosen].run();
+	cycles_per_us = SystemCoreClock / 1000000;
+	runtime = (DWT->CYCCNT - start) / (cycles_per_us > 0 ? cycles_per_us : 1);
+	duration = schedulerMicros() - start_us;
+	late = HAL_GetTick() - schedulerRelease[chosen];
+
+	stats = &schedulerTaskStats[chosen];
+	stats->runs++;
+	stats->runtime += runtime;
+	if (duration > stats->runtime_max)
+		stats->runtime_max = duration;
+	if (late > stats->late_max)
+		stats->late_max = late;
+	if (schedulerTasks[chosen].deadline != 0 && late > schedulerTasks[chosen].deadline)
+		stats->misses++;
+	return 1;
+}
+
+/**
+ * @brief Function checks if a task would run, called with interrupts off before the main loop sleeps.\n
+ */
+uint8_t schedulerPending(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	for (uint8_t i = 0; i < schedulerTaskCount; i++)
+	{
+		const SchedulerTask* task = &schedulerTasks[i];
+
+		if (task->period == 0 ? (task->ready != NULL && task->ready()) : (schedulerReleased[i] || schedulerDue(i, now)))
+			return 1;
+	}
+	return 0;
+}
+
+uint8_t schedulerCount(void)
+{
+	return schedulerTaskCount;
+}
+
+const SchedulerTask* schedulerTask(uint8_t index)
+{
+	return index < schedulerTaskCount ? &schedulerTasks[index] : NULL;
+}
+
+const SchedulerStats* schedulerStats(uint8_t index)
+{
+	return index < schedulerTaskCount ? &schedulerTaskStats[index] : NULL;
+}
+
+/**
+ * @brief Function returns the ms the terminal was awake since the statistics were reset.\n
+ */
+uint32_t schedulerElapsed(void)
+{
+	return HAL_GetTick() - schedulerSince;
+}
+
+void schedulerResetStats(void)
+{
+	memset(schedulerTaskStats, 0, sizeof(schedulerTaskStats));
+	schedulerSince = HAL_GetTick();
+}
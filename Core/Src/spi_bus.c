@@ -0,0 +1,377 @@
+/**
+ ******************************************************************************
+  * @file    spi_bus.c
+  * @brief   Queued SPI1 transport shared by the SD card, MFRC522 and ILI9163
+  *          drivers.
+  ******************************************************************************
+  *
+  * The SD card, the RFID reader and the display share SPI1, so a transfer of
+  * one slave may only start when the previous one released its chip select.
+  * The queue keeps that order; the driver that submitted a transaction either
+  * waits for it or is told by its completion callback. The DMA interrupt only
+  * starts the next transaction if it is a DMA transfer too: one clocked by the
+  * CPU would wait on HAL_GetTick() there, which SysTick cannot advance. It is
+  * left to SPI_Bus_Wait() or SPI_Bus_Flush() in the thread that waits for it.
+  */
+
+#include <string.h>
+
+#include "spi_bus.h"
+
+#define SPI_BUS_TIMEOUT		100		// ms, polled transfers only
+
+static SPI_Transaction *queue_head;
+static SPI_Transaction *queue_tail;
+static SPI_Transaction *active;		// Owns the bus until its completion
+static volatile uint8_t deferred;	// active was handed the bus in the DMA interrupt and is not started yet
+
+static const uint8_t dummy_bytes[SPI_BUS_DMA_MIN_SIZE] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+/**
+ * @brief Removes the first transaction from the queue.
+ * @note  Must be called with interrupts disabled.
+ */
+static SPI_Transaction* SPI_Bus_Pop(void)
+{
+	SPI_Transaction *transaction = queue_head;
+
+	if (transaction != NULL)
+	{
+		queue_head = transaction->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+		transaction->next = NULL;
+	}
+	return transaction;
+}
+
+/**
+ * @brief Receives a block through the SPI FIFO, keeping the transmitter a few frames ahead of the receiver.
+ * @note  The HAL has set FRXTH for 8 bit frames, so RXNE is set for every byte.
+ */
+static HAL_StatusTypeDef SPI_Bus_ReceiveFifo(uint8_t *rx, uint16_t size)
+{
+	SPI_TypeDef *spi = hspi1.Instance;
+	__IO uint8_t *dr = (__IO uint8_t *)&spi->DR;
+	uint16_t sent = 0;
+	uint16_t received = 0;
+	uint32_t start = HAL_GetTick();
+
+	__HAL_SPI_ENABLE(&hspi1);
+	while (received < size)
+	{
+		if (sent < size && sent - received < SPI_BUS_FIFO_FRAMES && (spi->SR & SPI_SR_TXE))
+		{
+			*dr = 0xFF;
+			sent++;
+		}
+		if (spi->SR & SPI_SR_RXNE)
+		{
+			rx[received++] = *dr;
+		}
+		else if (HAL_GetTick() - start >= SPI_BUS_TIMEOUT)
+		{
+			return HAL_TIMEOUT;
+		}
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief Clocks a short transaction out with a single blocking HAL call.
+ */
+static HAL_StatusTypeDef SPI_Bus_Polled(SPI_Transaction *transaction)
+{
+	uint8_t *tx = (uint8_t *)transaction->tx_data;
+	uint8_t *rx = transaction->rx_data;
+	uint16_t size = transaction->size;
+
+	if (tx != NULL && rx != NULL)
+		return HAL_SPI_TransmitReceive(&hspi1, tx, rx, size, SPI_BUS_TIMEOUT);
+	if (tx != NULL)
+	{
+		while (HAL_SPI_Transmit(&hspi1, tx, size, SPI_BUS_TIMEOUT) == HAL_OK)
+		{
+			if (transaction->repeat == 0)
+				return HAL_OK;
+			transaction->repeat--;
+		}
+		return HAL_ERROR;
+	}
+	if (rx != NULL && transaction->polled)
+		return SPI_Bus_ReceiveFifo(rx, size);
+	if (rx != NULL)
+	{
+		// The transmitter always runs ahead of the receiver, so the buffer can hold the 0xFF filler
+		memset(rx, 0xFF, size);
+		return HAL_SPI_TransmitReceive(&hspi1, rx, rx, size, SPI_BUS_TIMEOUT);
+	}
+
+	// Clocks only
+	while (size > 0)
+	{
+		uint16_t chunk = size < sizeof(dummy_bytes) ? size : sizeof(dummy_bytes);
+
+		if (HAL_SPI_Transmit(&hspi1, (uint8_t *)dummy_bytes, chunk, SPI_BUS_TIMEOUT) != HAL_OK)
+			return HAL_ERROR;
+		size -= chunk;
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief Starts a DMA transfer; it completes in HAL_SPI_TxCpltCallback() or HAL_SPI_TxRxCpltCallback().
+ */
+static HAL_StatusTypeDef SPI_Bus_StartDma(SPI_Transaction *transaction)
+{
+	uint8_t *tx = (uint8_t *)transaction->tx_data;
+	uint8_t *rx = transaction->rx_data;
+
+	if (tx != NULL && rx != NULL)
+		return HAL_SPI_TransmitReceive_DMA(&hspi1, tx, rx, transaction->size);
+	if (tx != NULL)
+		return HAL_SPI_Transmit_DMA(&hspi1, tx, transaction->size);
+
+	memset(rx, 0xFF, transaction->size);
+	return HAL_SPI_TransmitReceive_DMA(&hspi1, rx, rx, transaction->size);
+}
+
+/**
+ * @brief Releases the slave, reports the result and hands the bus to the next transaction.
+ * @retval the next transaction to run, NULL if the queue is empty
+ */
+static SPI_Transaction* SPI_Bus_Finish(SPI_Transaction *transaction, HAL_StatusTypeDef status)
+{
+	SPI_Transaction *next;
+	uint32_t primask;
+
+	if (transaction->cs_port != NULL)
+		HAL_GPIO_WritePin(transaction->cs_port, transaction->cs_pin, GPIO_PIN_SET);
+
+	transaction->state = (status == HAL_OK) ? SPI_TRANSACTION_DONE : SPI_TRANSACTION_ERROR;
+	if (transaction->complete != NULL)
+		transaction->complete(transaction);
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	next = SPI_Bus_Pop();
+	active = next;
+	__set_PRIMASK(primask);
+
+	return next;
+}
+
+/**
+ * @brief Sets the prescaler of SPI1 to the fastest SCLK that is not above the given one.
+ */
+static void SPI_Bus_SetClock(uint32_t sclk)
+{
+	uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+	uint32_t br = 0;
+
+	if (sclk > SPI_BUS_SCLK_MAX)
+		sclk = SPI_BUS_SCLK_MAX;
+	// SCLK is PCLK2 / 2^(BR + 1), PCLK2 / 256 at the slowest
+	while (br < 7 && (pclk >> (br + 1)) > sclk)
+		br++;
+
+	// BR may only change while SPI1 is disabled, the next HAL call enables it again
+	if ((hspi1.Instance->CR1 & SPI_CR1_BR) != (br << SPI_CR1_BR_Pos))
+	{
+		__HAL_SPI_DISABLE(&hspi1);
+		MODIFY_REG(hspi1.Instance->CR1, SPI_CR1_BR, br << SPI_CR1_BR_Pos);
+	}
+}
+
+/**
+ * @brief Checks if a transaction is moved by DMA rather than clocked by the CPU.
+ */
+static uint8_t SPI_Bus_IsDma(const SPI_Transaction *transaction)
+{
+	return transaction->size >= SPI_BUS_DMA_MIN_SIZE && !transaction->polled
+		&& (transaction->tx_data != NULL || transaction->rx_data != NULL);
+}
+
+/**
+ * @brief Runs transactions until the queue is empty or a DMA transfer is in flight.
+ * @param from_isr 1: called by the DMA interrupt, a transaction clocked by the CPU is deferred to the thread
+ */
+static void SPI_Bus_Run(SPI_Transaction *transaction, uint8_t from_isr)
+{
+	while (transaction != NULL)
+	{
+		HAL_StatusTypeDef status;
+
+		if (from_isr && !SPI_Bus_IsDma(transaction))
+		{
+			deferred = 1;
+			return;
+		}
+
+		transaction->state = SPI_TRANSACTION_ACTIVE;
+		if (transaction->sclk != 0)
+			SPI_Bus_SetClock(transaction->sclk);
+		if (transaction->dc_port != NULL)
+			HAL_GPIO_WritePin(transaction->dc_port, transaction->dc_pin, transaction->dc_state);
+		if (transaction->cs_port != NULL)
+			HAL_GPIO_WritePin(transaction->cs_port, transaction->cs_pin, GPIO_PIN_RESET);
+
+		if (SPI_Bus_IsDma(transaction))
+		{
+			status = SPI_Bus_StartDma(transaction);
+			if (status == HAL_OK)
+				return;
+		}
+		else
+		{
+			status = SPI_Bus_Polled(transaction);
+		}
+
+		transaction = SPI_Bus_Finish(transaction, status);
+	}
+}
+
+/**
+ * @brief Queues a transaction and starts it if the bus is free.
+ * @note  The transaction and its buffers must stay valid until it completes. A transaction clocked by
+ *        the CPU that is queued behind a DMA transfer only starts in SPI_Bus_Wait() or SPI_Bus_Flush().
+ * @param transaction transaction to run
+ */
+void SPI_Bus_Submit(SPI_Transaction *transaction)
+{
+	uint32_t primask;
+	uint8_t start;
+
+	transaction->state = SPI_TRANSACTION_QUEUED;
+	transaction->next = NULL;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (queue_tail != NULL)
+		queue_tail->next = transaction;
+	else
+		queue_head = transaction;
+	queue_tail = transaction;
+
+	start = (active == NULL);
+	if (start)
+		active = SPI_Bus_Pop();
+	__set_PRIMASK(primask);
+
+	if (start)
+		SPI_Bus_Run(active, 0);
+}
+
+/**
+ * @brief Starts the transaction the DMA interrupt left to the thread, if there is one.
+ */
+static void SPI_Bus_RunDeferred(void)
+{
+	SPI_Transaction *transaction = NULL;
+	uint32_t primask;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (deferred)
+	{
+		deferred = 0;
+		transaction = active;
+	}
+	__set_PRIMASK(primask);
+
+	if (transaction != NULL)
+		SPI_Bus_Run(transaction, 0);
+}
+
+/**
+ * @brief Sleeps until the transaction has completed.
+ * @note  Must not be called from an interrupt handler.
+ * @param transaction submitted transaction
+ * @retval HAL_OK on success, HAL_ERROR otherwise
+ */
+HAL_StatusTypeDef SPI_Bus_Wait(SPI_Transaction *transaction)
+{
+	while (transaction->state == SPI_TRANSACTION_QUEUED || transaction->state == SPI_TRANSACTION_ACTIVE)
+	{
+		SPI_Bus_RunDeferred();
+		// Checked with interrupts off, so the completion cannot slip in before WFI
+		__disable_irq();
+		if ((transaction->state == SPI_TRANSACTION_QUEUED || transaction->state == SPI_TRANSACTION_ACTIVE) && !deferred)
+			__WFI();
+		__enable_irq();
+	}
+	return (transaction->state == SPI_TRANSACTION_DONE) ? HAL_OK : HAL_ERROR;
+}
+
+/**
+ * @brief Submits a transaction and waits for it.
+ * @param transaction transaction to run
+ * @retval HAL_OK on success, HAL_ERROR otherwise
+ */
+HAL_StatusTypeDef SPI_Bus_Transfer(SPI_Transaction *transaction)
+{
+	SPI_Bus_Submit(transaction);
+	return SPI_Bus_Wait(transaction);
+}
+
+/**
+ * @brief Waits until every submitted transaction has completed.
+ * @note  Used before a driver drives its chip select outside of the queue.
+ */
+void SPI_Bus_Flush(void)
+{
+	while (active != NULL)
+	{
+		SPI_Bus_RunDeferred();
+		__disable_irq();
+		if (active != NULL && !deferred)
+			__WFI();
+		__enable_irq();
+	}
+}
+
+/**
+ * @brief Checks if the bus is free.
+ * @retval 1 if no transaction is queued or running, 0 otherwise
+ */
+uint8_t SPI_Bus_IsIdle(void)
+{
+	return active == NULL;
+}
+
+/**
+ * @brief End of a DMA transfer, the HAL has already waited for the last byte to leave the shift register.
+ */
+static void SPI_Bus_DmaDone(SPI_HandleTypeDef *hspi, HAL_StatusTypeDef status)
+{
+	if (hspi != &hspi1 || active == NULL)
+		return;
+
+	// A repeated buffer is sent again while the slave is still selected
+	if (status == HAL_OK && active->repeat > 0 && active->rx_data == NULL)
+	{
+		active->repeat--;
+		if (SPI_Bus_StartDma(active) == HAL_OK)
+			return;
+		status = HAL_ERROR;
+	}
+	SPI_Bus_Run(SPI_Bus_Finish(active, status), 1);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	SPI_Bus_DmaDone(hspi, HAL_OK);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	SPI_Bus_DmaDone(hspi, HAL_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	SPI_Bus_DmaDone(hspi, HAL_ERROR);
+}
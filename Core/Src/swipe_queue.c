@@ -0,0 +1,70 @@
+/*
+ * swipe_queue.c
+ *
+ * A ring with one producer, which pushes, and one consumer, which peeks and
+ * pops. Each index is written by one side only, so neither side disables
+ * interrupts; the barrier makes a record complete before the index that
+ * hands it over.
+ */
+#include "stm32f3xx_hal.h"
+#include "swipe_queue.h"
+
+#if (SWIPE_QUEUE_SIZE & (SWIPE_QUEUE_SIZE - 1)) != 0
+#error "SWIPE_QUEUE_SIZE must be a power of 2"
+#endif
+
+static SwipeRecord swipeQueue[SWIPE_QUEUE_SIZE];
+static volatile uint8_t swipeQueueHead;		// Written by the producer only
+static volatile uint8_t swipeQueueTail;		// Written by the consumer only
+
+/**
+ * @brief Function queues a swipe, producer side.\n
+ * 			Returns 1 if the swipe was queued, 0 if the queue is full.
+ */
+uint8_t swipeQueuePush(const SwipeRecord* record)
+{
+	uint8_t head = swipeQueueHead;
+
+	if ((uint8_t)(head - swipeQueueTail) == SWIPE_QUEUE_SIZE)
+		return 0;
+
+	swipeQueue[head % SWIPE_QUEUE_SIZE] = *record;
+	__DMB();
+	swipeQueueHead = head + 1;
+	return 1;
+}
+
+/**
+ * @brief Function returns the oldest swipe without taking it, consumer side.\n
+ * 			Returns NULL if the queue is empty.
+ */
+const SwipeRecord* swipeQueuePeek(void)
+{
+	uint8_t tail = swipeQueueTail;
+
+	if (swipeQueueHead == tail)
+		return NULL;
+
+	__DMB();
+	return &swipeQueue[tail % SWIPE_QUEUE_SIZE];
+}
+
+/**
+ * @brief Function releases the swipe returned by swipeQueuePeek(), consumer side.\n
+ */
+void swipeQueuePop(void)
+{
+	uint8_t tail = swipeQueueTail;
+
+	if (swipeQueueHead == tail)
+		return;
+
+	// The record is read out before the producer may overwrite it
+	__DMB();
+	swipeQueueTail = tail + 1;
+}
+
+uint8_t swipeQueueCount(void)
+{
+	return (uint8_t)(swipeQueueHead - swipeQueueTail);
+}
@@ -0,0 +1,57 @@
+/*
+ * uid_table.c
+ *
+ * A UID is reduced to the 32 bit FNV-1a hash where only a key is stored, and
+ * a sorted table of entries is searched by bisection.
+ */
+#include "uid_table.h"
+
+/**
+ * @brief Function calculates the FNV-1a hash of a UID.\n
+ */
+uint32_t uidTableHash(const uint8_t* uid, uint8_t uid_len)
+{
+	uint32_t key = 2166136261UL;
+
+	while (uid_len--)
+	{
+		key ^= *uid++;
+		key *= 16777619UL;
+	}
+	return key;
+}
+
+/**
+ * @brief Function bisects a sorted table for a key.\n
+ * @param[in] table -> first entry
+ * @param[in] count -> number of entries
+ * @param[in] size -> bytes per entry
+ * @param[in] key -> key passed to compare
+ * @param[in] compare -> order of an entry against the key
+ * @param[out] found -> 1 if an entry matches the key
+ * @retval index of the entry, or of the entry the key would be inserted before
+ */
+uint16_t uidTableFind(const void* table, uint16_t count, uint16_t size, const void* key, UidTableCompare compare, uint8_t* found)
+{
+	const uint8_t* entries = table;
+	uint16_t low = 0;
+	uint16_t high = count;
+
+	*found = 0;
+	while (low < high)
+	{
+		uint16_t mid = (low + high) / 2;
+		int cmp = compare(entries + (uint32_t)mid * size, key);
+
+		if (cmp == 0)
+		{
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
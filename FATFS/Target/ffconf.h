@@ -77,6 +77,10 @@
 /* This option switches f_forward() function. (0:Disable or 1:Enable)
 /  To enable it, also _FS_TINY need to be set to 1. */
 
+#define _USE_EXPAND          1
+/* This option switches f_expand() function, back-ported from R0.12.
+/  (0:Disable or 1:Enable) */
+
 /*-----------------------------------------------------------------------------/
 / Locale and Namespace Configurations
 /-----------------------------------------------------------------------------*/
@@ -0,0 +1,347 @@
+/**
+ ******************************************************************************
+  * @file    sd_cache.c
+  * @brief   Write-back sector cache between user_diskio.c and the SPI SD card
+  *          driver.
+  ******************************************************************************
+  *
+  * FatFs writes the data sector, the FAT and the directory entry of an append
+  * one sector at a time, and every CMD24 waits for the card to finish
+  * programming. The cache keeps written sectors in RAM and writes them out
+  * in ascending order, adjacent ones in a single CMD25. A caller that takes
+  * care of the flush itself can leave the sectors in RAM past f_sync() with
+  * SD_Cache_DeferSync(): a sector that is rewritten before the flush, like the
+  * directory entry of the log file, reaches the card once.
+  *
+  * The cache is written out:
+  *  - by SD_Cache_Flush(), before the terminal goes to sleep,
+  *  - on CTRL_SYNC unless SD_Cache_DeferSync() is on,
+  *  - when a new sector needs a line and all lines are dirty,
+  *  - after SD_Cache_PowerFail(), by the main thread when it leaves the cache
+  *    or calls SD_Cache_Flush(); from then on every write goes straight to
+  *    the card. The PVD interrupt does not write itself: SysTick cannot run
+  *    there, so a card that stops answering would never time out.
+  */
+
+#include <string.h>
+
+#include "sd_cache.h"
+#include "user_diskio_spi.h"
+
+typedef struct
+{
+	DWORD sector;
+	uint32_t lastUse;
+	uint8_t valid;
+	uint8_t dirty;
+} SD_CacheLine;
+
+static SD_CacheLine lines[SD_CACHE_SECTORS];
+static BYTE lineData[SD_CACHE_SECTORS][512] __attribute__((aligned(4)));	// In SRAM, DMA cannot reach CCM RAM
+static uint32_t useCounter;
+
+static volatile uint8_t busy;			// The main thread is inside the cache or the driver
+static volatile uint8_t flushPending;	// Power failed, the main thread flushes
+static volatile uint8_t powerFailed;
+static uint8_t deferSync;				// CTRL_SYNC leaves the sectors in the cache
+static uint32_t dropped;				// Initializations that dropped dirty sectors
+
+/**
+ * @brief Finds the line that holds a sector.
+ * @retval the line, NULL if the sector is not cached
+ */
+static SD_CacheLine* SD_Cache_Find (DWORD sector)
+{
+	for (UINT i = 0; i < SD_CACHE_SECTORS; i++)
+	{
+		if (lines[i].valid && lines[i].sector == sector)
+			return &lines[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief Finds a line for a new sector: a free one, else the least recently used clean one.
+ * @retval the line, NULL if every line is dirty
+ */
+static SD_CacheLine* SD_Cache_Victim (void)
+{
+	SD_CacheLine *victim = NULL;
+
+	for (UINT i = 0; i < SD_CACHE_SECTORS; i++)
+	{
+		if (!lines[i].valid)
+			return &lines[i];
+		if (!lines[i].dirty && (victim == NULL || lines[i].lastUse < victim->lastUse))
+			victim = &lines[i];
+	}
+	return victim;
+}
+
+/**
+ * @brief Writes the dirty lines to the card in ascending sector order, runs of adjacent sectors by one command.
+ */
+static DRESULT SD_Cache_WriteBack (BYTE pdrv)
+{
+	const BYTE *blocks[SD_CACHE_SECTORS];
+	SD_CacheLine *run[SD_CACHE_SECTORS];
+
+	for (;;)
+	{
+		SD_CacheLine *first = NULL;
+		UINT count;
+
+		for (UINT i = 0; i < SD_CACHE_SECTORS; i++)
+		{
+			if (lines[i].dirty && (first == NULL || lines[i].sector < first->sector))
+				first = &lines[i];
+		}
+		if (first == NULL)
+			return RES_OK;
+
+		run[0] = first;
+		blocks[0] = lineData[first - lines];
+		for (count = 1; count < SD_CACHE_SECTORS; count++)
+		{
+			SD_CacheLine *next = SD_Cache_Find(first->sector + count);
+
+			if (next == NULL || !next->dirty)
+				break;
+			run[count] = next;
+			blocks[count] = lineData[next - lines];
+		}
+
+		if (USER_SPI_write_blocks(pdrv, blocks, first->sector, count) != RES_OK)
+			return RES_ERROR;
+		while (count--)
+			run[count]->dirty = 0;
+	}
+}
+
+/**
+ * @brief Drops every line, the card was replaced or initialized again.
+ */
+static void SD_Cache_Invalidate (void)
+{
+	uint8_t lost = 0;
+
+	for (UINT i = 0; i < SD_CACHE_SECTORS; i++)
+	{
+		lost |= lines[i].dirty;
+		lines[i].valid = 0;
+		lines[i].dirty = 0;
+	}
+	dropped += lost;
+}
+
+/**
+ * @brief Marks the main thread as using the SD card.
+ */
+static void SD_Cache_Enter (void)
+{
+	busy = 1;
+}
+
+/**
+ * @brief Ends the use of the SD card and does the flush the power failure asked for meanwhile.
+ */
+static void SD_Cache_Leave (BYTE pdrv)
+{
+	busy = 0;
+
+	if (flushPending)
+	{
+		busy = 1;
+		flushPending = 0;
+		SD_Cache_WriteBack(pdrv);
+		busy = 0;
+	}
+}
+
+/**
+ * @brief Initializes the card, whatever the cache held belongs to the previous one.
+ * @details Dirty sectors are dropped too, the card they were written for failed or was replaced;
+ * 			SD_Cache_Dropped() tells the caller.
+ */
+DSTATUS SD_Cache_Initialize (BYTE pdrv)
+{
+	DSTATUS stat;
+
+	SD_Cache_Enter();
+	SD_Cache_Invalidate();
+	stat = USER_SPI_initialize(pdrv);
+	SD_Cache_Leave(pdrv);
+	return stat;
+}
+
+/**
+ * @brief Gets the card status, the driver may ask the card with CMD13.
+ */
+DSTATUS SD_Cache_Status (BYTE pdrv)
+{
+	DSTATUS stat;
+
+	SD_Cache_Enter();
+	stat = USER_SPI_status(pdrv);
+	SD_Cache_Leave(pdrv);
+	return stat;
+}
+
+/**
+ * @brief Reads sectors, the cached ones come from RAM.
+ * @details A multi-sector read goes to the card in one command and the dirty cached sectors are copied over it.
+ * 			A single sector that was read is kept in a clean line if one is free.
+ */
+DRESULT SD_Cache_Read (BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+	SD_CacheLine *line;
+	DRESULT res = RES_OK;
+
+	SD_Cache_Enter();
+	if (count == 1 && (line = SD_Cache_Find(sector)) != NULL)
+	{
+		memcpy(buff, lineData[line - lines], 512);
+		line->lastUse = ++useCounter;
+	}
+	else
+	{
+		res = USER_SPI_read(pdrv, buff, sector, count);
+		if (res == RES_OK)
+		{
+			for (UINT i = 0; i < SD_CACHE_SECTORS; i++)
+			{
+				if (lines[i].dirty && lines[i].sector - sector < count)
+					memcpy(buff + (lines[i].sector - sector) * 512, lineData[i], 512);
+			}
+
+			if (count == 1 && (line = SD_Cache_Victim()) != NULL)
+			{
+				memcpy(lineData[line - lines], buff, 512);
+				line->sector = sector;
+				line->valid = 1;
+				line->dirty = 0;
+				line->lastUse = ++useCounter;
+			}
+		}
+	}
+	SD_Cache_Leave(pdrv);
+	return res;
+}
+
+#if _USE_WRITE == 1
+/**
+ * @brief Writes sectors into the cache.
+ * @details Writes of as many sectors as the cache holds go to the card directly, after the cached copies
+ * 			are dropped. After a power failure every write goes to the card.
+ */
+DRESULT SD_Cache_Write (BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+	DRESULT res = RES_OK;
+
+	SD_Cache_Enter();
+	if (count >= SD_CACHE_SECTORS || powerFailed)
+	{
+		for (UINT i = 0; i < SD_CACHE_SECTORS; i++)
+		{
+			if (lines[i].valid && lines[i].sector - sector < count)
+				lines[i].valid = lines[i].dirty = 0;
+		}
+		res = USER_SPI_write(pdrv, buff, sector, count);
+	}
+	else
+	{
+		for (; count > 0 && res == RES_OK; count--, sector++, buff += 512)
+		{
+			SD_CacheLine *line = SD_Cache_Find(sector);
+
+			if (line == NULL && (line = SD_Cache_Victim()) == NULL)
+			{
+				res = SD_Cache_WriteBack(pdrv);
+				line = SD_Cache_Victim();
+			}
+			if (res == RES_OK)
+			{
+				memcpy(lineData[line - lines], buff, 512);
+				line->sector = sector;
+				line->valid = 1;
+				line->dirty = 1;
+				line->lastUse = ++useCounter;
+			}
+		}
+	}
+	SD_Cache_Leave(pdrv);
+	return res;
+}
+
+/**
+ * @brief Writes the dirty sectors to the card.
+ * @note  Called before the terminal sleeps, so a swipe is on the card a few seconds after it was made.
+ */
+DRESULT SD_Cache_Flush (BYTE pdrv)
+{
+	DRESULT res;
+
+	SD_Cache_Enter();
+	flushPending = 0;
+	res = SD_Cache_WriteBack(pdrv);
+	SD_Cache_Leave(pdrv);
+	return res;
+}
+
+/**
+ * @brief Lets CTRL_SYNC leave the sectors in the cache, for a caller that calls SD_Cache_Flush() itself.
+ * @param defer 1: f_sync() keeps the sectors in RAM, 0: f_sync() writes them to the card
+ */
+void SD_Cache_DeferSync (uint8_t defer)
+{
+	deferSync = defer;
+}
+
+/**
+ * @brief Asks for the cache to be written out while the supply still holds, called from the PVD interrupt.
+ * @details The main thread writes it, when it leaves the cache or by SD_Cache_Flush() as soon as
+ * 			SD_Cache_FlushPending() tells it to.
+ */
+void SD_Cache_PowerFail (void)
+{
+	powerFailed = 1;
+	flushPending = 1;
+}
+
+/**
+ * @brief Counts the initializations that dropped sectors not yet on the card, the writes since the last
+ * 			successful SD_Cache_Flush() are lost when it changes.
+ */
+uint32_t SD_Cache_Dropped (void)
+{
+	return dropped;
+}
+
+/**
+ * @brief Checks if a power failure asked for the cache to be written out.
+ */
+uint8_t SD_Cache_FlushPending (void)
+{
+	return flushPending;
+}
+#endif /* _USE_WRITE == 1 */
+
+#if _USE_IOCTL == 1
+/**
+ * @brief Drive controls, CTRL_SYNC writes the cache out unless the flush is deferred.
+ */
+DRESULT SD_Cache_Ioctl (BYTE pdrv, BYTE cmd, void *buff)
+{
+	DRESULT res = RES_OK;
+
+	SD_Cache_Enter();
+#if _USE_WRITE == 1
+	if (cmd == CTRL_SYNC && (!deferSync || powerFailed))
+		res = SD_Cache_WriteBack(pdrv);
+#endif
+	if (res == RES_OK)
+		res = USER_SPI_ioctl(pdrv, cmd, buff);
+	SD_Cache_Leave(pdrv);
+	return res;
+}
+#endif /* _USE_IOCTL == 1 */
@@ -0,0 +1,33 @@
+/**
+ ******************************************************************************
+  * @file    sd_cache.h
+  * @brief   Write-back sector cache between user_diskio.c and the SPI SD card
+  *          driver.
+  ******************************************************************************
+  */
+
+#ifndef _SD_CACHE_H
+#define _SD_CACHE_H
+
+#include "integer.h" //from FatFs middleware library
+#include "diskio.h" //from FatFs middleware library
+
+// Sectors held in RAM, 512 bytes each; adjacent dirty sectors are written by one CMD25
+#define SD_CACHE_SECTORS	4
+
+DSTATUS SD_Cache_Initialize (BYTE pdrv);
+DSTATUS SD_Cache_Status (BYTE pdrv);
+DRESULT SD_Cache_Read (BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
+#if _USE_WRITE == 1
+  DRESULT SD_Cache_Write (BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+  DRESULT SD_Cache_Flush (BYTE pdrv);
+  void SD_Cache_DeferSync (uint8_t defer);
+  void SD_Cache_PowerFail (void);
+  uint8_t SD_Cache_FlushPending (void);
+  uint32_t SD_Cache_Dropped (void);
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+  DRESULT SD_Cache_Ioctl (BYTE pdrv, BYTE cmd, void *buff);
+#endif /* _USE_IOCTL == 1 */
+
+#endif
@@ -36,6 +36,7 @@
 #include <string.h>
 #include "ff_gen_drv.h"
 #include "user_diskio_spi.h"
+#include "sd_cache.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -82,7 +83,7 @@ DSTATUS USER_initialize (
 )
 {
   /* USER CODE BEGIN INIT */
-    return USER_SPI_initialize(pdrv);
+    return SD_Cache_Initialize(pdrv);
   /* USER CODE END INIT */
 }
 
@@ -96,7 +97,7 @@ DSTATUS USER_status (
 )
 {
   /* USER CODE BEGIN STATUS */
-    return USER_SPI_status(pdrv);
+    return SD_Cache_Status(pdrv);
   /* USER CODE END STATUS */
 }
 
@@ -116,7 +117,7 @@ DRESULT USER_read (
 )
 {
   /* USER CODE BEGIN READ */
-    return USER_SPI_read(pdrv, buff, sector, count);
+    return SD_Cache_Read(pdrv, buff, sector, count);
   /* USER CODE END READ */
 }
 
@@ -138,7 +139,7 @@ DRESULT USER_write (
 {
   /* USER CODE BEGIN WRITE */
   /* USER CODE HERE */
-    return USER_SPI_write(pdrv, buff, sector, count);
+    return SD_Cache_Write(pdrv, buff, sector, count);
   /* USER CODE END WRITE */
 }
 #endif /* _USE_WRITE == 1 */
@@ -158,7 +159,7 @@ DRESULT USER_ioctl (
 )
 {
   /* USER CODE BEGIN IOCTL */
-    return USER_SPI_ioctl(pdrv, cmd, buff);
+    return SD_Cache_Ioctl(pdrv, cmd, buff);
   /* USER CODE END IOCTL */
 }
 #endif /* _USE_IOCTL == 1 */
@@ -26,6 +26,7 @@
 
 #include "stm32f3xx_hal.h" /* Provide the low-level HAL functions */
 #include "user_diskio_spi.h"
+#include "spi_bus.h"
 
 //Make sure you set #define SD_SPI_HANDLE as some hspix in main.h
 //Make sure you set #define SD_CS_GPIO_Port as some GPIO port in main.h
@@ -34,12 +35,13 @@ extern SPI_HandleTypeDef SD_SPI_HANDLE;
 
 /* Function prototypes */
 
-//(Note that the _256 is used as a mask to clear the prescalar bits as it provides binary 111 in the correct position)
-#define FCLK_SLOW() { MODIFY_REG(SD_SPI_HANDLE.Instance->CR1, SPI_BAUDRATEPRESCALER_256, SPI_BAUDRATEPRESCALER_128); }	/* Set SCLK = slow, approx 280 KBits/s*/
-#define FCLK_FAST() { MODIFY_REG(SD_SPI_HANDLE.Instance->CR1, SPI_BAUDRATEPRESCALER_256, SPI_BAUDRATEPRESCALER_8); }	/* Set SCLK = fast, approx 4.5 MBits/s */
+//The SCLK is set by the bus for every transaction of the card, the other slaves keep their own
+static uint32_t sdSclk = SD_SCLK_SLOW;
+#define FCLK_SLOW() { sdSclk = SD_SCLK_SLOW; }	/* Set SCLK = slow, at most 400 kHz */
+#define FCLK_FAST() { sdSclk = SD_SCLK_FAST; }	/* Set SCLK = fast */
 
 #define CS_HIGH()	{HAL_GPIO_WritePin(SD_CS_GPIO_Port, SD_CS_Pin, GPIO_PIN_SET);}
-#define CS_LOW()	{HAL_GPIO_WritePin(SD_CS_GPIO_Port, SD_CS_Pin, GPIO_PIN_RESET);}
+#define CS_LOW()	{SPI_Bus_Flush(); HAL_GPIO_WritePin(SD_CS_GPIO_Port, SD_CS_Pin, GPIO_PIN_RESET);}
 
 /*--------------------------------------------------------------------------
 
@@ -55,6 +57,7 @@ extern SPI_HandleTypeDef SD_SPI_HANDLE;
 #define CMD9	(9)			/* SEND_CSD */
 #define CMD10	(10)		/* SEND_CID */
 #define CMD12	(12)		/* STOP_TRANSMISSION */
+#define CMD13	(13)		/* SEND_STATUS */
 #define ACMD13	(0x80+13)	/* SD_STATUS (SDC) */
 #define CMD16	(16)		/* SET_BLOCKLEN */
 #define CMD17	(17)		/* READ_SINGLE_BLOCK */
@@ -83,6 +86,11 @@ DSTATUS Stat = STA_NOINIT;	/* Physical drive status */
 static
 BYTE CardType;			/* Card type flags */
 
+#define STATUS_PROBE_MS	200	/* Card presence is checked again after this much silence */
+
+static
+uint32_t lastResponseTick;	/* HAL tick of the last command the card answered */
+
 uint32_t spiTimerTickStart;
 uint32_t spiTimerTickDelay;
 
@@ -108,7 +116,7 @@ uint8_t SPI_Timer_Status() {
 /* Exchange a byte */
 /**
  * @brief Function is used to transmit a single byte over SPI.\n
- * @details Function is using  HAL_SPI_TransmitReceive to send data over SPI and read data that is sent back.\n
+ * @details Function runs a one byte transaction on the shared SPI bus and reads the data that is sent back.\n
  * 			This is useful for SD card communication that needs to start by sending a command to SD card and reading the SD cards response.\n
  * @param[in] dat -> data that is send over SPI
  */
@@ -116,15 +124,23 @@ static BYTE transmitByte (
 	BYTE dat	/* Data to send */
 )
 {
-	BYTE rxDat;
-    HAL_SPI_TransmitReceive(&SD_SPI_HANDLE, &dat, &rxDat, 1, 50);
-    return rxDat;
+	BYTE rxDat = 0xFF;
+	SPI_Transaction transaction = {0};
+
+	// CS is driven by the driver, it stays low for the whole command
+	transaction.tx_data = &dat;
+	transaction.rx_data = &rxDat;
+	transaction.size = 1;
+	transaction.sclk = sdSclk;
+	SPI_Bus_Transfer(&transaction);
+	return rxDat;
 }
 
 
 /* Receive multiple byte */
 /**
  * @brief Function is used to receive multiple bytes over SPI and stores them in a buffer.\n
+ * @details The whole block is one transaction that clocks out 0xFF, moved by DMA or by the CPU through the SPI FIFO (SD_SPI_RX_DMA).\n
  * @param[in] buff -> buffer used to store the read data
  * @param[in] btr -> number of bytes to receive
  */
@@ -133,15 +149,20 @@ static void recieveMultiByte (
 	UINT btr		/* Number of bytes to receive (even number) */
 )
 {
-	for(UINT i=0; i<btr; i++) {
-		*(buff+i) = transmitByte(0xFF);
-	}
+	SPI_Transaction transaction = {0};
+
+	transaction.rx_data = buff;
+	transaction.size = btr;
+	transaction.polled = !SD_SPI_RX_DMA;
+	transaction.sclk = sdSclk;
+	SPI_Bus_Transfer(&transaction);
 }
 
 
 #if _USE_WRITE
 /**
  * @brief Function is used to transmit multiple bytes over SPI to SD card.\n
+ * @details Data blocks are long enough to be moved by DMA, the CPU sleeps until the transfer is done.\n
  * @param[in] buff -> data that is send over SPI
  * @param[in] btx -> number of bytes to send
  */
@@ -150,7 +171,12 @@ static void transmitMultiByte (
 	UINT btx			/* Number of bytes to send (even number) */
 )
 {
-	HAL_SPI_Transmit(&SD_SPI_HANDLE, buff, btx, HAL_MAX_DELAY);
+	SPI_Transaction transaction = {0};
+
+	transaction.tx_data = buff;
+	transaction.size = btx;
+	transaction.sclk = sdSclk;
+	SPI_Bus_Transfer(&transaction);
 }
 #endif
 
@@ -248,6 +274,7 @@ static int recieveDatablock (	/* 1:OK, 0:Error */
 	)
 {
 	BYTE token;
+	BYTE crc[2];
 
 
 	SPI_Timer_On(200);
@@ -258,7 +285,7 @@ static int recieveDatablock (	/* 1:OK, 0:Error */
 	if(token != 0xFE) return 0;		/* Function fails if invalid DataStart token or timeout */
 
 	recieveMultiByte(buff, btr);		/* Store trailing data to the buffer */
-	transmitByte(0xFF); transmitByte(0xFF);			/* Discard CRC */
+	recieveMultiByte(crc, 2);			/* Discard CRC */
 
 	return 1;						/* Function succeeded */
 }
@@ -379,6 +406,8 @@ static BYTE sendCommandToSD (		/* Return value: R1 resp (bit7==1:Failed to send)
 		res = transmitByte(0xFF);
 	} while ((res & 0x80) && --n);
 
+	if (!(res & 0x80)) lastResponseTick = HAL_GetTick();
+
 	return res;							/* Return received response */
 }
 
@@ -466,6 +495,9 @@ inline DSTATUS USER_SPI_initialize (
 /*-----------------------------------------------------------------------*/
 /**
  * @brief Function used to get the disk status of a drive (SD).
+ * @details The socket has no card detect switch. If the card has not answered a command for STATUS_PROBE_MS,
+ * 			it is asked for its status with CMD13. A card that does not answer, or answers in idle state because
+ * 			it was replaced, sets STA_NOINIT, so the next mount initializes the card again.\n
  */
 inline DSTATUS USER_SPI_status (
 	BYTE drv		/* Physical drive number (0) */
@@ -473,6 +505,15 @@ inline DSTATUS USER_SPI_status (
 {
 	if (drv) return STA_NOINIT;		/* Supports only drive 0 */
 
+	if (!(Stat & STA_NOINIT) && HAL_GetTick() - lastResponseTick >= STATUS_PROBE_MS) {
+		if (sendCommandToSD(CMD13, 0) == 0) {
+			transmitByte(0xFF);		/* Second byte of the R2 resp */
+		} else {
+			Stat |= STA_NOINIT;		/* Removed or replaced */
+		}
+		SPI_deselectSlave();
+	}
+
 	return Stat;	/* Return disk status */
 }
 
@@ -569,6 +610,41 @@ inline DRESULT USER_SPI_write (
 #endif
 
 
+#if _USE_WRITE
+/**
+ * @brief Function used by the sector cache to write consecutive sectors held in separate buffers.
+ * @details Same as USER_SPI_write(), but every sector comes from its own 512 byte buffer,
+ * 			so the cached sectors are written by one CMD25 without copying them together first.\n
+ */
+inline DRESULT USER_SPI_write_blocks (
+	BYTE drv,					/* Physical drive number (0) */
+	const BYTE *const *blocks,	/* Pointers to the sectors to write */
+	DWORD sector,				/* Start sector number (LBA) */
+	UINT count					/* Number of sectors to write (1..128) */
+)
+{
+	if (drv || !count) return RES_PARERR;		/* Check parameter */
+	if (Stat & STA_NOINIT) return RES_NOTRDY;	/* Check drive status */
+	if (Stat & STA_PROTECT) return RES_WRPRT;	/* Check write protect */
+
+	if (count == 1) return USER_SPI_write(drv, blocks[0], sector, 1);
+
+	if (!(CardType & CT_BLOCK)) sector *= 512;	/* LBA ==> BA conversion (byte addressing cards) */
+
+	if (CardType & CT_SDC) sendCommandToSD(ACMD23, count);	/* Predefine number of sectors */
+	if (sendCommandToSD(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
+		do {
+			if (!transmitDatablock(*blocks++, 0xFC)) break;
+		} while (--count);
+		if (!transmitDatablock(0, 0xFD)) count = 1;	/* STOP_TRAN token */
+	}
+	SPI_deselectSlave();
+
+	return count ? RES_ERROR : RES_OK;	/* Return result */
+}
+#endif
+
+
 /*-----------------------------------------------------------------------*/
 /* Miscellaneous drive controls other than data read/write               */
 /*-----------------------------------------------------------------------*/
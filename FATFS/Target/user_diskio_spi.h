@@ -22,6 +22,15 @@
 #include "diskio.h" //from FatFs middleware library
 #include "ff_gen_drv.h" //from FatFs middleware library
 
+//Data blocks are received by DMA while the CPU sleeps; 0 clocks them through the SPI FIFO by the CPU instead
+#ifndef SD_SPI_RX_DMA
+#define SD_SPI_RX_DMA 1
+#endif
+
+//SCLK in Hz while the card is identified (at most 400 kHz) and afterwards, limited by SPI_BUS_SCLK_MAX
+#define SD_SCLK_SLOW 400000U
+#define SD_SCLK_FAST 25000000U
+
 //we define these as inline because we don't want them to be actual function calls (they get "called" from the cubemx autogenerated user_diskio file)
 //we define them as extern because they are defined in a separate .c file to user_diskio.c (which #includes this .h file)
 
@@ -30,6 +39,7 @@ extern DSTATUS USER_SPI_status (BYTE pdrv);
 extern DRESULT USER_SPI_read (BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
 #if _USE_WRITE == 1
   extern DRESULT USER_SPI_write (BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+  extern DRESULT USER_SPI_write_blocks (BYTE pdrv, const BYTE *const *blocks, DWORD sector, UINT count);
 #endif /* _USE_WRITE == 1 */
 #if _USE_IOCTL == 1
   extern DRESULT USER_SPI_ioctl (BYTE pdrv, BYTE cmd, void *buff);
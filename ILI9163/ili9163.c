@@ -19,18 +19,51 @@
 
 #include "ili9163.h"
 #include "font.h"
+#include "spi_bus.h"
 
 #include <string.h>
 
+#define LCD_WIDTH			128
+#define LCD_HEIGHT			128
+
+#define LCD_TEXT_COLOURS	8	// Colour pairs that can be on the screen at once
+
+// One display line of RGB565 pixels, the source of every burst write
+static uint8_t lcdLineBuffer[LCD_WIDTH * 2];
+
+// Character cell of the text layer
+typedef struct
+{
+	uint8_t character;
+	uint8_t colours;	// Index to lcdTextPalette
+} LcdTextCell;
+
+static LcdTextCell lcdTextFrame[LCD_TEXT_ROWS][LCD_TEXT_COLUMNS];	// Text to be shown
+static LcdTextCell lcdTextShown[LCD_TEXT_ROWS][LCD_TEXT_COLUMNS];	// Text on the screen
+static uint16_t lcdTextPalette[LCD_TEXT_COLOURS][2];					// Foreground, background
+static uint8_t lcdTextPaletteSize;
+
 /**
- * @brief Function is used to register a callback to transmit function for SPI communication - separation of software and hardware parts\n
+ * @brief Function is used to send bytes to the display through the shared SPI bus.\n
+ * @param[in] dc -> GPIO_PIN_RESET for a command, GPIO_PIN_SET for parameters and data
+ * @param[in] repeat -> how many more times the data is sent while the display stays selected
 */
-void ILI9163_RegisterCallback(uint8_t *callback1) {
-
-	if(callback1 != 0){
-		ILI9163_SPI_TransmitData = callback1;
-	}
+static void lcdTransfer(GPIO_PinState dc, const uint8_t *data, uint16_t size, uint16_t repeat)
+{
+	SPI_Transaction transaction = {0};
+
+	transaction.cs_port = DISPLAY_CS_PIN_GPIO_Port;
+	transaction.cs_pin = DISPLAY_CS_PIN_Pin;
+	transaction.dc_port = DISPLAY_CD_PIN_GPIO_Port;
+	transaction.dc_pin = DISPLAY_CD_PIN_Pin;
+	transaction.dc_state = dc;
+	transaction.tx_data = data;
+	transaction.size = size;
+	transaction.repeat = repeat;
+	transaction.sclk = LCD_SCLK_MAX;
+	SPI_Bus_Transfer(&transaction);
 }
+
 /**
  * @brief Function is used to reset the display hardware\n
 */
@@ -48,10 +81,7 @@ void lcdReset(void)
 */
 void lcdWriteCommand(uint8_t address)
 {
-	HAL_GPIO_WritePin(DISPLAY_CD_PIN_GPIO_Port, DISPLAY_CD_PIN_Pin, GPIO_PIN_RESET);
-	HAL_GPIO_WritePin(DISPLAY_CS_PIN_GPIO_Port, DISPLAY_CS_PIN_Pin, GPIO_PIN_RESET);
-	ILI9163_SPI_TransmitData(&SD_SPI_HANDLE, &address, 1);
-	HAL_GPIO_WritePin(DISPLAY_CS_PIN_GPIO_Port, DISPLAY_CS_PIN_Pin, GPIO_PIN_SET);
+	lcdTransfer(GPIO_PIN_RESET, &address, 1, 0);
 }
 
 /**
@@ -60,10 +90,7 @@ void lcdWriteCommand(uint8_t address)
 */
 void lcdWriteParameter(uint8_t parameter)
 {
-	HAL_GPIO_WritePin(DISPLAY_CD_PIN_GPIO_Port, DISPLAY_CD_PIN_Pin, GPIO_PIN_SET);
-	HAL_GPIO_WritePin(DISPLAY_CS_PIN_GPIO_Port, DISPLAY_CS_PIN_Pin, GPIO_PIN_RESET);
-	ILI9163_SPI_TransmitData(&SD_SPI_HANDLE, &parameter, 1);
-	HAL_GPIO_WritePin(DISPLAY_CS_PIN_GPIO_Port, DISPLAY_CS_PIN_Pin, GPIO_PIN_SET);
+	lcdTransfer(GPIO_PIN_SET, &parameter, 1, 0);
 }
 
 /**
@@ -72,11 +99,55 @@ void lcdWriteParameter(uint8_t parameter)
 */
 void lcdWriteData(uint8_t dataByte1, uint8_t dataByte2)
 {
-	HAL_GPIO_WritePin(DISPLAY_CD_PIN_GPIO_Port, DISPLAY_CD_PIN_Pin, GPIO_PIN_SET);
-	HAL_GPIO_WritePin(DISPLAY_CS_PIN_GPIO_Port, DISPLAY_CS_PIN_Pin, GPIO_PIN_RESET);
-	ILI9163_SPI_TransmitData(&SD_SPI_HANDLE, &dataByte1, 1);
-	ILI9163_SPI_TransmitData(&SD_SPI_HANDLE, &dataByte2, 1);
-	HAL_GPIO_WritePin(DISPLAY_CS_PIN_GPIO_Port, DISPLAY_CS_PIN_Pin, GPIO_PIN_SET);
+	uint8_t data[2] = { dataByte1, dataByte2 };
+
+	lcdTransfer(GPIO_PIN_SET, data, 2, 0);
+}
+
+
+/**
+ * @brief The function is used to select the area written by the following pixel data and start the memory write.\n
+ *  @param[in] x0, y0 -> top left corner
+ *  @param[in] x1, y1 -> bottom right corner, inclusive
+*/
+static void lcdSetWindow(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1)
+{
+	uint8_t column[4] = { 0x00, x0, 0x00, x1 };
+	uint8_t page[4] = { 0x00, y0, 0x00, y1 };
+
+	lcdWriteCommand(SET_COLUMN_ADDRESS);
+	lcdTransfer(GPIO_PIN_SET, column, sizeof(column), 0);
+
+	lcdWriteCommand(SET_PAGE_ADDRESS);
+	lcdTransfer(GPIO_PIN_SET, page, sizeof(page), 0);
+
+	lcdWriteCommand(WRITE_MEMORY_START);
+}
+
+/**
+ * @brief The function is used to write the same colour to a number of pixels of the current window.\n
+ * @details The line buffer is filled with the colour once and then streamed repeatedly with the display selected,
+ * 			so a full screen takes one burst instead of a transfer per pixel.\n
+ *  @param[in] colour -> colour
+ *  @param[in] pixels -> number of pixels
+*/
+static void lcdFill(uint16_t colour, uint32_t pixels)
+{
+	uint16_t chunk = (pixels < LCD_WIDTH) ? pixels : LCD_WIDTH;
+	uint16_t i;
+
+	if (chunk == 0)
+		return;
+
+	for (i = 0; i < chunk; i++)
+	{
+		lcdLineBuffer[2 * i] = colour >> 8;
+		lcdLineBuffer[2 * i + 1] = colour;
+	}
+
+	lcdTransfer(GPIO_PIN_SET, lcdLineBuffer, chunk * 2, pixels / chunk - 1);
+	if (pixels % chunk)
+		lcdTransfer(GPIO_PIN_SET, lcdLineBuffer, (pixels % chunk) * 2, 0);
 }
 
 
@@ -185,28 +256,12 @@ void lcdInitialise(uint8_t orientation)
 */
 void lcdClearDisplay(uint16_t colour)
 {
-	uint16_t pixel;
-
-	// Set the column address to 0-127
-	lcdWriteCommand(SET_COLUMN_ADDRESS);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x7f);
-
-	// Set the page address to 0-127
-	lcdWriteCommand(SET_PAGE_ADDRESS);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x7f);
+	lcdSetWindow(0, 0, LCD_WIDTH - 1, LCD_HEIGHT - 1);
+	lcdFill(colour, (uint32_t)LCD_WIDTH * LCD_HEIGHT);
 
-	// Plot the pixels
-	lcdWriteCommand(WRITE_MEMORY_START);
-	for(pixel = 0; pixel < 16385; pixel++)
-	{
-		lcdWriteData(colour >> 8, colour);
-	}
+	// The text layer now knows the screen holds only spaces
+	lcdTextClear(colour);
+	memcpy(lcdTextShown, lcdTextFrame, sizeof(lcdTextShown));
 }
 
 /**
@@ -327,28 +382,10 @@ void lcdRectangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t colou
 */
 void lcdFilledRectangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t colour)
 {
-	uint16_t pixels;
-
-	// To speed up plotting we define a x window with the width of the
-	// rectangle and then just output the required number of bytes to
-	// fill down to the end point
-
-	lcdWriteCommand(SET_COLUMN_ADDRESS); // Horizontal Address Start Position
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(x0);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(x1);
-
-	lcdWriteCommand(SET_PAGE_ADDRESS); // Vertical Address end Position
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(y0);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(y1);
-
-	lcdWriteCommand(WRITE_MEMORY_START);
-
-	for (pixels = 0; pixels < ((x1 - x0) * (y1 - y0)); pixels++)
-		lcdWriteData(colour >> 8, colour);;
+	// To speed up plotting we define a window with the size of the
+	// rectangle and then just stream the colour until it is full
+	lcdSetWindow(x0, y0, x1, y1);
+	lcdFill(colour, (uint32_t)(x1 - x0 + 1) * (y1 - y0 + 1));
 }
 
 /**
@@ -401,24 +438,12 @@ void lcdCircle(int16_t xCentre, int16_t yCentre, int16_t radius, uint16_t colour
 void lcdPutCh(unsigned char character, uint8_t x, uint8_t y, uint16_t fgColour, uint16_t bgColour)
 {
 	uint8_t row, column;
+	uint8_t *pixel = lcdLineBuffer;
 
-	// To speed up plotting we define a x window of 6 pixels and then
-	// write out one row at a time.  This means the LCD will correctly
-	// update the memory pointer saving us a good few bytes
-
-	lcdWriteCommand(SET_COLUMN_ADDRESS); // Horizontal Address Start Position
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(x);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(x+5);
-
-	lcdWriteCommand(SET_PAGE_ADDRESS); // Vertical Address end Position
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(y);
-	lcdWriteParameter(0x00);
-	lcdWriteParameter(0x7f);
-
-	lcdWriteCommand(WRITE_MEMORY_START);
+	// To speed up plotting we define a x window of 6 pixels, render the
+	// whole glyph into the line buffer row by row and send it at once.
+	// The LCD moves its memory pointer to the next row by itself
+	lcdSetWindow(x, y, x + 5, LCD_HEIGHT - 1);
 
 	// Plot the font data
 	for (row = 0; row < 8; row++)
@@ -426,11 +451,14 @@ void lcdPutCh(unsigned char character, uint8_t x, uint8_t y, uint16_t fgColour,
 		for (column = 0; column < 6; column++)
 		{
 			//if ((font5x8[character][column]) & (1 << row))
-			if ((fontus[character][column]) & (1 << row))
-				lcdWriteData(fgColour>>8, fgColour);
-			else lcdWriteData(bgColour >> 8, bgColour);
+			uint16_t colour = ((fontus[character][column]) & (1 << row)) ? fgColour : bgColour;
+
+			*pixel++ = colour >> 8;
+			*pixel++ = colour;
 		}
 	}
+
+	lcdTransfer(GPIO_PIN_SET, lcdLineBuffer, pixel - lcdLineBuffer, 0);
 }
 
 /**
@@ -488,4 +516,189 @@ void lcdPutS(const char *string, uint8_t x, uint8_t y, uint16_t fgColour, uint16
 }
 
 
+// LCD text layer -------------------------------------------------------------------------------------------
+
+/**
+ * @brief The function is used to find a colour pair no text cell uses.
+
+ *  @param[in] keep -> index that must not be reused, LCD_TEXT_COLOURS for none
+ *  @param[in] shown -> 1: the cells on the screen count too, 0: only the cells to be shown
+ *  @return index of the pair, LCD_TEXT_COLOURS if all are used
+*/
+static uint8_t lcdTextColoursFree(uint8_t keep, uint8_t shown)
+{
+	uint16_t used = 0;
+	uint16_t cell;
+	uint8_t index;
+
+	for (cell = 0; cell < LCD_TEXT_ROWS * LCD_TEXT_COLUMNS; cell++)
+	{
+		used |= 1U << (&lcdTextFrame[0][0])[cell].colours;
+		if (shown)
+			used |= 1U << (&lcdTextShown[0][0])[cell].colours;
+	}
+
+	for (index = 0; index < LCD_TEXT_COLOURS; index++)
+	{
+		if (index != keep && !(used & (1U << index)))
+			return index;
+	}
+	return LCD_TEXT_COLOURS;
+}
+
+/**
+ * @brief The function is used to find the palette index of a colour pair, adding the pair if it is new.
+
+ * @note  With all LCD_TEXT_COLOURS pairs taken, a pair that is only left on the screen is replaced and its
+ * 		  cells are drawn again by the next lcdTextUpdate(). If the text to be shown uses them all, a pair with
+ * 		  the same background is returned instead, so text already placed never changes its colours.
+ *  @param[in] keep -> index that must not be reused, LCD_TEXT_COLOURS for none
+*/
+static uint8_t lcdTextColours(uint16_t fgColour, uint16_t bgColour, uint8_t keep)
+{
+	LcdTextCell *shown = &lcdTextShown[0][0];
+	uint16_t cell;
+	uint8_t index;
+
+	for (index = 0; index < lcdTextPaletteSize; index++)
+	{
+		if (lcdTextPalette[index][0] == fgColour && lcdTextPalette[index][1] == bgColour)
+			return index;
+	}
+
+	if (lcdTextPaletteSize < LCD_TEXT_COLOURS)
+		index = lcdTextPaletteSize++;
+	else if ((index = lcdTextColoursFree(keep, 1)) == LCD_TEXT_COLOURS)
+	{
+		index = lcdTextColoursFree(keep, 0);
+		if (index == LCD_TEXT_COLOURS)
+		{
+			for (index = 0; index < LCD_TEXT_COLOURS; index++)
+			{
+				if (lcdTextPalette[index][1] == bgColour)
+					return index;
+			}
+			return (keep < LCD_TEXT_COLOURS) ? keep : 0;
+		}
+
+		// The cells drawn with the old pair no longer match anything and are drawn again
+		for (cell = 0; cell < LCD_TEXT_ROWS * LCD_TEXT_COLUMNS; cell++)
+		{
+			if (shown[cell].colours == index)
+				shown[cell].colours = LCD_TEXT_COLOURS;
+		}
+	}
+
+	lcdTextPalette[index][0] = fgColour;
+	lcdTextPalette[index][1] = bgColour;
+	return index;
+}
+
+/**
+ * @brief The function is used to fill the text layer with spaces.\n
+ * @details Nothing is sent to the display until lcdTextUpdate().
+ *  @param[in] bgColour -> background colour
+*/
+void lcdTextClear(uint16_t bgColour)
+{
+	LcdTextCell *frame = &lcdTextFrame[0][0];
+	uint8_t colours = lcdTextColours(bgColour, bgColour, LCD_TEXT_COLOURS);
+	uint16_t cell;
+
+	for (cell = 0; cell < LCD_TEXT_ROWS * LCD_TEXT_COLUMNS; cell++)
+	{
+		frame[cell].character = ' ';
+		frame[cell].colours = colours;
+	}
+}
+
+/**
+ * @brief The function is used to write a string of characters to the text layer.\n
+ * @details The string wraps to the starting column of the next row like in lcdPutS().
+ * 			Nothing is sent to the display until lcdTextUpdate().
+ *  @param[in] *string -> pointer string of characters
+ *  @param[in] column -> text column (0-20)
+ *  @param[in] row -> text row (0-15)
+ *  @param[in] fgColour -> colour of string
+ *  @param[in] bgColour -> background colour of string
+*/
+void lcdTextPutS(const char *string, uint8_t column, uint8_t row, uint16_t fgColour, uint16_t bgColour)
+{
+	uint8_t origin = column;
+	uint8_t colours = lcdTextColours(fgColour, bgColour, LCD_TEXT_COLOURS);
+	// A space shows only the background, so it matches a space of any foreground
+	uint8_t spaceColours = lcdTextColours(bgColour, bgColour, colours);
+
+	for (; *string != '\0'; string++)
+	{
+		if (column >= LCD_TEXT_COLUMNS)
+		{
+			column = origin;
+			row++;
+		}
+
+		if (row >= LCD_TEXT_ROWS) break;
+
+		lcdTextFrame[row][column].character = *string;
+		lcdTextFrame[row][column].colours = (*string == ' ') ? spaceColours : colours;
+		column++;
+	}
+}
+
+/**
+ * @brief The function is used to repaint the text cells that changed since the last update.\n
+ * @details The changed cells of a row are drawn through one address window spanning from the first to the last of them,
+ * 			a pixel line of the whole span at a time.\n
+*/
+void lcdTextUpdate(void)
+{
+	uint8_t row, line, column;
+
+	for (row = 0; row < LCD_TEXT_ROWS; row++)
+	{
+		int8_t first = -1, last = -1;
+
+		for (column = 0; column < LCD_TEXT_COLUMNS; column++)
+		{
+			if (memcmp(&lcdTextFrame[row][column], &lcdTextShown[row][column], sizeof(LcdTextCell)) != 0)
+			{
+				if (first < 0)
+					first = column;
+				last = column;
+			}
+		}
+
+		if (first < 0)
+			continue;
+
+		lcdSetWindow(lcdTextX(first), lcdTextY(row), lcdTextX(last) + 5, lcdTextY(row) + 7);
+
+		for (line = 0; line < 8; line++)
+		{
+			uint8_t *pixel = lcdLineBuffer;
+
+			for (column = first; column <= last; column++)
+			{
+				const LcdTextCell *cell = &lcdTextFrame[row][column];
+				uint16_t fgColour = lcdTextPalette[cell->colours][0];
+				uint16_t bgColour = lcdTextPalette[cell->colours][1];
+				uint8_t i;
+
+				for (i = 0; i < 6; i++)
+				{
+					uint16_t colour = ((fontus[cell->character][i]) & (1 << line)) ? fgColour : bgColour;
+
+					*pixel++ = colour >> 8;
+					*pixel++ = colour;
+				}
+			}
+
+			lcdTransfer(GPIO_PIN_SET, lcdLineBuffer, pixel - lcdLineBuffer, 0);
+		}
+
+		memcpy(&lcdTextShown[row][first], &lcdTextFrame[row][first], (last - first + 1) * sizeof(LcdTextCell));
+	}
+}
+
+
 #endif /* ILI9163_C_ */
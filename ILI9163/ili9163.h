@@ -34,6 +34,9 @@
 #define LCD_CS		(1 << 6)
 #define LCD_RESET	(1 << 7)
 
+// Highest SCLK of the ILI9163 serial interface, 66 ns write cycle
+#define LCD_SCLK_MAX	15000000U
+
 // Screen orientation defines:
 // 0 = Ribbon at top
 // 1 = Ribbon at left
@@ -122,9 +125,6 @@ uint8_t lcdTextX(uint8_t x);
 // it easy to place text
 uint8_t lcdTextY(uint8_t y);
 
-//SPI
-void (*ILI9163_SPI_TransmitData)(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size);
-void ILI9163_RegisterCallback(uint8_t *callback1);
 //	LCD function prototypes
 void lcdReset(void);
 void lcdWriteCommand(uint8_t address);
@@ -142,5 +142,14 @@ void lcdCircle(int16_t xCentre, int16_t yCentre, int16_t radius, uint16_t colour
 void lcdPutCh(unsigned char character, uint8_t x, uint8_t y, uint16_t fgColour, uint16_t bgColour);
 void lcdPutS(const char *string, uint8_t x, uint8_t y, uint16_t fgColour, uint16_t bgColour);
 
+// Text layer: strings are placed in 6x8 character cells and lcdTextUpdate()
+// repaints only the cells that changed. lcdClearDisplay() resets it.
+#define LCD_TEXT_COLUMNS	21
+#define LCD_TEXT_ROWS		16
+
+void lcdTextClear(uint16_t bgColour);
+void lcdTextPutS(const char *string, uint8_t column, uint8_t row, uint16_t fgColour, uint16_t bgColour);
+void lcdTextUpdate(void);
+
 
 #endif /* ILI9163_H_ */
@@ -4,16 +4,73 @@
  */
 
 /* Includes */
+#include <stdio.h>
+#include <string.h>
+
 #include "mfrc522.h"
+#include "spi_bus.h"
 
 /* Defines */
 #define RC522_CS_GPIO_Port GPIOA
 #define RC522_CS_Pin GPIO_PIN_9
+#define RC522_FIFO_SIZE 64
+#define RC522_IRQ_GUARD_MS 30	// Longer than the 25 ms RF timer, ends the wait if the IRQ pin never comes
+#define RC522_TIMER_RELOAD 0x03E8	// RF timer reload of 25 ms, set in MFRC522_PCD_Init()
+#define RC522_DETECT_RELOAD 0x0028	// RF timer reload of 1 ms, a card answers REQA within 100 us
+#define RC522_FIELD_GUARD_MS 5	// Cards need the field this long before the first command (ISO 14443-3)
+#define RC522_POWER_UP_POLLS 100	// Reads of COMMAND_REG while the oscillator starts
+#define RC522_INVENTORY_RETRIES 2	// Failed selections before an inventory gives up
+#define RC522_NO_SECTOR 0xFF	// No sector is authenticated in the MIFARE session
+
+// Configuration registers only the driver changes, bit n stands for register n. Their last value is kept
+// in shadow_regs, so reading them costs no SPI transfer and writing the same value again is skipped.
+// Registers with bits set by the hardware (command, interrupt, FIFO, status, CollReg) are not listed.
+#define RC522_SHADOWED ((1ULL << COM_I_EN_REG) | (1ULL << DIV_I_EN_REG) | (1ULL << MODE_REG) \
+						| (1ULL << TX_MODE_REG) | (1ULL << RX_MODE_REG) | (1ULL << TX_CONTROL_REG) \
+						| (1ULL << TX_ASK_REG) | (1ULL << BIT_FRAMING_REG) | (1ULL << MOD_WIDTH_REG) \
+						| (1ULL << T_MODE_REG) | (1ULL << T_PRESCALER_REG) \
+						| (1ULL << T_RELOAD_REG_HIGH) | (1ULL << T_RELOAD_REG_LOW))
+#define RC522_IS_SHADOWED(reg) ((RC522_SHADOWED >> ((reg) & 0x3F)) & 1U)
+
+static volatile uint8_t irq_raised;	// Set by the falling edge of the IRQ pin
+static uint16_t detect_interval = MFRC522_DETECT_MIN_MS;	// Pause after the next empty REQA burst
+static uint16_t detect_next;		// Pause the last empty REQA burst asks for, 0 after a card
+static uint8_t shadow_regs[64];		// Last value of the RC522_SHADOWED registers
+static uint64_t shadow_valid;		// Bit n: shadow_regs[n] holds the value of the chip
+
+/* MIFARE Classic session, the key is used for every sector and kept until MFRC522_MIFARE_EndSession() */
+static struct
+{
+	PICC_Uid uid;
+	MIFARE_Key key;
+	uint8_t key_type;		// PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+	uint8_t sector;			// Sector Crypto1 is authenticated for, RC522_NO_SECTOR if none
+} mf_session = { .sector = RC522_NO_SECTOR };
 
 /////////////////////////////////////////////////////////////////////////////////////
 // Basic interface functions for communicating with the MFRC522
 /////////////////////////////////////////////////////////////////////////////////////
 
+/**
+  * @brief 	Runs one chip select cycle of the MFRC522 on the shared SPI bus.
+  * @param 	tx bytes to send
+  * @param 	rx buffer for the received bytes, NULL to discard them
+  * @param	size number of bytes
+  * @retval None
+  */
+static void MFRC522_PCD_Transfer(const uint8_t *tx, uint8_t *rx, uint16_t size)
+{
+	SPI_Transaction transaction = {0};
+
+	transaction.cs_port = RC522_CS_GPIO_Port;
+	transaction.cs_pin = RC522_CS_Pin;
+	transaction.tx_data = tx;
+	transaction.rx_data = rx;
+	transaction.size = size;
+	transaction.sclk = MFRC522_SCLK_MAX;
+	SPI_Bus_Transfer(&transaction);
+}
+
 /**
   * @brief 	Write a byte to the specified register in the MFRC522 reader/writer IC.
   * @note 	Communication is done through the SPI interface.
@@ -23,17 +80,18 @@
   */
 void MFRC522_PCD_Write(uint8_t reg_addr, uint8_t value)
 {
-	// Set the chip select line so we can start transferring
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_RESET);
-
-	// Prepare address for write mode
-	uint8_t addr = (((reg_addr << 1) & 0x7E));
+	// Address byte in write mode followed by the value, both in one chip select cycle
+	uint8_t tx[2] = { ((reg_addr << 1) & 0x7E), value };
 
-	HAL_SPI_Transmit(&hspi1, &addr, 1, 500);
-	HAL_SPI_Transmit(&hspi1, &value, 1, 500);
+	if (RC522_IS_SHADOWED(reg_addr))
+	{
+		if (((shadow_valid >> reg_addr) & 1U) && shadow_regs[reg_addr] == value)
+			return;		// The register holds the value already
+		shadow_regs[reg_addr] = value;
+		shadow_valid |= 1ULL << reg_addr;
+	}
 
-	// Clear the select line - release the slave
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_SET);
+	MFRC522_PCD_Transfer(tx, NULL, 2);
 }
 
 /**
@@ -41,22 +99,28 @@ void MFRC522_PCD_Write(uint8_t reg_addr, uint8_t value)
   * @note 	Communication is done through the SPI interface.
   * @param 	reg_addr register address
   * @param 	p_data data to be written
-  * @param	length number of bytes to be written
+  * @param	length number of bytes to be written, at most RC522_FIFO_SIZE
   * @retval None
   */
 void MFRC522_PCD_WriteArray(uint8_t reg_addr, uint8_t *p_data, uint8_t length) {
 
-	// Set the chip select line so we can start transferring
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_RESET);
+	uint8_t tx[1 + RC522_FIFO_SIZE];
+
+	if (length > RC522_FIFO_SIZE)
+		length = RC522_FIFO_SIZE;
 
 	// Prepare address for write mode
-	uint8_t addr = (((reg_addr << 1) & 0x7E));
+	tx[0] = ((reg_addr << 1) & 0x7E);
+	memcpy(&tx[1], p_data, length);
 
-	HAL_SPI_Transmit(&hspi1, &addr, 1, 500);
-	HAL_SPI_Transmit(&hspi1, p_data, length, 500);
+	// A register outside of the FIFO keeps the last byte
+	if (RC522_IS_SHADOWED(reg_addr) && length > 0)
+	{
+		shadow_regs[reg_addr] = p_data[length - 1];
+		shadow_valid |= 1ULL << reg_addr;
+	}
 
-	// Clear the select line - release the slave
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_SET);
+	MFRC522_PCD_Transfer(tx, NULL, 1 + length);
 }
 
 /**
@@ -67,20 +131,20 @@ void MFRC522_PCD_WriteArray(uint8_t reg_addr, uint8_t *p_data, uint8_t length) {
   */
 uint8_t MFRC522_PCD_Read(uint8_t reg_addr) {
 
-	uint8_t value;
-
-	// Prepare address for read mode
-	uint8_t addr = (((reg_addr << 1) & 0x7E) | 0x80);
+	// Address in read mode, the value is clocked in with the terminating 0x00
+	uint8_t tx[2] = { (((reg_addr << 1) & 0x7E) | 0x80), 0x00 };
+	uint8_t rx[2];
 
-	// Set the select line so we can start transferring - select slave
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_RESET);
+	if (RC522_IS_SHADOWED(reg_addr) && ((shadow_valid >> reg_addr) & 1U))
+		return shadow_regs[reg_addr];
 
-	HAL_SPI_Transmit(&hspi1, &addr, 1, 500);
-	HAL_SPI_Receive(&hspi1, &value, 1, 500);
-
-	// Clear the select line - release slave
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_SET);
-	return (uint8_t) value;
+	MFRC522_PCD_Transfer(tx, rx, 2);
+	if (RC522_IS_SHADOWED(reg_addr))
+	{
+		shadow_regs[reg_addr] = rx[1];
+		shadow_valid |= 1ULL << reg_addr;
+	}
+	return rx[1];
 }
 
 /**
@@ -88,22 +152,51 @@ uint8_t MFRC522_PCD_Read(uint8_t reg_addr) {
   * @note 	Communication is done through the SPI interface.
   * @param 	reg_addr register address
   * @param	p_data pointer to data buffer for storing the read bytes
-  * @param	count number of bytes to read
+  * @param	count number of bytes to read, at most RC522_FIFO_SIZE
   * @retval none
   */
 void MFRC522_PCD_ReadArray(uint8_t reg_addr, uint8_t* p_data, uint8_t count) {
 
-	// Prepare address for read mode
-	uint8_t addr = (((reg_addr << 1) & 0x7E) | 0x80);
+	uint8_t tx[1 + RC522_FIFO_SIZE];
+	uint8_t rx[1 + RC522_FIFO_SIZE];
 
-	// set the select line so we can start transferring - select slave
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_RESET);
+	if (count == 0)
+		return;
+	if (count > RC522_FIFO_SIZE)
+		count = RC522_FIFO_SIZE;
 
-	HAL_SPI_Transmit(&hspi1, &addr, 1, HAL_MAX_DELAY);
-	HAL_SPI_Receive(&hspi1, p_data, count, HAL_MAX_DELAY);
+	// Each byte is read by sending the address again, the last one by sending 0x00
+	memset(tx, (((reg_addr << 1) & 0x7E) | 0x80), count);
+	tx[count] = 0x00;
 
-	// Clear the select line - release slave
-	HAL_GPIO_WritePin(RC522_CS_GPIO_Port, RC522_CS_Pin, GPIO_PIN_SET);
+	MFRC522_PCD_Transfer(tx, rx, count + 1);
+	memcpy(p_data, &rx[1], count);
+}
+
+/**
+  * @brief 	Reads several registers in one chip select cycle.
+  * @note 	In read mode every byte sent after the first address is the address of the next read.
+  * @param 	reg_addrs addresses of the registers, in the order they are read
+  * @param	values returns the values of the registers
+  * @param	count number of registers, at most RC522_FIFO_SIZE
+  * @retval none
+  */
+void MFRC522_PCD_ReadMulti(const uint8_t *reg_addrs, uint8_t *values, uint8_t count) {
+
+	uint8_t tx[1 + RC522_FIFO_SIZE];
+	uint8_t rx[1 + RC522_FIFO_SIZE];
+
+	if (count == 0)
+		return;
+	if (count > RC522_FIFO_SIZE)
+		count = RC522_FIFO_SIZE;
+
+	for (uint8_t i = 0; i < count; i++)
+		tx[i] = ((reg_addrs[i] << 1) & 0x7E) | 0x80;
+	tx[count] = 0x00;
+
+	MFRC522_PCD_Transfer(tx, rx, count + 1);
+	memcpy(values, &rx[1], count);
 }
 
 /**
@@ -141,6 +234,7 @@ void MFRC522_PCD_ClearBitMask(uint8_t reg, uint8_t mask)
   */
 uint8_t MFRC522_PCD_CalculateCRC(uint8_t *p_data, uint8_t len, uint8_t *result)
 {
+	static const uint8_t result_regs[2] = { CRC_RESULT_REG_LOW, CRC_RESULT_REG_HIGH };
 	uint8_t i, n;
 
 	MFRC522_PCD_Write(COMMAND_REG, PCD_IDLE);			// Stop any active command.
@@ -148,10 +242,7 @@ uint8_t MFRC522_PCD_CalculateCRC(uint8_t *p_data, uint8_t len, uint8_t *result)
 	MFRC522_PCD_Write(FIFO_LEVEL_REG, 0x80);			// FlushBuffer = 1, FIFO initialization
 
 	// Writing data to the FIFO
-	for (i = 0; i < len; i++)
-	{
-		MFRC522_PCD_Write(FIFO_DATA_REG, *(p_data+i));
-	}
+	MFRC522_PCD_WriteArray(FIFO_DATA_REG, p_data, len);
 	MFRC522_PCD_Write(COMMAND_REG, PCD_CALC_CRC); 		// Start calculation
 
 	/* Wait for when CRC calculation is complete */
@@ -165,8 +256,7 @@ uint8_t MFRC522_PCD_CalculateCRC(uint8_t *p_data, uint8_t len, uint8_t *result)
 			MFRC522_PCD_Write(COMMAND_REG, PCD_IDLE);	// Stop calculating
 
 			// Read CRC calculation result
-			result[0] = MFRC522_PCD_Read(CRC_RESULT_REG_LOW);
-			result[1] = MFRC522_PCD_Read(CRC_RESULT_REG_HIGH);
+			MFRC522_PCD_ReadMulti(result_regs, result, 2);
 			return STATUS_OK;
 		}
 
@@ -206,6 +296,10 @@ void MFRC522_PCD_Init()
 	MFRC522_PCD_Write(TX_ASK_REG, 0x40);			// Default 0x00. Force a 100 % ASK modulation independent of the ModGsPReg register setting
 	MFRC522_PCD_Write(MODE_REG, 0x3D);				// Default 0x3F. Set the preset value for the CRC coprocessor for the CalcCRC command to 0x6363 (ISO 14443-3 part 6.2.4)
 
+#if MFRC522_USE_IRQ_PIN
+	MFRC522_PCD_Write(DIV_I_EN_REG, 0x80);			// IRQPushPull=1, the IRQ pin is driven high while inactive
+#endif
+
 	/* Turn antenna on */
 	MFRC522_PCD_AntennaOn();
 }
@@ -216,6 +310,7 @@ void MFRC522_PCD_Init()
 void MFRC522_PCD_SoftReset(void)
 {
 	MFRC522_PCD_Write(COMMAND_REG, PCD_SOFT_RESET);
+	shadow_valid = 0;		// All registers are back at their reset values
 }
 
 /**
@@ -234,45 +329,253 @@ void MFRC522_PCD_AntennaOff(void) {
 	MFRC522_PCD_ClearBitMask(TX_CONTROL_REG, 0x03);
 }
 
+/**
+  * @brief 	Stops the RF field and puts the MFRC522 into soft power-down.
+  * @note 	Only the digital part and the SPI interface keep running, a card in the field loses power.
+  */
+void MFRC522_PCD_SoftPowerDown(void)
+{
+	MFRC522_PCD_AntennaOff();
+	MFRC522_PCD_Write(COMMAND_REG, 0x10 | PCD_NO_CMD_CHANGE);	// PowerDown=1
+}
+
+/**
+  * @brief 	Leaves soft power-down and turns the RF field on again.
+  * @note 	The PowerDown bit reads 1 until the oscillator is stable.
+  */
+void MFRC522_PCD_SoftPowerUp(void)
+{
+	uint8_t i = RC522_POWER_UP_POLLS;
+
+	MFRC522_PCD_Write(COMMAND_REG, PCD_NO_CMD_CHANGE);			// PowerDown=0
+	while ((MFRC522_PCD_Read(COMMAND_REG) & 0x10) && --i)
+		;
+	MFRC522_PCD_AntennaOn();
+}
+
+/**
+  * @brief 	Sets the reload value of the RF timer that ends a transceive without an answer.
+  * @param 	reload timer periods of 25 us
+  */
+static void MFRC522_PCD_SetTimeout(uint16_t reload)
+{
+	MFRC522_PCD_Write(T_RELOAD_REG_HIGH, reload >> 8);
+	MFRC522_PCD_Write(T_RELOAD_REG_LOW, reload & 0xFF);
+}
+
+/**
+  * @brief 	Lets the MFRC522 append the CRC_A to the transmitted frames and check it in the received ones.
+  * @param	tx 1 for SELECT and the commands of an active PICC, 0 for REQA and the anticollision frames
+  * @param	rx 1 if the answer carries a CRC_A, 0 for the anticollision frames and the 4 bit MIFARE ACK
+  * @retval None
+  */
+static void MFRC522_PCD_SetCrc(uint8_t tx, uint8_t rx)
+{
+	MFRC522_PCD_Write(TX_MODE_REG, tx ? 0x80 : 0x00);		// TxCRCEn at 106 kBd
+	MFRC522_PCD_Write(RX_MODE_REG, rx ? 0x80 : 0x00);		// RxCRCEn at 106 kBd
+}
+
+/**
+  * @brief 	Sleeps for the given time, SysTick wakes the core every millisecond.
+  * @note 	Only used for the few ms the reader itself needs, a longer pause is left to the caller.
+  * @param 	ms time to sleep
+  */
+static void MFRC522_PCD_Sleep(uint32_t ms)
+{
+	uint32_t start = HAL_GetTick();
+
+	while ((HAL_GetTick() - start) < ms)
+		__WFI();
+}
+
+/**
+  * @brief 	IRQ pin of the MFRC522 went active, called from the EXTI interrupt.
+  */
+void MFRC522_PCD_IrqCallback(void)
+{
+	irq_raised = 1;
+}
+
+#if MFRC522_USE_IRQ_PIN
+/**
+  * @brief 	Sleeps until the IRQ pin goes active or RC522_IRQ_GUARD_MS passes.
+  * @note 	SysTick wakes the core every millisecond, the RF timer of the MFRC522 ends a transceive without an answer.
+  */
+static void MFRC522_PCD_WaitIrq(void)
+{
+	uint32_t start = HAL_GetTick();
+
+	while (!irq_raised && (HAL_GetTick() - start) < RC522_IRQ_GUARD_MS)
+	{
+		// Checked with interrupts off, so the edge cannot slip in before WFI
+		__disable_irq();
+		if (!irq_raised)
+			__WFI();
+		__enable_irq();
+	}
+}
+#endif
+
 /////////////////////////////////////////////////////////////////////////////////////
 // Functions for communicating with PICCs
 /////////////////////////////////////////////////////////////////////////////////////
 
 /**
-  * @brief 	Anti-collision detection, reads selected card's UID.
-  * @note	Shows all known firmware versions.
-  * @param	p_ser_num returns 4 bytes of the card's serial number, the first 5 bytes for the checksum byte
-  * @retval	STATUS_OK on success, STATUS_ERROR otherwise
+  * @brief 	Anticollision loop and selection of one PICC through all of its cascade levels (ISO 14443-3, 6.5.3).
+  * @note	The PICCs must be READY, after MFRC522_PICC_RequestA(). If several PICCs answer, the first colliding bit
+  * 		is taken as 1 and the loop goes on with the PICCs that have it, so one of them is selected without a new REQA.
+  * @param	uid returns the UID, its size and the SAK of the selected PICC
+  * @retval	STATUS_OK on success, STATUS_TIMEOUT if no PICC answered, STATUS_CRC_WRONG, STATUS_COLLISION or
+  * 		STATUS_ERROR otherwise
   */
-uint8_t MFRC522_PICC_Anticollision(uint8_t *p_ser_num)
+uint8_t MFRC522_PICC_Select(PICC_Uid *uid)
 {
 	uint8_t status;
-	uint8_t i;
-	uint8_t ser_num_check = 0;
-	uint32_t un_len;
+	uint8_t level;
+	uint8_t frame[7];		// SEL, NVB, 4 bytes of the cascade level, BCC
+	uint8_t rx[MAX_LEN];
+	uint8_t back_bits;
 
-	//ClearBitMask(Status2Reg, 0x08);		//TempSensclear
-	//ClearBitMask(CollReg,0x80);			//ValuesAfterColl
-	MFRC522_PCD_Write(BIT_FRAMING_REG, 0x00);		//TxLastBists = BitFramingReg[2..0]
+	uid->size = 0;
+	MFRC522_PCD_ClearBitMask(COLL_REG, 0x80);		// ValuesAfterColl=0, bits received after a collision are cleared
 
-	p_ser_num[0] = PICC_CMD_SEL_CL1;
-	p_ser_num[1] = 0x20;
-	status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, p_ser_num, 2, p_ser_num, &un_len);
+	for (level = 0; level < 3; level++)
+	{
+		uint8_t known = 0;	// Bits of the cascade level (4 bytes and BCC) known so far
 
-	if (status == STATUS_OK)
+		frame[0] = PICC_CMD_SEL_CL1 + 2 * level;
+
+		// ANTICOLLISION: send the known bits, the PICCs that match answer with the rest
+		while (known < 40)
+		{
+			uint8_t full = known / 8;
+			uint8_t last_bits = known % 8;
+			uint8_t coll;
+
+			frame[1] = ((2 + full) << 4) | last_bits;				// NVB
+			MFRC522_PCD_Write(BIT_FRAMING_REG, (last_bits << 4) | last_bits);	// RxAlign = TxLastBits
+			status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, frame, 2 + full + (last_bits ? 1 : 0), rx, &back_bits);
+			if (status != STATUS_OK && status != STATUS_COLLISION)
+				return status;
+
+			// The first received byte completes the partial byte that was sent
+			if (last_bits)
+				rx[0] = (frame[2 + full] & ((1 << last_bits) - 1)) | (rx[0] & (0xFF << last_bits));
+			memcpy(&frame[2 + full], rx, 5 - full);
+
+			if (status == STATUS_OK)
+			{
+				known = 40;
+				break;
+			}
+
+			coll = MFRC522_PCD_Read(COLL_REG);
+			if (coll & 0x20)								// CollPosNotValid
+				return STATUS_COLLISION;
+			coll = (coll & 0x1F) ? (coll & 0x1F) : 32;		// 1..32, counted from RxAlign in the first byte
+			if (full * 8 + coll <= known || full * 8 + coll > 40)
+				return STATUS_ERROR;
+
+			// Bits up to the collision are valid, continue with the PICCs that have a 1 there
+			known = full * 8 + coll;
+			frame[2 + (known - 1) / 8] |= 1 << ((known - 1) % 8);
+		}
+
+		if ((frame[2] ^ frame[3] ^ frame[4] ^ frame[5]) != frame[6])
+			return STATUS_ERROR;						// BCC
+
+		// SELECT the PICC with the complete cascade level, the MFRC522 appends and checks the CRC_A
+		frame[1] = 0x70;
+		MFRC522_PCD_Write(BIT_FRAMING_REG, 0x00);
+		MFRC522_PCD_SetCrc(1, 1);
+		status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, frame, 7, rx, &back_bits);
+		MFRC522_PCD_SetCrc(0, 0);
+		if (status != STATUS_OK)
+			return status;
+		if (back_bits != 8)									// SAK
+			return STATUS_ERROR;
+
+		// SAK bit 2: the UID is not complete, this level started with the cascade tag
+		if (rx[0] & 0x04)
+		{
+			if (frame[2] != PICC_CMD_CT || level == 2)
+				return STATUS_ERROR;
+			memcpy(&uid->uid_byte[uid->size], &frame[3], 3);
+			uid->size += 3;
+		}
+		else
+		{
+			memcpy(&uid->uid_byte[uid->size], &frame[2], 4);
+			uid->size += 4;
+			uid->sak = rx[0];
+			return STATUS_OK;
+		}
+	}
+
+	return STATUS_ERROR;
+}
+
+/**
+  * @brief 	Sends HLTA, the selected PICC goes to HALT and only answers WUPA afterwards.
+  * @retval	STATUS_OK if the PICC stayed silent, as it should, STATUS_ERROR otherwise
+  */
+uint8_t MFRC522_PICC_HaltA(void)
+{
+	uint8_t frame[MAX_LEN] = { PICC_CMD_HLTA, 0x00 };
+	uint8_t back_bits;
+	uint8_t status;
+
+	MFRC522_PCD_Write(BIT_FRAMING_REG, 0x00);
+
+	// Any answer within 1 ms means the PICC did not understand HLTA (ISO 14443-3, 6.4.3)
+	MFRC522_PCD_SetTimeout(RC522_DETECT_RELOAD);
+	MFRC522_PCD_SetCrc(1, 1);
+	status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, frame, 2, frame, &back_bits);
+	MFRC522_PCD_SetCrc(0, 0);
+	MFRC522_PCD_SetTimeout(RC522_TIMER_RELOAD);
+
+	return (status == STATUS_TIMEOUT) ? STATUS_OK : STATUS_ERROR;
+}
+
+/**
+  * @brief 	Lists the PICCs in the field, each one is selected and halted until none answers REQA any more.
+  * @note	The PICCs must be READY, after MFRC522_PICC_RequestA() or MFRC522_PICC_Detect(). The listed PICCs stay
+  * 		in HALT and ignore REQA until they leave the field or the field is switched off.
+  * @param	tag_type ATQA of the request that made the PICCs READY, also the buffer of the following requests
+  * @param	tags returns the UID, SAK and ATQA of every PICC found. With several PICCs in one request
+  * 		the ATQA is the superposition of their answers.
+  * @param	max number of entries in tags
+  * @retval	number of PICCs in tags
+  */
+uint8_t MFRC522_PICC_Inventory(uint8_t *tag_type, PICC_Uid *tags, uint8_t max)
+{
+	uint8_t count = 0;
+	uint8_t retries = RC522_INVENTORY_RETRIES;
+	uint8_t status;
+
+	while (count < max)
 	{
-		//Check card serial number
-		for (i = 0; i < 4; i++)
+		if (MFRC522_PICC_Select(&tags[count]) == STATUS_OK)
 		{
-			ser_num_check ^= p_ser_num[i];
+			tags[count].atqa[0] = tag_type[0];
+			tags[count].atqa[1] = tag_type[1];
+			count++;
+			MFRC522_PICC_HaltA();
 		}
-		if (ser_num_check != p_ser_num[i])
+		else if (retries-- == 0)
 		{
-			status = STATUS_ERROR;
+			break;		// The selection keeps failing, the field is too noisy
 		}
-  }
 
-  return status;
+		// The halted PICCs stay silent, a PICC that failed the selection is IDLE again
+		MFRC522_PCD_SetTimeout(RC522_DETECT_RELOAD);
+		status = MFRC522_PICC_RequestA(PICC_CMD_REQA, tag_type);
+		MFRC522_PCD_SetTimeout(RC522_TIMER_RELOAD);
+		if (status != STATUS_OK)
+			break;
+	}
+
+	return count;
 }
 
 /**
@@ -290,20 +593,77 @@ uint8_t MFRC522_PICC_Anticollision(uint8_t *p_ser_num)
 uint8_t MFRC522_PICC_RequestA(uint8_t req_mode, uint8_t *tag_type)
 {
   uint8_t status;
-  uint32_t back_bits; // The received data bits
+  uint8_t back_bits; // The received data bits
 
   MFRC522_PCD_Write(BIT_FRAMING_REG, 0x07);   // TxLastBists = BitFramingReg[2..0]
 
   tag_type[0] = req_mode;
 
   status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, tag_type, 1, tag_type, &back_bits);
-  if ((status != STATUS_OK) || (back_bits != 0x10)) {
+  if (status == STATUS_COLLISION) {
+    status = STATUS_OK;	// PICCs of different UID sizes answered at once, all of them are READY
+  }
+  else if ((status != STATUS_OK) || (back_bits != 0x10)) {
     status = STATUS_ERROR;
   }
 
   return status;
 }
 
+/**
+  * @brief Duty-cycled card detection, one REQA burst per call.
+  * @note  The reader is powered up, the field is given RC522_FIELD_GUARD_MS and REQA is sent with a 1 ms
+  *        timeout. If no card answers, the reader goes back to soft power-down and the caller is to wait
+  *        MFRC522_PICC_DetectNextMs() before the next burst; the pause doubles up to MFRC522_DETECT_MAX_MS.
+  *        A card found leaves the reader powered up for the anticollision and restarts the pause at
+  *        MFRC522_DETECT_MIN_MS.
+  * @param tag_type returns the ATQA of the card
+  * @retval STATUS_OK if a card answered, STATUS_ERROR otherwise.
+  */
+uint8_t MFRC522_PICC_Detect(uint8_t *tag_type)
+{
+	uint8_t status;
+
+	MFRC522_PCD_SoftPowerUp();
+	MFRC522_PCD_Sleep(RC522_FIELD_GUARD_MS);
+
+	MFRC522_PCD_SetTimeout(RC522_DETECT_RELOAD);
+	status = MFRC522_PICC_RequestA(PICC_CMD_REQA, tag_type);
+	MFRC522_PCD_SetTimeout(RC522_TIMER_RELOAD);
+
+	if (status == STATUS_OK)
+	{
+		detect_interval = MFRC522_DETECT_MIN_MS;
+		detect_next = 0;
+		return STATUS_OK;
+	}
+
+	MFRC522_PCD_SoftPowerDown();
+
+	detect_next = detect_interval;
+	detect_interval *= 2;
+	if (detect_interval > MFRC522_DETECT_MAX_MS)
+		detect_interval = MFRC522_DETECT_MAX_MS;
+	return status;
+}
+
+/**
+  * @brief Starts the detection again with the shortest interval, a card is expected soon.
+  */
+void MFRC522_PICC_DetectRestart(void)
+{
+	detect_interval = MFRC522_DETECT_MIN_MS;
+	detect_next = 0;
+}
+
+/**
+  * @brief Returns the ms the reader is to stay powered down before the next MFRC522_PICC_Detect(), 0 for none.
+  */
+uint16_t MFRC522_PICC_DetectNextMs(void)
+{
+	return detect_next;
+}
+
 //-----------------------------------------------
 
 /**
@@ -313,16 +673,26 @@ uint8_t MFRC522_PICC_RequestA(uint8_t req_mode, uint8_t *tag_type)
   * @param sen_len length of data sent
   * @param back_data pointer to received data,
   * @param back_len return data bit length
-  * @retval STATUS_OK on succecss, STATUS_ERROR otherwise
+  * @retval STATUS_OK on succecss, STATUS_COLLISION if PICCs answered at once, STATUS_TIMEOUT if none did,
+  *         STATUS_ERROR otherwise
   */
 uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_len, uint8_t *back_data, uint8_t *back_len)
 {
   uint8_t status = STATUS_ERROR;
   uint8_t irq_en = 0x00;
   uint8_t wait_irq = 0x00;
+  uint8_t framing = 0x00;
   uint8_t last_bits;
+  uint8_t error;
   uint8_t n;
   uint32_t i;
+#if MFRC522_USE_IRQ_PIN
+  static const uint8_t result_regs[4] = { COM_IRQ_REG, ERROR_REG, FIFO_LEVEL_REG, CONTROL_REG };
+  uint8_t result[4];	// ComIrqReg, ErrorReg, FIFOLevelReg, ControlReg
+#else
+  static const uint8_t result_regs[3] = { ERROR_REG, FIFO_LEVEL_REG, CONTROL_REG };
+  uint8_t result[4];	// ComIrqReg from the polling loop, ErrorReg, FIFOLevelReg, ControlReg
+#endif
 
   switch (command)
   {
@@ -342,25 +712,31 @@ uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_le
   		  break;
   }
 
-  MFRC522_PCD_Write(COM_I_EN_REG, irq_en|0x80); // Interrupt request
-  MFRC522_PCD_ClearBitMask(COM_IRQ_REG, 0x80);  // Clear all interrupt request bit
-  MFRC522_PCD_SetBitMask(FIFO_LEVEL_REG, 0x80); // FlushBuffer=1, FIFO Initialization
+  MFRC522_PCD_Write(COM_I_EN_REG, wait_irq|0x81); // IRqInv=1, the end of the command or the timer pulls the IRQ pin low
+  MFRC522_PCD_Write(COM_IRQ_REG, 0x7F);         // Set1=0, clear all interrupt request bits
+  irq_raised = 0;
 
   MFRC522_PCD_Write(COMMAND_REG, PCD_IDLE); // NO action; Cancel the current command
+  MFRC522_PCD_Write(FIFO_LEVEL_REG, 0x80);  // FlushBuffer=1, FIFO Initialization
 
-  // Writing data to the FIFO
-  for (i =0; i < send_len; i++)
-  {
-	  MFRC522_PCD_Write(FIFO_DATA_REG, send_data[i]);
-  }
+  // Writing data to the FIFO, all bytes in one chip select cycle
+  MFRC522_PCD_WriteArray(FIFO_DATA_REG, send_data, send_len);
 
   // Execute the command
   MFRC522_PCD_Write(COMMAND_REG, command);
   if (command == PCD_TRANSCEIVE)
   {
-    MFRC522_PCD_SetBitMask(BIT_FRAMING_REG, 0x80);      // StartSend=1,transmission of data starts
+    framing = MFRC522_PCD_Read(BIT_FRAMING_REG);
+    MFRC522_PCD_Write(BIT_FRAMING_REG, framing | 0x80);  // StartSend=1,transmission of data starts
   }
 
+#if MFRC522_USE_IRQ_PIN
+  // Waiting to receive data to complete, the core sleeps until the IRQ pin
+  MFRC522_PCD_WaitIrq();
+  MFRC522_PCD_ReadMulti(result_regs, result, 4);
+  n = result[0];
+  i = (n & 0x01) || (n & wait_irq);
+#else
   // Waiting to receive data to complete
   i = 2000;	// i according to the clock frequency adjustment, the operator M1 card maximum waiting time 25ms
   do
@@ -371,23 +747,31 @@ uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_le
     i--;
   }
   while ((i != 0) && !(n & 0x01) && !(n & wait_irq));
+  MFRC522_PCD_ReadMulti(result_regs, &result[1], 3);
+#endif
 
-  MFRC522_PCD_ClearBitMask(BIT_FRAMING_REG, 0x80);      // StartSend=0
+  if (command == PCD_TRANSCEIVE)
+  {
+    MFRC522_PCD_Write(BIT_FRAMING_REG, framing);      // StartSend=0
+  }
 
   if (i != 0)
   {
-	  if(!(MFRC522_PCD_Read(ERROR_REG) & 0x1B))  // BufferOvfl Collerr CRCErr ProtecolErr
+	  error = result[1];
+	  if(!(error & 0x13))  // BufferOvfl ParityErr ProtecolErr
 	  {
-		  status = STATUS_OK;
+		  // CollErr: the bits up to COLL_REG are valid, the anticollision goes on from there
+		  // CRCErr: RxCRCEn is set and the CRC_A of the answer is wrong
+		  status = (error & 0x08) ? STATUS_COLLISION : ((error & 0x04) ? STATUS_CRC_WRONG : STATUS_OK);
 		  if (n & irq_en & 0x01)
 		  {
-			status = STATUS_ERROR;             // ??
+			status = STATUS_TIMEOUT;           // TimerIRq, no PICC answered
 		  }
 
 		  if (command == PCD_TRANSCEIVE)
 		  {
-			  n = MFRC522_PCD_Read(FIFO_LEVEL_REG);
-			  last_bits = MFRC522_PCD_Read(CONTROL_REG) & 0x07;
+			  n = result[2];
+			  last_bits = result[3] & 0x07;
 
 			  if (last_bits)
 			  {
@@ -407,11 +791,8 @@ uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_le
 				  n = MAX_LEN;
 			  }
 
-			  // Reading the received data in FIFO
-			  for (i = 0; i < n; i++)
-			  {
-				  back_data[i] = MFRC522_PCD_Read(FIFO_DATA_REG);
-			  }
+			  // Reading the received data in FIFO, all bytes in one chip select cycle
+			  MFRC522_PCD_ReadArray(FIFO_DATA_REG, back_data, n);
 		  }
 	  }
 	  else
@@ -423,11 +804,189 @@ uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_le
   else
   {
     //printf("~~~ request timed out\r\n");
+    status = STATUS_TIMEOUT;
   }
 
   return status;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////
+// MIFARE Classic
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+  * @brief 	Runs MFAuthent for the sector of a block, the following frames to the PICC are encrypted by Crypto1.
+  * @note	The PICC must be selected (ACTIVE). A PICC that fails the authentication goes back to IDLE.
+  * @param	command PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+  * @param	block_addr any block of the sector
+  * @param	key key of the sector
+  * @param	uid UID of the selected PICC, the last 4 bytes take part in the authentication
+  * @retval	STATUS_OK on success, the error of MFRC522_PICC_ToCard() or STATUS_ERROR if the PICC refused the key
+  */
+uint8_t MFRC522_PCD_Authenticate(uint8_t command, uint8_t block_addr, const MIFARE_Key *key, const PICC_Uid *uid)
+{
+	uint8_t frame[2 + MF_KEY_SIZE + 4];
+	uint8_t back_bits;
+	uint8_t status;
+
+	frame[0] = command;
+	frame[1] = block_addr;
+	memcpy(&frame[2], key->key_byte, MF_KEY_SIZE);
+	memcpy(&frame[2 + MF_KEY_SIZE], &uid->uid_byte[uid->size - 4], 4);
+
+	status = MFRC522_PICC_ToCard(PCD_MF_AUTHENT, frame, sizeof(frame), frame, &back_bits);
+	if (status != STATUS_OK)
+		return status;
+
+	// MFCrypto1On is only set by a successful authentication
+	return (MFRC522_PCD_Read(STATUS_2_REG) & 0x08) ? STATUS_OK : STATUS_ERROR;
+}
+
+/**
+  * @brief 	Leaves the authenticated state, frames to the PICC are sent in plain again.
+  * @retval	None
+  */
+void MFRC522_PCD_StopCrypto1(void)
+{
+	MFRC522_PCD_ClearBitMask(STATUS_2_REG, 0x08);	// MFCrypto1On=0
+}
+
+/**
+  * @brief 	Starts a MIFARE Classic session with a selected PICC.
+  * @note	Blocks are authenticated by sector on first access, further blocks of the same sector need no
+  * 		new authentication.
+  * @param	uid UID of the selected PICC
+  * @param	key_type PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+  * @param	key key used for every sector of the session
+  * @retval	None
+  */
+void MFRC522_MIFARE_BeginSession(const PICC_Uid *uid, uint8_t key_type, const MIFARE_Key *key)
+{
+	mf_session.uid = *uid;
+	mf_session.key = *key;
+	mf_session.key_type = key_type;
+	mf_session.sector = RC522_NO_SECTOR;
+}
+
+/**
+  * @brief 	Ends the MIFARE Classic session and stops Crypto1.
+  * @retval	None
+  */
+void MFRC522_MIFARE_EndSession(void)
+{
+	if (mf_session.sector != RC522_NO_SECTOR)
+		MFRC522_PCD_StopCrypto1();
+	mf_session.sector = RC522_NO_SECTOR;
+	memset(&mf_session.key, 0, sizeof(mf_session.key));
+}
+
+/**
+  * @brief 	Authenticates the sector of a block unless the session is already authenticated for it.
+  * @retval	STATUS_OK on success, the error of MFRC522_PCD_Authenticate() otherwise
+  */
+static uint8_t MFRC522_MIFARE_OpenSector(uint8_t block_addr)
+{
+	// 32 sectors of 4 blocks, then 8 sectors of 16 blocks (MIFARE Classic 4K)
+	uint8_t sector = (block_addr < 128) ? (block_addr / 4) : (32 + (block_addr - 128) / 16);
+	uint8_t status;
+
+	if (mf_session.sector == sector)
+		return STATUS_OK;
+
+	mf_session.sector = RC522_NO_SECTOR;
+	status = MFRC522_PCD_Authenticate(mf_session.key_type, block_addr, &mf_session.key, &mf_session.uid);
+	if (status == STATUS_OK)
+		mf_session.sector = sector;
+	return status;
+}
+
+/**
+  * @brief 	The PICC dropped the authentication after an error or a NAK, the next access authenticates again.
+  */
+static void MFRC522_MIFARE_CloseSector(void)
+{
+	mf_session.sector = RC522_NO_SECTOR;
+	MFRC522_PCD_StopCrypto1();
+}
+
+/**
+  * @brief 	Checks the 4 bit ACK of a MIFARE Classic write step.
+  */
+static uint8_t MFRC522_MIFARE_Ack(uint8_t status, const uint8_t *rx, uint8_t back_bits)
+{
+	if (status != STATUS_OK)
+		return status;
+	return (back_bits == 4 && (rx[0] & 0x0F) == 0x0A) ? STATUS_OK : STATUS_MIFARE_NACK;
+}
+
+/**
+  * @brief 	Reads a block of the PICC of the session.
+  * @param	block_addr block number
+  * @param	buffer returns the MF_BLOCK_SIZE bytes of the block
+  * @retval	STATUS_OK on success, STATUS_ERROR, STATUS_TIMEOUT, STATUS_CRC_WRONG otherwise
+  */
+uint8_t MFRC522_MIFARE_Read(uint8_t block_addr, uint8_t *buffer)
+{
+	uint8_t frame[MAX_LEN] = { PICC_CMD_MF_READ, block_addr };
+	uint8_t back_bits;
+	uint8_t status;
+
+	status = MFRC522_MIFARE_OpenSector(block_addr);
+	if (status != STATUS_OK)
+		return status;
+
+	MFRC522_PCD_Write(BIT_FRAMING_REG, 0x00);
+	MFRC522_PCD_SetCrc(1, 1);
+	status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, frame, 2, frame, &back_bits);
+	MFRC522_PCD_SetCrc(0, 0);
+
+	if (status == STATUS_OK && back_bits != MF_BLOCK_SIZE * 8)
+		status = STATUS_ERROR;			// A 4 bit NAK
+	if (status != STATUS_OK)
+	{
+		MFRC522_MIFARE_CloseSector();
+		return status;
+	}
+
+	memcpy(buffer, frame, MF_BLOCK_SIZE);
+	return STATUS_OK;
+}
+
+/**
+  * @brief 	Writes a block of the PICC of the session.
+  * @note	Writing a sector trailer changes the keys and access bits of the sector.
+  * @param	block_addr block number
+  * @param	buffer MF_BLOCK_SIZE bytes to write
+  * @retval	STATUS_OK on success, STATUS_MIFARE_NACK if the PICC refused the block, STATUS_ERROR or STATUS_TIMEOUT otherwise
+  */
+uint8_t MFRC522_MIFARE_Write(uint8_t block_addr, const uint8_t *buffer)
+{
+	uint8_t frame[MAX_LEN] = { PICC_CMD_MF_WRITE, block_addr };
+	uint8_t back_bits;
+	uint8_t status;
+
+	status = MFRC522_MIFARE_OpenSector(block_addr);
+	if (status != STATUS_OK)
+		return status;
+
+	// Both steps are answered by a 4 bit ACK without CRC_A
+	MFRC522_PCD_Write(BIT_FRAMING_REG, 0x00);
+	MFRC522_PCD_SetCrc(1, 0);
+	status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, frame, 2, frame, &back_bits);
+	status = MFRC522_MIFARE_Ack(status, frame, back_bits);
+	if (status == STATUS_OK)
+	{
+		memcpy(frame, buffer, MF_BLOCK_SIZE);
+		status = MFRC522_PICC_ToCard(PCD_TRANSCEIVE, frame, MF_BLOCK_SIZE, frame, &back_bits);
+		status = MFRC522_MIFARE_Ack(status, frame, back_bits);
+	}
+	MFRC522_PCD_SetCrc(0, 0);
+
+	if (status != STATUS_OK)
+		MFRC522_MIFARE_CloseSector();
+	return status;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////
 // Debug functions
 /////////////////////////////////////////////////////////////////////////////////////
@@ -439,7 +998,7 @@ uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_le
   * @param	buf_size size of the data buffer
   * @retval	none
   */
-void MFRC522_PCD_GetVersion(uint8_t* buf, uint8_t buf_size) {
+void MFRC522_PCD_GetVersion(char* buf, uint8_t buf_size) {
 	uint8_t ver = MFRC522_PCD_Read(VERSION_REG);
 
 	switch(ver)
@@ -464,7 +1023,8 @@ void MFRC522_PCD_GetVersion(uint8_t* buf, uint8_t buf_size) {
 			snprintf(buf, buf_size, "Firmware Version: 0x%x = counterfeit chip", ver);
 			//return buf;
 			break;
-		case (0x00 || 0xFF):
+		case 0x00:
+		case 0xFF:
 			snprintf(buf, buf_size, "WARNING: Communication failure, is the MFRC522 properly connected?");
 			//return buf;
 			break;
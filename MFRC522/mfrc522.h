@@ -16,6 +16,45 @@
 //Maximum length of the array
 #define MAX_LEN 16
 
+//Longest UID of a PICC, triple size (ISO 14443-3, 6.4.4)
+#define PICC_UID_MAX 10
+
+/* UID of a selected PICC */
+typedef struct
+{
+	uint8_t size;						// Number of UID bytes, 4, 7 or 10
+	uint8_t uid_byte[PICC_UID_MAX];
+	uint8_t sak;						// Select acknowledge of the last cascade level
+	uint8_t atqa[2];					// Answer to request, filled by MFRC522_PICC_Inventory()
+} PICC_Uid;
+
+//MIFARE Classic key and data block
+#define MF_KEY_SIZE 6
+#define MF_BLOCK_SIZE 16
+
+/* Key A or B of a MIFARE Classic sector */
+typedef struct
+{
+	uint8_t key_byte[MF_KEY_SIZE];
+} MIFARE_Key;
+
+// 1: a transceive sleeps until the IRQ pin (MFRC522_IRQ_Pin) reports its end, 0: polls COM_IRQ_REG, for boards without the wire
+#ifndef MFRC522_USE_IRQ_PIN
+#define MFRC522_USE_IRQ_PIN 1
+#endif
+
+// Highest SCLK of the MFRC522 SPI interface (datasheet)
+#define MFRC522_SCLK_MAX 10000000U
+
+// Card detection: the reader sleeps between short REQA bursts, the pause doubles from MIN to MAX while no card answers;
+// the caller waits MFRC522_PICC_DetectNextMs() between two calls of MFRC522_PICC_Detect()
+#ifndef MFRC522_DETECT_MIN_MS
+#define MFRC522_DETECT_MIN_MS 20
+#endif
+#ifndef MFRC522_DETECT_MAX_MS
+#define MFRC522_DETECT_MAX_MS 100
+#endif
+
 /* MFRC522 Command word -------------------------	*/
 #define PCD_IDLE              				0x00    // No action; Cancels current command execution
 #define PCD_MEM				  				0x01	// Stores 25 bytes into the internal buffer
@@ -120,6 +159,9 @@ void MFRC522_PCD_Init();
 void MFRC522_PCD_SoftReset(void);
 void MFRC522_PCD_AntennaOn(void);
 void MFRC522_PCD_AntennaOff(void);
+void MFRC522_PCD_IrqCallback(void);
+void MFRC522_PCD_SoftPowerDown(void);
+void MFRC522_PCD_SoftPowerUp(void);
 
 /////////////////////////////////////////////////////////////////////////////////////
 // Basic interface functions for communicating with the MFRC522
@@ -128,6 +170,7 @@ void MFRC522_PCD_Write(uint8_t reg_addr, uint8_t value);
 void MFRC522_PCD_WriteArray(uint8_t reg_addr, uint8_t *data, uint8_t length);
 uint8_t MFRC522_PCD_Read(uint8_t reg_addr);
 void MFRC522_PCD_ReadArray(uint8_t reg_addr, uint8_t* data, uint8_t count);
+void MFRC522_PCD_ReadMulti(const uint8_t *reg_addrs, uint8_t *values, uint8_t count);
 void MFRC522_PCD_SetBitMask(uint8_t reg, uint8_t mask);
 void MFRC522_PCD_ClearBitMask(uint8_t reg, uint8_t mask);
 uint8_t MFRC522_PCD_CalculateCRC(uint8_t *p_data, uint8_t len, uint8_t *result);
@@ -136,12 +179,27 @@ uint8_t MFRC522_PCD_CalculateCRC(uint8_t *p_data, uint8_t len, uint8_t *result);
 // Functions for communicating with PICCs
 /////////////////////////////////////////////////////////////////////////////////////
 uint8_t MFRC522_PICC_RequestA(uint8_t req_mode, uint8_t *tag_type);
+uint8_t MFRC522_PICC_Detect(uint8_t *tag_type);
+void MFRC522_PICC_DetectRestart(void);
+uint16_t MFRC522_PICC_DetectNextMs(void);
 uint8_t MFRC522_PICC_ToCard(uint8_t command, uint8_t *send_data, uint8_t send_len, uint8_t *back_data, uint8_t *back_len);
-uint8_t MFRC522_PICC_Anticollision(uint8_t *p_ser_num);
+uint8_t MFRC522_PICC_Select(PICC_Uid *uid);
+uint8_t MFRC522_PICC_HaltA(void);
+uint8_t MFRC522_PICC_Inventory(uint8_t *tag_type, PICC_Uid *tags, uint8_t max);
+
+/////////////////////////////////////////////////////////////////////////////////////
+// MIFARE Classic
+/////////////////////////////////////////////////////////////////////////////////////
+uint8_t MFRC522_PCD_Authenticate(uint8_t command, uint8_t block_addr, const MIFARE_Key *key, const PICC_Uid *uid);
+void MFRC522_PCD_StopCrypto1(void);
+void MFRC522_MIFARE_BeginSession(const PICC_Uid *uid, uint8_t key_type, const MIFARE_Key *key);
+uint8_t MFRC522_MIFARE_Read(uint8_t block_addr, uint8_t *buffer);
+uint8_t MFRC522_MIFARE_Write(uint8_t block_addr, const uint8_t *buffer);
+void MFRC522_MIFARE_EndSession(void);
 
 /////////////////////////////////////////////////////////////////////////////////////
 // Debug functions
 /////////////////////////////////////////////////////////////////////////////////////
-void MFRC522_PCD_GetVersion(uint8_t* buf, uint8_t buf_size);
+void MFRC522_PCD_GetVersion(char* buf, uint8_t buf_size);
 
 #endif /* MFRC522_H_ */
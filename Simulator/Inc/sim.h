@@ -0,0 +1,166 @@
+/**
+ ******************************************************************************
+  * @file    sim.h
+  * @brief   Host-side simulator of the attendance terminal.
+  *          The firmware sources are compiled unchanged for Linux and linked
+  *          against a stub HAL (sim_hal.c) and virtual SPI slaves:
+  *          MFRC522 (sim_mfrc522.c), ILI9163 (sim_ili9163.c) and an SD card
+  *          backed by an image file (sim_sdcard.c).
+  ******************************************************************************
+  *
+  * Time is virtual. Every HAL call charges the CPU cycles it would cost on the
+  * STM32F303K8 and every SPI byte charges its bus time at the SCLK programmed
+  * in SPI1->CR1, so the reported latencies follow the firmware's real access
+  * pattern rather than the speed of the host.
+  */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "stm32f3xx_hal.h"
+
+/* Virtual time is kept in picoseconds, so one cycle is exact up to 64 MHz */
+typedef uint64_t SimTime;
+
+#define SIM_NS(x)	((SimTime)(x) * 1000ULL)
+#define SIM_US(x)	((SimTime)(x) * 1000000ULL)
+#define SIM_MS(x)	((SimTime)(x) * 1000000000ULL)
+
+/* CPU cost of HAL calls in core cycles (STM32F3 HAL built with -Os) */
+#define SIM_CYC_CALL			40		// Any HAL call that is not listed below
+#define SIM_CYC_GPIO_WRITE		16		// HAL_GPIO_WritePin()
+#define SIM_CYC_GET_TICK		8		// HAL_GetTick()
+#define SIM_CYC_SPI_CALL		120		// Entry and exit of a blocking HAL_SPI_xxx() call
+#define SIM_CYC_SPI_BYTE		48		// Polling loop per byte of a blocking HAL_SPI_xxx() call
+#define SIM_CYC_DMA_SETUP		300		// HAL_SPI_xxx_DMA(): channel setup and start
+#define SIM_CYC_RTC_GET			150		// HAL_RTC_GetTime() / HAL_RTC_GetDate()
+#define SIM_CYC_IRQ_ENTRY		24		// Exception entry plus exit
+
+/* Time the supply capacitors keep the board alive after the PVD interrupt */
+#define SIM_PVD_HOLDUP			SIM_MS(20)
+
+/* Trace categories for --trace */
+#define SIM_TRACE_SD		0x01
+#define SIM_TRACE_RFID		0x02
+#define SIM_TRACE_LCD		0x04
+#define SIM_TRACE_IRQ		0x08
+#define SIM_TRACE_UART		0x10
+
+/* Where the bus time is booked in the final report */
+typedef enum
+{
+	SIM_ACC_CPU = 0,
+	SIM_ACC_DELAY,
+	SIM_ACC_SLEEP,
+	SIM_ACC_STOP,
+	SIM_ACC_SPI_SD,
+	SIM_ACC_SPI_RFID,
+	SIM_ACC_SPI_LCD,
+	SIM_ACC_SPI_NONE,
+	SIM_ACC_UART,
+	SIM_ACC_COUNT
+} SimAccount;
+
+/**
+ * @brief A virtual slave on the SPI1 bus, selected by an active-low CS line.
+ */
+typedef struct SimSpiDevice
+{
+	const char *name;
+	GPIO_TypeDef *cs_port;
+	uint16_t cs_pin;
+	SimAccount account;
+	uint32_t max_sclk;					// Highest SCLK in Hz the slave is specified for
+
+	void (*select)(int selected);		// CS edge
+	uint8_t (*exchange)(uint8_t mosi);	// One full-duplex byte while selected
+
+	uint64_t bytes;
+	uint64_t transactions;
+	struct SimSpiDevice *next;
+} SimSpiDevice;
+
+/* Scheduled callback, used for device completions and DMA transfers */
+typedef void (*SimTimerCallback)(void *ctx);
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Core: virtual time, interrupts, scheduler (sim_core.c)
+/////////////////////////////////////////////////////////////////////////////////////
+extern SimTime sim_now;
+extern uint32_t sim_trace;
+
+void Sim_MapPeripherals(void);
+void Sim_Advance(SimTime duration, SimAccount account);
+void Sim_Cycles(uint32_t cycles);
+void Sim_Schedule(SimTime at, SimTimerCallback callback, void *ctx);
+void Sim_Cancel(SimTimerCallback callback, void *ctx);
+void Sim_WaitForInterrupt(SimAccount account);
+void Sim_SetIrqPending(IRQn_Type irq);
+void Sim_SetIrqEnabled(IRQn_Type irq, int enabled);
+void Sim_DisableIrq(void);
+void Sim_EnableIrq(void);
+uint32_t Sim_GetPrimask(void);
+void Sim_SetPrimask(uint32_t primask);
+uint32_t Sim_CoreClock(void);
+uint32_t Sim_Pclk2(void);
+void Sim_Trace(uint32_t category, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void Sim_Fatal(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+void Sim_Finish(int status) __attribute__((noreturn));
+void Sim_SetEndTime(SimTime end);
+double Sim_Ms(SimTime t);
+
+/////////////////////////////////////////////////////////////////////////////////////
+// GPIO and SPI bus (sim_hal.c)
+/////////////////////////////////////////////////////////////////////////////////////
+void Sim_GpioDrive(GPIO_TypeDef *port, uint16_t pin, int level);
+int Sim_GpioOutput(GPIO_TypeDef *port, uint16_t pin);
+void Sim_GpioWatch(GPIO_TypeDef *port, uint16_t pin, void (*changed)(int level));
+void Sim_SpiAttach(SimSpiDevice *device);
+uint8_t Sim_SpiExchange(uint8_t mosi);
+SimTime Sim_SpiByteTime(void);
+SimSpiDevice *Sim_SpiDevices(void);
+void Sim_UartOpen(const char *path);
+void Sim_UartReceive(const char *line);
+void Sim_RtcSkip(int64_t seconds);
+void Sim_PowerFail(void);
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Virtual devices
+/////////////////////////////////////////////////////////////////////////////////////
+#define SIM_UID_MAX 10
+
+void Sim_Mfrc522Attach(void);
+int Sim_PiccEnter(const uint8_t *uid, uint8_t uid_len, uint8_t sak);
+void Sim_PiccLeave(const uint8_t *uid, uint8_t uid_len);
+void Sim_PiccLeaveAll(void);
+uint32_t Sim_PiccSelections(void);
+void Sim_Mfrc522Report(FILE *out);
+
+void Sim_Ili9163Attach(void);
+void Sim_Ili9163Text(char *buf, size_t size);
+int Sim_Ili9163DumpPpm(const char *path);
+uint64_t Sim_Ili9163Pixels(void);
+void Sim_Ili9163Report(FILE *out);
+
+int Sim_SdAttach(const char *image, uint32_t size_mb);
+void Sim_SdFlush(void);
+void Sim_SdSetPresent(int inserted);
+uint32_t Sim_SdBlocksWritten(void);
+uint32_t Sim_SdBlocksRead(void);
+SimTime Sim_SdLastWrite(void);
+int Sim_SdFormat(void);
+void Sim_SdList(FILE *out);
+int Sim_SdGet(const char *name, const char *host_path);
+int Sim_SdPut(const char *host_path);
+void Sim_SdReport(FILE *out);
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Scenario and report (sim_main.c)
+/////////////////////////////////////////////////////////////////////////////////////
+void Sim_OnUidRead(const uint8_t *uid, uint8_t uid_len);
+void Sim_OnLcdText(const char *text);
+void Sim_Report(FILE *out);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+  * @file    sim_cmsis.h
+  * @brief   Host override of the CMSIS GCC intrinsics.
+  *          Force-included ahead of every firmware source (-include). The real
+  *          cmsis_gcc.h provides the compiler macros; the Cortex-M instructions
+  *          that the firmware executes (cpsid, wfi, dsb, ...) are routed to the
+  *          simulator core instead of inline assembly.
+  ******************************************************************************
+  */
+
+#ifndef SIM_CMSIS_H_
+#define SIM_CMSIS_H_
+
+#include <stdint.h>
+#include <cmsis_gcc.h>
+
+void Sim_DisableIrq(void);
+void Sim_EnableIrq(void);
+uint32_t Sim_GetPrimask(void);
+void Sim_SetPrimask(uint32_t primask);
+void Sim_WaitForInterruptCpu(void);
+
+#define __disable_irq()			Sim_DisableIrq()
+#define __enable_irq()			Sim_EnableIrq()
+#define __get_PRIMASK()			Sim_GetPrimask()
+#define __set_PRIMASK(x)		Sim_SetPrimask(x)
+
+#undef __NOP
+#undef __WFI
+#undef __WFE
+#undef __SEV
+#define __NOP()					do { } while (0)
+#define __WFI()					Sim_WaitForInterruptCpu()
+#define __WFE()					Sim_WaitForInterruptCpu()
+#define __SEV()					do { } while (0)
+
+#define __ISB()					__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __DSB()					__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __DMB()					__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif /* SIM_CMSIS_H_ */
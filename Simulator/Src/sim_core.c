@@ -0,0 +1,596 @@
+/**
+ ******************************************************************************
+  * @file    sim_core.c
+  * @brief   Virtual time base, event scheduler and interrupt controller of the
+  *          host simulator.
+  ******************************************************************************
+  *
+  * The firmware runs on the host thread. Whenever it calls into the stub HAL,
+  * virtual time advances by the cost of that call. While time advances, due
+  * scheduler entries run, SysTick counts down and fires every millisecond and pending
+  * interrupts are delivered to the firmware's IRQ handlers in priority order,
+  * exactly where the Cortex-M4 would preempt the thread.
+  */
+
+#include <execinfo.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define SIM_IRQ_COUNT	96
+#define SIM_TICK_PERIOD	SIM_MS(1)
+#define SIM_THREAD_PRIO	0x100
+
+SimTime sim_now;
+uint32_t sim_trace;
+
+typedef struct SimTimer
+{
+	SimTime at;
+	SimTimerCallback callback;
+	void *ctx;
+	struct SimTimer *next;
+} SimTimer;
+
+static SimTimer *timers;
+static SimTime end_time = ~0ULL;
+static SimTime accounts[SIM_ACC_COUNT];
+static const char *account_names[SIM_ACC_COUNT] = {
+	"cpu", "HAL_Delay", "sleep", "stop", "spi sd", "spi rfid", "spi lcd", "spi idle", "uart"
+};
+
+static uint8_t irq_pending[SIM_IRQ_COUNT];
+static uint8_t irq_enabled[SIM_IRQ_COUNT];
+static uint8_t systick_pending;
+static uint32_t primask;
+static uint32_t running_prio = SIM_THREAD_PRIO;
+static uint64_t irqs_taken;
+static SimTime next_tick = SIM_TICK_PERIOD;
+static SimTime cycle_rest;		// Time not yet counted as a whole DWT cycle
+
+static volatile uint64_t progress;
+static uint64_t progress_seen;
+
+/* Firmware vector table; handlers the firmware does not define stay NULL */
+extern void SysTick_Handler(void) __attribute__((weak));
+extern void PVD_IRQHandler(void) __attribute__((weak));
+extern void EXTI0_IRQHandler(void) __attribute__((weak));
+extern void EXTI1_IRQHandler(void) __attribute__((weak));
+extern void EXTI2_TSC_IRQHandler(void) __attribute__((weak));
+extern void EXTI3_IRQHandler(void) __attribute__((weak));
+extern void EXTI4_IRQHandler(void) __attribute__((weak));
+extern void EXTI9_5_IRQHandler(void) __attribute__((weak));
+extern void EXTI15_10_IRQHandler(void) __attribute__((weak));
+extern void RTC_WKUP_IRQHandler(void) __attribute__((weak));
+extern void RTC_Alarm_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel1_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel2_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel3_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel4_IRQHandler(void) __attribute__((weak));
+extern void DMA1_Channel5_IRQHandler(void) __attribute__((weak));
+extern void SPI1_IRQHandler(void) __attribute__((weak));
+extern void USART2_IRQHandler(void) __attribute__((weak));
+extern void TIM6_DAC1_IRQHandler(void) __attribute__((weak));
+extern void TIM7_DAC2_IRQHandler(void) __attribute__((weak));
+
+static void (*vector(IRQn_Type irq))(void)
+{
+	switch (irq)
+	{
+		case PVD_IRQn:				return PVD_IRQHandler;
+		case EXTI0_IRQn:			return EXTI0_IRQHandler;
+		case EXTI1_IRQn:			return EXTI1_IRQHandler;
+		case EXTI2_TSC_IRQn:		return EXTI2_TSC_IRQHandler;
+		case EXTI3_IRQn:			return EXTI3_IRQHandler;
+		case EXTI4_IRQn:			return EXTI4_IRQHandler;
+		case EXTI9_5_IRQn:			return EXTI9_5_IRQHandler;
+		case EXTI15_10_IRQn:		return EXTI15_10_IRQHandler;
+		case RTC_WKUP_IRQn:			return RTC_WKUP_IRQHandler;
+		case RTC_Alarm_IRQn:		return RTC_Alarm_IRQHandler;
+		case DMA1_Channel1_IRQn:	return DMA1_Channel1_IRQHandler;
+		case DMA1_Channel2_IRQn:	return DMA1_Channel2_IRQHandler;
+		case DMA1_Channel3_IRQn:	return DMA1_Channel3_IRQHandler;
+		case DMA1_Channel4_IRQn:	return DMA1_Channel4_IRQHandler;
+		case DMA1_Channel5_IRQn:	return DMA1_Channel5_IRQHandler;
+		case SPI1_IRQn:				return SPI1_IRQHandler;
+		case USART2_IRQn:			return USART2_IRQHandler;
+		case TIM6_DAC1_IRQn:		return TIM6_DAC1_IRQHandler;
+		case TIM7_DAC2_IRQn:		return TIM7_DAC2_IRQHandler;
+		default:					return NULL;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Memory map
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Backs the STM32F303K8 address ranges that the firmware dereferences
+ *        (flash, system memory, peripherals, Cortex-M system control space)
+ *        with host memory at the very same addresses.
+ * @note  The CMSIS device header casts fixed addresses such as SPI1_BASE to
+ *        register structs. Mapping those ranges lets the unmodified headers
+ *        and register macros work; the stub HAL gives them behaviour.
+ */
+void Sim_MapPeripherals(void)
+{
+	static const struct { uintptr_t base; size_t size; uint8_t fill; } regions[] = {
+		{ 0x08000000UL, 0x10000UL, 0xFF },	// Main flash, erased
+		{ 0x1FFFF000UL, 0x01000UL, 0x00 },	// System memory (UID, flash size)
+		{ 0x40000000UL, 0x24000UL, 0x00 },	// APB1, APB2, AHB1 (DMA, RCC, FLASH, CRC)
+		{ 0x42420000UL, 0x08000UL, 0x00 },	// Bit-band alias of RCC (RTCEN), not mirrored
+		{ 0x48000000UL, 0x02000UL, 0x00 },	// AHB2 GPIO ports
+		{ 0xE0001000UL, 0x01000UL, 0x00 },	// DWT (cycle counter)
+		{ 0xE000E000UL, 0x01000UL, 0x00 },	// System control space (SysTick, NVIC, SCB)
+		{ 0xE0042000UL, 0x01000UL, 0x00 },	// DBGMCU
+	};
+
+	for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+	{
+		void *p = mmap((void *)regions[i].base, regions[i].size, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (p == MAP_FAILED || (uintptr_t)p != regions[i].base)
+			Sim_Fatal("cannot map 0x%08lx for the peripheral space", (unsigned long)regions[i].base);
+		memset(p, regions[i].fill, regions[i].size);
+	}
+
+	*(volatile uint16_t *)FLASHSIZE_BASE = 64;
+	*(volatile uint32_t *)(UID_BASE + 0) = 0x00400031;
+	*(volatile uint32_t *)(UID_BASE + 4) = 0x32385112;
+	*(volatile uint32_t *)(UID_BASE + 8) = 0x20363046;
+
+	RCC->CR = RCC_CR_HSION | RCC_CR_HSIRDY;
+	DBGMCU->IDCODE = 0x10016438;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Clocks
+/////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t Sim_CoreClock(void)
+{
+	return SystemCoreClock ? SystemCoreClock : HSI_VALUE;
+}
+
+uint32_t Sim_Pclk2(void)
+{
+	return Sim_CoreClock() >> APBPrescTable[(RCC->CFGR & RCC_CFGR_PPRE2) >> RCC_CFGR_PPRE2_Pos];
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Scheduler
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Runs callback(ctx) once virtual time reaches at.
+ */
+void Sim_Schedule(SimTime at, SimTimerCallback callback, void *ctx)
+{
+	SimTimer *t = malloc(sizeof(*t));
+	SimTimer **pp = &timers;
+
+	if (t == NULL)
+		Sim_Fatal("out of memory");
+
+	t->at = at;
+	t->callback = callback;
+	t->ctx = ctx;
+
+	while (*pp && (*pp)->at <= at)
+		pp = &(*pp)->next;
+	t->next = *pp;
+	*pp = t;
+}
+
+/**
+ * @brief Removes every pending entry with the given callback and context.
+ */
+void Sim_Cancel(SimTimerCallback callback, void *ctx)
+{
+	SimTimer **pp = &timers;
+
+	while (*pp)
+	{
+		if ((*pp)->callback == callback && (*pp)->ctx == ctx)
+		{
+			SimTimer *dead = *pp;
+			*pp = dead->next;
+			free(dead);
+		}
+		else
+		{
+			pp = &(*pp)->next;
+		}
+	}
+}
+
+void Sim_SetEndTime(SimTime end)
+{
+	end_time = end;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Interrupts
+/////////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t irq_priority(IRQn_Type irq)
+{
+	return NVIC_GetPriority(irq);
+}
+
+static int systick_running(void)
+{
+	return (SysTick->CTRL & (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk))
+			== (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk);
+}
+
+void Sim_SetIrqPending(IRQn_Type irq)
+{
+	if (irq >= 0 && irq < SIM_IRQ_COUNT)
+		irq_pending[irq] = 1;
+}
+
+void Sim_SetIrqEnabled(IRQn_Type irq, int enabled)
+{
+	if (irq >= 0 && irq < SIM_IRQ_COUNT)
+		irq_enabled[irq] = enabled ? 1 : 0;
+}
+
+/**
+ * @brief Checks for an interrupt that wakes WFI: one that could preempt the
+ *        running context if PRIMASK were clear. Inside a handler a pending
+ *        interrupt of the same or lower priority does not wake the core.
+ */
+static int irq_waiting(void)
+{
+	if (systick_pending && irq_priority(SysTick_IRQn) < running_prio)
+		return 1;
+	for (int i = 0; i < SIM_IRQ_COUNT; i++)
+		if (irq_pending[i] && irq_enabled[i] && irq_priority((IRQn_Type)i) < running_prio)
+			return 1;
+	return 0;
+}
+
+/**
+ * @brief Takes every pending interrupt that may preempt the running context.
+ */
+static void service_irqs(void)
+{
+	for (;;)
+	{
+		int best = -2;
+		uint32_t best_prio = running_prio;
+
+		if (primask)
+			return;
+
+		if (systick_pending && irq_priority(SysTick_IRQn) < best_prio)
+		{
+			best = SysTick_IRQn;
+			best_prio = irq_priority(SysTick_IRQn);
+		}
+		for (int i = 0; i < SIM_IRQ_COUNT; i++)
+		{
+			if (irq_pending[i] && irq_enabled[i] && irq_priority((IRQn_Type)i) < best_prio)
+			{
+				best = i;
+				best_prio = irq_priority((IRQn_Type)i);
+			}
+		}
+		if (best == -2)
+			return;
+
+		uint32_t saved = running_prio;
+		void (*handler)(void);
+
+		if (best == SysTick_IRQn)
+		{
+			systick_pending = 0;
+			handler = SysTick_Handler;
+		}
+		else
+		{
+			irq_pending[best] = 0;
+			handler = vector((IRQn_Type)best);
+			Sim_Trace(SIM_TRACE_IRQ, "irq %d", best);
+		}
+
+		irqs_taken++;
+		running_prio = best_prio;
+		if (handler)
+			handler();
+		else
+			Sim_Trace(SIM_TRACE_IRQ, "irq %d has no handler", best);
+		running_prio = saved;
+		Sim_Cycles(SIM_CYC_IRQ_ENTRY);
+	}
+}
+
+void Sim_DisableIrq(void)
+{
+	primask = 1;
+}
+
+void Sim_EnableIrq(void)
+{
+	primask = 0;
+	service_irqs();
+}
+
+uint32_t Sim_GetPrimask(void)
+{
+	return primask;
+}
+
+void Sim_SetPrimask(uint32_t value)
+{
+	primask = value & 1;
+	if (!primask)
+		service_irqs();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Time
+/////////////////////////////////////////////////////////////////////////////////////
+
+static SimTime next_event(SimTime limit)
+{
+	SimTime next = limit;
+
+	if (timers && timers->at < next)
+		next = timers->at;
+	if (systick_running() && next_tick < next)
+		next = next_tick;
+	if (end_time < next)
+		next = end_time;
+	return next;
+}
+
+static void process_due(void)
+{
+	if (sim_now >= end_time)
+		Sim_Finish(0);
+
+	while (timers && timers->at <= sim_now)
+	{
+		SimTimer *t = timers;
+		timers = t->next;
+		t->callback(t->ctx);
+		free(t);
+	}
+
+	if (sim_now >= next_tick)
+	{
+		if (systick_running())
+			systick_pending = 1;
+		next_tick = (sim_now / SIM_TICK_PERIOD + 1) * SIM_TICK_PERIOD;
+	}
+
+	service_irqs();
+}
+
+/**
+ * @brief Counts DWT->CYCCNT while the core runs, like on the target it stops in sleep and STOP.
+ */
+static void count_cycles(SimTime duration, SimAccount account)
+{
+	unsigned __int128 total;
+
+	if (account == SIM_ACC_SLEEP || account == SIM_ACC_STOP || !(CoreDebug->DEMCR & CoreDebug_DEMCR_TRCENA_Msk) || !(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+		return;
+
+	total = (unsigned __int128)(duration + cycle_rest) * Sim_CoreClock();
+	DWT->CYCCNT += (uint32_t)(total / 1000000000000ULL);
+	cycle_rest = (SimTime)(total % 1000000000000ULL / Sim_CoreClock());
+}
+
+/**
+ * @brief Counts SysTick->VAL down with the virtual time while SysTick is enabled, it reloads on every tick.
+ */
+static void count_systick(void)
+{
+	uint64_t reload = (uint64_t)(SysTick->LOAD & SysTick_LOAD_RELOAD_Msk) + 1;
+
+	if (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)
+		SysTick->VAL = (uint32_t)(reload - 1 - (sim_now % SIM_TICK_PERIOD) * reload / SIM_TICK_PERIOD);
+}
+
+/**
+ * @brief Moves virtual time forward and books it to the given account.
+ * @note  Interrupts that become due on the way are delivered before the call
+ *        returns, so interrupt handlers run "inside" the HAL call just like a
+ *        preempted thread on the target.
+ */
+void Sim_Advance(SimTime duration, SimAccount account)
+{
+	SimTime target = sim_now + duration;
+
+	progress++;
+	while (sim_now < target)
+	{
+		SimTime next = next_event(target);
+
+		accounts[account] += next - sim_now;
+		count_cycles(next - sim_now, account);
+		sim_now = next;
+		count_systick();
+		process_due();
+	}
+	process_due();
+}
+
+/**
+ * @brief Charges the given number of core cycles at the current HCLK.
+ */
+void Sim_Cycles(uint32_t cycles)
+{
+	Sim_Advance((SimTime)cycles * 1000000000000ULL / Sim_CoreClock(), SIM_ACC_CPU);
+}
+
+/**
+ * @brief Sleeps until an enabled interrupt is pending (WFI semantics).
+ * @note  If nothing can ever wake the core the scenario is over.
+ */
+void Sim_WaitForInterrupt(SimAccount account)
+{
+	progress++;
+	while (!irq_waiting())
+	{
+		SimTime next = next_event(~0ULL);
+
+		accounts[account] += next - sim_now;
+		sim_now = next;
+		count_systick();
+		if (sim_now >= end_time)
+			Sim_Finish(0);
+		while (timers && timers->at <= sim_now)
+		{
+			SimTimer *t = timers;
+			timers = t->next;
+			t->callback(t->ctx);
+			free(t);
+		}
+		if (sim_now >= next_tick)
+		{
+			if (systick_running())
+				systick_pending = 1;
+			next_tick = (sim_now / SIM_TICK_PERIOD + 1) * SIM_TICK_PERIOD;
+		}
+	}
+	service_irqs();
+}
+
+void Sim_WaitForInterruptCpu(void)
+{
+	Sim_WaitForInterrupt(SIM_ACC_SLEEP);
+}
+
+double Sim_Ms(SimTime t)
+{
+	return (double)t / 1e9;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Diagnostics
+/////////////////////////////////////////////////////////////////////////////////////
+
+void Sim_Trace(uint32_t category, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!(sim_trace & category))
+		return;
+
+	fprintf(stderr, "[%12.3f ms] ", Sim_Ms(sim_now));
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void Sim_Fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "rfid_sim: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(3);
+}
+
+/**
+ * @brief Prints the virtual time budget, split by account.
+ */
+static void report_accounts(FILE *out)
+{
+	SimTime total = 0;
+
+	for (int i = 0; i < SIM_ACC_COUNT; i++)
+		total += accounts[i];
+
+	fprintf(out, "\ntime budget        ms        %%\n");
+	for (int i = 0; i < SIM_ACC_COUNT; i++)
+	{
+		if (accounts[i] == 0)
+			continue;
+		fprintf(out, "  %-10s %12.3f %7.2f\n", account_names[i], Sim_Ms(accounts[i]),
+				total ? 100.0 * (double)accounts[i] / (double)total : 0.0);
+	}
+	fprintf(out, "  interrupts taken: %llu\n", (unsigned long long)irqs_taken);
+}
+
+void Sim_Finish(int status)
+{
+	static int finishing;
+
+	if (!finishing)
+	{
+		finishing = 1;
+		Sim_Report(stdout);
+		report_accounts(stdout);
+		Sim_SdFlush();
+	}
+	fflush(NULL);
+	exit(status);
+}
+
+/**
+ * @brief Watchdog on real time: a firmware that spins without calling the HAL
+ *        (Error_Handler, a register polling loop on a dead device) never
+ *        advances virtual time, so it is reported as a stall.
+ */
+static void watchdog(int sig)
+{
+	(void)sig;
+	if (progress == progress_seen)
+	{
+		fprintf(stderr, "rfid_sim: firmware stalled at %.3f ms (primask=%u), Error_Handler()?\n",
+				Sim_Ms(sim_now), (unsigned)primask);
+		Sim_Report(stdout);
+		report_accounts(stdout);
+		Sim_SdFlush();
+		fflush(NULL);
+		_exit(2);
+	}
+	progress_seen = progress;
+}
+
+/**
+ * @brief An access outside the mapped peripheral space is a bus fault on the
+ *        target, report where it happened.
+ */
+static void bus_fault(int sig, siginfo_t *info, void *uctx)
+{
+	void *frames[32];
+	int depth = backtrace(frames, 32);
+
+	(void)sig;
+	(void)uctx;
+	fprintf(stderr, "rfid_sim: bus fault at address %p, %.3f ms\n", info->si_addr, Sim_Ms(sim_now));
+	backtrace_symbols_fd(frames, depth, 2);
+	_exit(2);
+}
+
+__attribute__((constructor))
+static void start_watchdog(void)
+{
+	struct itimerval period = { { 2, 0 }, { 2, 0 } };
+	struct sigaction fault = { .sa_sigaction = bus_fault, .sa_flags = SA_SIGINFO };
+
+	sigaction(SIGSEGV, &fault, NULL);
+	sigaction(SIGBUS, &fault, NULL);
+	signal(SIGALRM, watchdog);
+	setitimer(ITIMER_REAL, &period, NULL);
+}
@@ -0,0 +1,1447 @@
+/**
+ ******************************************************************************
+  * @file    sim_hal.c
+  * @brief   Stub of the STM32F3 HAL used by the host simulator.
+  ******************************************************************************
+  *
+  * Only the HAL functions the firmware calls are provided. Each one keeps the
+  * semantics of the original driver (state fields, return codes, callbacks)
+  * and charges the time it would take on the target to the virtual clock.
+  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+/////////////////////////////////////////////////////////////////////////////////////
+// HAL core and SysTick
+/////////////////////////////////////////////////////////////////////////////////////
+
+__IO uint32_t uwTick;
+uint32_t uwTickPrio = (1UL << __NVIC_PRIO_BITS);
+HAL_TickFreqTypeDef uwTickFreq = HAL_TICK_FREQ_DEFAULT;
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+	FLASH->ACR |= FLASH_ACR_PRFTBE;
+	HAL_NVIC_SetPriorityGrouping(NVIC_PRIORITYGROUP_4);
+	HAL_InitTick(TICK_INT_PRIORITY);
+	HAL_MspInit();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_InitTick(uint32_t TickPriority)
+{
+	if (SysTick_Config(SystemCoreClock / (1000U / uwTickFreq)) > 0U)
+		return HAL_ERROR;
+	if (TickPriority >= (1UL << __NVIC_PRIO_BITS))
+		return HAL_ERROR;
+
+	HAL_NVIC_SetPriority(SysTick_IRQn, TickPriority, 0U);
+	uwTickPrio = TickPriority;
+	return HAL_OK;
+}
+
+void HAL_IncTick(void)
+{
+	uwTick += uwTickFreq;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	Sim_Cycles(SIM_CYC_GET_TICK);
+	return uwTick;
+}
+
+uint32_t HAL_GetTickPrio(void)
+{
+	return uwTickPrio;
+}
+
+/**
+ * @brief Busy wait on uwTick like the original HAL_Delay().
+ * @note  With SysTick suspended the original never returns; this is reported
+ *        as a stall instead of hanging the host.
+ */
+void HAL_Delay(uint32_t Delay)
+{
+	uint32_t tickstart = uwTick;
+	uint32_t wait = Delay;
+
+	Sim_Cycles(SIM_CYC_CALL);
+	if (wait < HAL_MAX_DELAY)
+		wait += (uint32_t)uwTickFreq;
+
+	if ((SysTick->CTRL & SysTick_CTRL_TICKINT_Msk) == 0U || Sim_GetPrimask())
+	{
+		Sim_Trace(SIM_TRACE_IRQ, "HAL_Delay(%u) with SysTick stopped", (unsigned)Delay);
+		Sim_Fatal("HAL_Delay(%u) called while SysTick is suspended, the target hangs here", (unsigned)Delay);
+	}
+
+	while ((uwTick - tickstart) < wait)
+		Sim_Advance(SIM_MS(1) - sim_now % SIM_MS(1), SIM_ACC_DELAY);
+}
+
+void HAL_SuspendTick(void)
+{
+	CLEAR_BIT(SysTick->CTRL, SysTick_CTRL_TICKINT_Msk);
+}
+
+void HAL_ResumeTick(void)
+{
+	SET_BIT(SysTick->CTRL, SysTick_CTRL_TICKINT_Msk);
+}
+
+uint32_t HAL_GetUIDw0(void) { return READ_REG(*((uint32_t *)UID_BASE)); }
+uint32_t HAL_GetUIDw1(void) { return READ_REG(*((uint32_t *)(UID_BASE + 4U))); }
+uint32_t HAL_GetUIDw2(void) { return READ_REG(*((uint32_t *)(UID_BASE + 8U))); }
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Cortex
+/////////////////////////////////////////////////////////////////////////////////////
+
+void HAL_NVIC_SetPriorityGrouping(uint32_t PriorityGroup)
+{
+	NVIC_SetPriorityGrouping(PriorityGroup);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+	uint32_t group = NVIC_GetPriorityGrouping();
+
+	NVIC_SetPriority(IRQn, NVIC_EncodePriority(group, PreemptPriority, SubPriority));
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+	NVIC_EnableIRQ(IRQn);
+	Sim_SetIrqEnabled(IRQn, 1);
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+	NVIC_DisableIRQ(IRQn);
+	Sim_SetIrqEnabled(IRQn, 0);
+}
+
+void HAL_NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+	Sim_SetIrqPending(IRQn);
+	Sim_Cycles(0);
+}
+
+void HAL_NVIC_ClearPendingIRQ(IRQn_Type IRQn)
+{
+	NVIC_ClearPendingIRQ(IRQn);
+}
+
+uint32_t HAL_SYSTICK_Config(uint32_t TicksNumb)
+{
+	return SysTick_Config(TicksNumb);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// GPIO
+/////////////////////////////////////////////////////////////////////////////////////
+
+#define SIM_GPIO_PORTS	6
+#define SIM_WATCH_MAX	16
+
+typedef struct
+{
+	GPIO_TypeDef *port;
+	uint16_t pin;
+	void (*changed)(int level);
+} GpioWatch;
+
+static uint16_t gpio_output[SIM_GPIO_PORTS];	// Output data latch
+static uint16_t gpio_is_output[SIM_GPIO_PORTS];
+static uint16_t gpio_input[SIM_GPIO_PORTS];		// Level driven from outside
+static GpioWatch watches[SIM_WATCH_MAX];
+static int watch_count;
+
+/* EXTI configuration per line, as programmed by HAL_GPIO_Init() */
+static uint16_t exti_rising;
+static uint16_t exti_falling;
+static uint16_t exti_masked_in;
+static uint8_t exti_port[16];
+static uint16_t exti_pending;
+
+static int gpio_index(GPIO_TypeDef *port)
+{
+	int index = (int)(((uintptr_t)port - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE));
+
+	if (index < 0 || index >= SIM_GPIO_PORTS)
+		Sim_Fatal("access to an unknown GPIO port %p", (void *)port);
+	return index;
+}
+
+static IRQn_Type exti_irq(uint16_t line)
+{
+	switch (line)
+	{
+		case 0:		return EXTI0_IRQn;
+		case 1:		return EXTI1_IRQn;
+		case 2:		return EXTI2_TSC_IRQn;
+		case 3:		return EXTI3_IRQn;
+		case 4:		return EXTI4_IRQn;
+		default:	return line < 10 ? EXTI9_5_IRQn : EXTI15_10_IRQn;
+	}
+}
+
+static int gpio_level(int index, uint16_t pin)
+{
+	uint16_t levels = (gpio_output[index] & gpio_is_output[index]) | (gpio_input[index] & ~gpio_is_output[index]);
+
+	return (levels & pin) ? 1 : 0;
+}
+
+static void gpio_mirror(int index)
+{
+	GPIO_TypeDef *port = (GPIO_TypeDef *)(GPIOA_BASE + (uint32_t)index * (GPIOB_BASE - GPIOA_BASE));
+
+	port->ODR = gpio_output[index];
+	port->IDR = (gpio_output[index] & gpio_is_output[index]) | (gpio_input[index] & ~gpio_is_output[index]);
+	EXTI->PR = exti_pending;
+}
+
+static void gpio_notify(GPIO_TypeDef *port, uint16_t pins, int index)
+{
+	for (int i = 0; i < watch_count; i++)
+		if (watches[i].port == port && (watches[i].pin & pins))
+			watches[i].changed(gpio_level(index, watches[i].pin));
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+	int index = gpio_index(GPIOx);
+
+	Sim_Cycles(SIM_CYC_CALL * 4);
+
+	for (uint16_t line = 0; line < 16; line++)
+	{
+		uint16_t pin = (uint16_t)(1U << line);
+
+		if (!(GPIO_Init->Pin & pin))
+			continue;
+
+		if ((GPIO_Init->Mode & GPIO_MODE) == MODE_OUTPUT)
+			gpio_is_output[index] |= pin;
+		else
+			gpio_is_output[index] &= (uint16_t)~pin;
+
+		if ((GPIO_Init->Mode & GPIO_MODE) == MODE_INPUT)
+		{
+			// Nothing drives the pin yet; the pull resistor decides the level
+			if (GPIO_Init->Pull == GPIO_PULLUP)
+				gpio_input[index] |= pin;
+			else if (GPIO_Init->Pull == GPIO_PULLDOWN)
+				gpio_input[index] &= (uint16_t)~pin;
+		}
+
+		MODIFY_REG(GPIOx->MODER, GPIO_MODER_MODER0 << (line * 2U), (GPIO_Init->Mode & GPIO_MODE) << (line * 2U));
+		MODIFY_REG(GPIOx->PUPDR, GPIO_PUPDR_PUPDR0 << (line * 2U), GPIO_Init->Pull << (line * 2U));
+
+		if (GPIO_Init->Mode & EXTI_MODE)
+		{
+			exti_port[line] = (uint8_t)index;
+			exti_rising = (GPIO_Init->Mode & TRIGGER_RISING) ? (exti_rising | pin) : (exti_rising & ~pin);
+			exti_falling = (GPIO_Init->Mode & TRIGGER_FALLING) ? (exti_falling | pin) : (exti_falling & ~pin);
+			if (GPIO_Init->Mode & EXTI_IT)
+				exti_masked_in |= pin;
+			else
+				exti_masked_in &= (uint16_t)~pin;
+			EXTI->IMR = (EXTI->IMR & ~0xFFFFU) | exti_masked_in;
+			EXTI->RTSR = (EXTI->RTSR & ~0xFFFFU) | exti_rising;
+			EXTI->FTSR = (EXTI->FTSR & ~0xFFFFU) | exti_falling;
+		}
+	}
+	gpio_mirror(index);
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin)
+{
+	int index = gpio_index(GPIOx);
+
+	gpio_is_output[index] &= (uint16_t)~GPIO_Pin;
+	for (uint16_t line = 0; line < 16; line++)
+	{
+		if ((GPIO_Pin & (1U << line)) && exti_port[line] == index)
+		{
+			exti_rising &= (uint16_t)~(1U << line);
+			exti_falling &= (uint16_t)~(1U << line);
+			exti_masked_in &= (uint16_t)~(1U << line);
+		}
+	}
+	gpio_mirror(index);
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	Sim_Cycles(SIM_CYC_GPIO_WRITE);
+	return gpio_level(gpio_index(GPIOx), GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	int index = gpio_index(GPIOx);
+	uint16_t before = gpio_output[index];
+
+	Sim_Cycles(SIM_CYC_GPIO_WRITE);
+	if (PinState != GPIO_PIN_RESET)
+		gpio_output[index] |= GPIO_Pin;
+	else
+		gpio_output[index] &= (uint16_t)~GPIO_Pin;
+
+	gpio_mirror(index);
+	if (before != gpio_output[index])
+		gpio_notify(GPIOx, (uint16_t)(before ^ gpio_output[index]), index);
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	int index = gpio_index(GPIOx);
+
+	HAL_GPIO_WritePin(GPIOx, GPIO_Pin, (gpio_output[index] & GPIO_Pin) ? GPIO_PIN_RESET : GPIO_PIN_SET);
+}
+
+__weak void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+	(void)GPIO_Pin;
+}
+
+void HAL_GPIO_EXTI_IRQHandler(uint16_t GPIO_Pin)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	if (exti_pending & GPIO_Pin)
+	{
+		exti_pending &= (uint16_t)~GPIO_Pin;
+		EXTI->PR = exti_pending;
+		HAL_GPIO_EXTI_Callback(GPIO_Pin);
+	}
+}
+
+/**
+ * @brief Drives an input pin from outside (button, IRQ line of a slave).
+ * @note  Edges on EXTI enabled lines latch the pending bit and raise the IRQ.
+ */
+void Sim_GpioDrive(GPIO_TypeDef *port, uint16_t pin, int level)
+{
+	int index = gpio_index(port);
+	int before = gpio_level(index, pin);
+
+	if (level)
+		gpio_input[index] |= pin;
+	else
+		gpio_input[index] &= (uint16_t)~pin;
+
+	if (before != gpio_level(index, pin))
+	{
+		for (uint16_t line = 0; line < 16; line++)
+		{
+			uint16_t mask = (uint16_t)(1U << line);
+
+			if (!(pin & mask) || exti_port[line] != index || !(exti_masked_in & mask))
+				continue;
+			if ((level && (exti_rising & mask)) || (!level && (exti_falling & mask)))
+			{
+				exti_pending |= mask;
+				Sim_SetIrqPending(exti_irq(line));
+			}
+		}
+		gpio_notify(port, pin, index);
+	}
+	gpio_mirror(index);
+}
+
+int Sim_GpioOutput(GPIO_TypeDef *port, uint16_t pin)
+{
+	return (gpio_output[gpio_index(port)] & pin) ? 1 : 0;
+}
+
+void Sim_GpioWatch(GPIO_TypeDef *port, uint16_t pin, void (*changed)(int level))
+{
+	if (watch_count == SIM_WATCH_MAX)
+		Sim_Fatal("too many GPIO watches");
+	watches[watch_count].port = port;
+	watches[watch_count].pin = pin;
+	watches[watch_count].changed = changed;
+	watch_count++;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// RCC, FLASH and PWR
+/////////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t pll_mul = 2;
+static uint32_t pll_source = RCC_PLLSOURCE_HSI;
+
+static uint32_t sysclk_freq(void)
+{
+	switch (RCC->CFGR & RCC_CFGR_SWS)
+	{
+		case RCC_SYSCLKSOURCE_STATUS_PLLCLK:
+			if (pll_source == RCC_PLLSOURCE_HSI)
+				return (HSI_VALUE / 2U) * pll_mul;
+			return HSE_VALUE * pll_mul;
+		case RCC_SYSCLKSOURCE_STATUS_HSE:
+			return HSE_VALUE;
+		default:
+			return HSI_VALUE;
+	}
+}
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct)
+{
+	Sim_Cycles(SIM_CYC_CALL * 8);
+
+	if (RCC_OscInitStruct->OscillatorType & RCC_OSCILLATORTYPE_HSE)
+	{
+		if (RCC_OscInitStruct->HSEState != RCC_HSE_OFF)
+			return HAL_TIMEOUT;		// No crystal on this board
+	}
+	if (RCC_OscInitStruct->OscillatorType & RCC_OSCILLATORTYPE_LSI)
+	{
+		if (RCC_OscInitStruct->LSIState == RCC_LSI_ON)
+			RCC->CSR |= RCC_CSR_LSION | RCC_CSR_LSIRDY;
+		else
+			RCC->CSR &= ~(RCC_CSR_LSION | RCC_CSR_LSIRDY);
+	}
+
+	if (RCC_OscInitStruct->PLL.PLLState == RCC_PLL_ON)
+	{
+		if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_SYSCLKSOURCE_STATUS_PLLCLK)
+			return HAL_ERROR;		// PLL cannot be reconfigured while it clocks the core
+		if (RCC_OscInitStruct->PLL.PLLSource != RCC_PLLSOURCE_HSI)
+			return HAL_TIMEOUT;
+		pll_source = RCC_OscInitStruct->PLL.PLLSource;
+		pll_mul = ((RCC_OscInitStruct->PLL.PLLMUL & RCC_CFGR_PLLMUL) >> RCC_CFGR_PLLMUL_Pos) + 2U;
+		if (pll_mul > 16U)
+			pll_mul = 16U;
+		RCC->CR |= RCC_CR_PLLON | RCC_CR_PLLRDY;
+		Sim_Advance(SIM_US(200), SIM_ACC_CPU);	// PLL lock time
+	}
+	else if (RCC_OscInitStruct->PLL.PLLState == RCC_PLL_OFF)
+	{
+		if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_SYSCLKSOURCE_STATUS_PLLCLK)
+			return HAL_ERROR;
+		RCC->CR &= ~(RCC_CR_PLLON | RCC_CR_PLLRDY);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency)
+{
+	uint32_t cfgr = RCC->CFGR;
+	uint32_t hclk;
+
+	Sim_Cycles(SIM_CYC_CALL * 8);
+
+	if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_SYSCLK)
+	{
+		if (RCC_ClkInitStruct->SYSCLKSource == RCC_SYSCLKSOURCE_PLLCLK && !(RCC->CR & RCC_CR_PLLRDY))
+			return HAL_ERROR;
+		if (RCC_ClkInitStruct->SYSCLKSource == RCC_SYSCLKSOURCE_HSE)
+			return HAL_ERROR;
+		cfgr = (cfgr & ~(RCC_CFGR_SW | RCC_CFGR_SWS)) | RCC_ClkInitStruct->SYSCLKSource
+				| (RCC_ClkInitStruct->SYSCLKSource << RCC_CFGR_SWS_Pos);
+	}
+	if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_HCLK)
+		cfgr = (cfgr & ~RCC_CFGR_HPRE) | RCC_ClkInitStruct->AHBCLKDivider;
+	if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_PCLK1)
+		cfgr = (cfgr & ~RCC_CFGR_PPRE1) | RCC_ClkInitStruct->APB1CLKDivider;
+	if (RCC_ClkInitStruct->ClockType & RCC_CLOCKTYPE_PCLK2)
+		cfgr = (cfgr & ~RCC_CFGR_PPRE2) | (RCC_ClkInitStruct->APB2CLKDivider << 3U);
+
+	RCC->CFGR = cfgr;
+	hclk = sysclk_freq() >> AHBPrescTable[(cfgr & RCC_CFGR_HPRE) >> RCC_CFGR_HPRE_Pos];
+
+	// RM0316 3.5.1: 0 wait states up to 24 MHz, 1 up to 48 MHz, 2 above
+	if ((hclk > 48000000U && FLatency < FLASH_LATENCY_2) || (hclk > 24000000U && FLatency < FLASH_LATENCY_1))
+		Sim_Fatal("HCLK %u Hz with flash latency %u, the core would fetch garbage", (unsigned)hclk, (unsigned)FLatency);
+	if (hclk > 72000000U)
+		Sim_Fatal("HCLK %u Hz is out of specification", (unsigned)hclk);
+	if ((RCC->CFGR & RCC_CFGR_PPRE1) == RCC_HCLK_DIV1 && hclk > 36000000U)
+		Sim_Fatal("PCLK1 %u Hz is above the 36 MHz limit", (unsigned)hclk);
+
+	MODIFY_REG(FLASH->ACR, FLASH_ACR_LATENCY, FLatency);
+	SystemCoreClock = hclk;
+	Sim_Trace(SIM_TRACE_IRQ, "HCLK %u Hz, PCLK2 %u Hz", (unsigned)hclk, (unsigned)Sim_Pclk2());
+
+	return HAL_InitTick(uwTickPrio);
+}
+
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *PeriphClkInit)
+{
+	Sim_Cycles(SIM_CYC_CALL * 4);
+	if (PeriphClkInit->PeriphClockSelection & RCC_PERIPHCLK_RTC)
+		MODIFY_REG(RCC->BDCR, RCC_BDCR_RTCSEL, PeriphClkInit->RTCClockSelection);
+	return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetSysClockFreq(void)
+{
+	return sysclk_freq();
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void)
+{
+	return SystemCoreClock;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+	return SystemCoreClock >> APBPrescTable[(RCC->CFGR & RCC_CFGR_PPRE1) >> RCC_CFGR_PPRE1_Pos];
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+	return Sim_Pclk2();
+}
+
+/* Flash programming times of the STM32F303x8 datasheet, typical; the core stalls meanwhile */
+#define SIM_FLASH_ERASE_TIME	SIM_MS(20)
+#define SIM_FLASH_PROGRAM_TIME	SIM_US(50)
+
+static uint8_t flash_unlocked;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	flash_unlocked = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	flash_unlocked = 0;
+	return HAL_OK;
+}
+
+static int flash_in_range(uint32_t address, uint32_t size)
+{
+	return address >= FLASH_BASE && address + size <= FLASH_BASE + 0x10000UL;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	*PageError = 0xFFFFFFFFU;
+	if (!flash_unlocked || pEraseInit->TypeErase != FLASH_TYPEERASE_PAGES)
+		return HAL_ERROR;
+
+	for (uint32_t i = 0; i < pEraseInit->NbPages; i++)
+	{
+		uint32_t page = pEraseInit->PageAddress + i * FLASH_PAGE_SIZE;
+
+		if ((page % FLASH_PAGE_SIZE) != 0 || !flash_in_range(page, FLASH_PAGE_SIZE))
+		{
+			*PageError = page;
+			return HAL_ERROR;
+		}
+		memset((void *)(uintptr_t)page, 0xFF, FLASH_PAGE_SIZE);
+		Sim_Trace(SIM_TRACE_IRQ, "flash page 0x%08X erased", (unsigned)page);
+		Sim_Advance(SIM_FLASH_ERASE_TIME, SIM_ACC_CPU);
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief Only half-words are simulated. As on the target a half-word that is
+ *        not erased can only be programmed to 0 (PGERR otherwise).
+ */
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	volatile uint16_t *target = (volatile uint16_t *)(uintptr_t)Address;
+
+	Sim_Cycles(SIM_CYC_CALL);
+	if (!flash_unlocked || TypeProgram != FLASH_TYPEPROGRAM_HALFWORD || (Address & 1U) || !flash_in_range(Address, 2))
+		return HAL_ERROR;
+	if (*target != 0xFFFF && (uint16_t)Data != 0)
+		return HAL_ERROR;
+
+	*target = (uint16_t)Data;
+	Sim_Advance(SIM_FLASH_PROGRAM_TIME, SIM_ACC_CPU);
+	return HAL_OK;
+}
+
+void HAL_PWR_EnterSLEEPMode(uint32_t Regulator, uint8_t SLEEPEntry)
+{
+	(void)Regulator;
+	(void)SLEEPEntry;
+	Sim_Cycles(SIM_CYC_CALL);
+	Sim_WaitForInterrupt(SIM_ACC_SLEEP);
+}
+
+/* Set while the core is in STOP: the USART is not clocked and loses what arrives */
+static uint8_t pwr_stopped;
+
+/**
+ * @brief STOP mode: every clock except LSI is gated, so SysTick does not run
+ *        and the core restarts from HSI when it wakes up, as on the target.
+ */
+void HAL_PWR_EnterSTOPMode(uint32_t Regulator, uint8_t STOPEntry)
+{
+	uint32_t ctrl = SysTick->CTRL;
+
+	(void)Regulator;
+	(void)STOPEntry;
+	Sim_Cycles(SIM_CYC_CALL);
+
+	SysTick->CTRL = ctrl & ~SysTick_CTRL_ENABLE_Msk;
+	pwr_stopped = 1;
+	Sim_WaitForInterrupt(SIM_ACC_STOP);
+	pwr_stopped = 0;
+	SysTick->CTRL = ctrl;
+
+	if ((RCC->CFGR & RCC_CFGR_SWS) != RCC_SYSCLKSOURCE_STATUS_HSI)
+	{
+		RCC->CFGR &= ~(RCC_CFGR_SW | RCC_CFGR_SWS);
+		RCC->CR &= ~(RCC_CR_PLLON | RCC_CR_PLLRDY);
+		SystemCoreClock = HSI_VALUE >> AHBPrescTable[(RCC->CFGR & RCC_CFGR_HPRE) >> RCC_CFGR_HPRE_Pos];
+	}
+	Sim_Advance(SIM_US(5), SIM_ACC_STOP);		// Regulator and HSI wakeup
+}
+
+/* PVD on EXTI line 16, kept apart from the GPIO lines mirrored into EXTI->PR */
+#define SIM_PVD_MODE_IT		0x00010000U		// PVD_MODE_IT, private to stm32f3xx_hal_pwr_ex.c
+static uint8_t pvd_enabled;
+static uint8_t pvd_pending;
+
+void HAL_PWR_ConfigPVD(PWR_PVDTypeDef *sConfigPVD)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	if (sConfigPVD->Mode & SIM_PVD_MODE_IT)
+		EXTI->IMR |= PWR_EXTI_LINE_PVD;
+	else
+		EXTI->IMR &= ~PWR_EXTI_LINE_PVD;
+}
+
+void HAL_PWR_EnablePVD(void)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	pvd_enabled = 1;
+}
+
+__attribute__((weak)) void HAL_PWR_PVDCallback(void)
+{
+}
+
+void HAL_PWR_PVD_IRQHandler(void)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	if (pvd_pending)
+	{
+		pvd_pending = 0;
+		HAL_PWR_PVDCallback();
+	}
+}
+
+/**
+ * @brief Supply drops below the PVD threshold: the interrupt is raised if the
+ *        firmware armed it and the core keeps running on the hold-up
+ *        capacitance for SIM_PVD_HOLDUP before everything stops.
+ */
+void Sim_PowerFail(void)
+{
+	Sim_Trace(SIM_TRACE_IRQ, "supply below the PVD threshold");
+	if (pvd_enabled && (EXTI->IMR & PWR_EXTI_LINE_PVD))
+	{
+		pvd_pending = 1;
+		Sim_SetIrqPending(PVD_IRQn);
+	}
+	Sim_SetEndTime(sim_now + SIM_PVD_HOLDUP);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// RTC
+/////////////////////////////////////////////////////////////////////////////////////
+
+/* Calendar in seconds since 2000-01-01 at virtual time zero */
+static int64_t rtc_base;
+
+static int64_t rtc_seconds(void)
+{
+	return rtc_base + (int64_t)(sim_now / SIM_MS(1000));
+}
+
+uint8_t RTC_ByteToBcd2(uint8_t number)
+{
+	return (uint8_t)(((number / 10U) << 4U) | (number % 10U));
+}
+
+uint8_t RTC_Bcd2ToByte(uint8_t number)
+{
+	return (uint8_t)(((number >> 4U) * 10U) + (number & 0x0FU));
+}
+
+static time_t rtc_epoch(void)
+{
+	struct tm base = { .tm_year = 100, .tm_mon = 0, .tm_mday = 1 };
+
+	return timegm(&base);
+}
+
+static void rtc_split(struct tm *out)
+{
+	time_t t = rtc_epoch() + (time_t)rtc_seconds();
+
+	gmtime_r(&t, out);
+}
+
+/**
+ * @brief Moves the calendar forward, e.g. over midnight, without running the time in between.
+ */
+void Sim_RtcSkip(int64_t seconds)
+{
+	rtc_base += seconds;
+}
+
+static void rtc_join(const struct tm *in)
+{
+	struct tm copy = *in;
+
+	rtc_base = (int64_t)(timegm(&copy) - rtc_epoch()) - (int64_t)(sim_now / SIM_MS(1000));
+}
+
+HAL_StatusTypeDef HAL_RTC_Init(RTC_HandleTypeDef *hrtc)
+{
+	if (hrtc == NULL)
+		return HAL_ERROR;
+	if (hrtc->State == HAL_RTC_STATE_RESET)
+	{
+		hrtc->Lock = HAL_UNLOCKED;
+		HAL_RTC_MspInit(hrtc);
+	}
+	Sim_Cycles(SIM_CYC_CALL * 4);
+	hrtc->State = HAL_RTC_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_SetTime(RTC_HandleTypeDef *hrtc, RTC_TimeTypeDef *sTime, uint32_t Format)
+{
+	struct tm now;
+	uint8_t h = sTime->Hours, m = sTime->Minutes, s = sTime->Seconds;
+
+	(void)hrtc;
+	if (Format == RTC_FORMAT_BCD)
+	{
+		h = RTC_Bcd2ToByte(h);
+		m = RTC_Bcd2ToByte(m);
+		s = RTC_Bcd2ToByte(s);
+	}
+	if (h > 23U || m > 59U || s > 59U)
+		return HAL_ERROR;
+
+	Sim_Cycles(SIM_CYC_RTC_GET * 2);
+	rtc_split(&now);
+	now.tm_hour = h;
+	now.tm_min = m;
+	now.tm_sec = s;
+	rtc_join(&now);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_GetTime(RTC_HandleTypeDef *hrtc, RTC_TimeTypeDef *sTime, uint32_t Format)
+{
+	struct tm now;
+	uint32_t fraction = (uint32_t)((sim_now % SIM_MS(1000)) / SIM_MS(1));
+
+	Sim_Cycles(SIM_CYC_RTC_GET);
+	rtc_split(&now);
+
+	sTime->Hours = (uint8_t)now.tm_hour;
+	sTime->Minutes = (uint8_t)now.tm_min;
+	sTime->Seconds = (uint8_t)now.tm_sec;
+	sTime->TimeFormat = RTC_HOURFORMAT12_AM;
+	sTime->SecondFraction = hrtc->Init.SynchPrediv;
+	sTime->SubSeconds = hrtc->Init.SynchPrediv - fraction * (hrtc->Init.SynchPrediv + 1U) / 1000U;
+
+	if (Format == RTC_FORMAT_BCD)
+	{
+		sTime->Hours = RTC_ByteToBcd2(sTime->Hours);
+		sTime->Minutes = RTC_ByteToBcd2(sTime->Minutes);
+		sTime->Seconds = RTC_ByteToBcd2(sTime->Seconds);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_SetDate(RTC_HandleTypeDef *hrtc, RTC_DateTypeDef *sDate, uint32_t Format)
+{
+	struct tm now;
+	uint8_t y = sDate->Year, m = sDate->Month, d = sDate->Date;
+
+	(void)hrtc;
+	if (Format == RTC_FORMAT_BCD)
+	{
+		y = RTC_Bcd2ToByte(y);
+		m = RTC_Bcd2ToByte(m);
+		d = RTC_Bcd2ToByte(d);
+	}
+	else if (m & 0x10U)
+	{
+		m = (uint8_t)((m & ~0x10U) + 10U);	// RTC_MONTH_OCTOBER and later are BCD coded
+	}
+	if (y > 99U || m < 1U || m > 12U || d < 1U || d > 31U)
+		return HAL_ERROR;
+
+	Sim_Cycles(SIM_CYC_RTC_GET * 2);
+	rtc_split(&now);
+	now.tm_year = 100 + y;
+	now.tm_mon = m - 1;
+	now.tm_mday = d;
+	rtc_join(&now);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTC_GetDate(RTC_HandleTypeDef *hrtc, RTC_DateTypeDef *sDate, uint32_t Format)
+{
+	struct tm now;
+
+	(void)hrtc;
+	Sim_Cycles(SIM_CYC_RTC_GET);
+	rtc_split(&now);
+
+	sDate->Year = (uint8_t)(now.tm_year - 100);
+	sDate->Month = (uint8_t)(now.tm_mon + 1);
+	sDate->Date = (uint8_t)now.tm_mday;
+	sDate->WeekDay = (uint8_t)(now.tm_wday == 0 ? RTC_WEEKDAY_SUNDAY : now.tm_wday);
+
+	if (Format == RTC_FORMAT_BCD)
+	{
+		sDate->Year = RTC_ByteToBcd2(sDate->Year);
+		sDate->Month = RTC_ByteToBcd2(sDate->Month);
+		sDate->Date = RTC_ByteToBcd2(sDate->Date);
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief The shadow registers are copied from the calendar every two RTCCLK periods.
+ */
+HAL_StatusTypeDef HAL_RTC_WaitForSynchro(RTC_HandleTypeDef *hrtc)
+{
+	SimTime copy = SIM_MS(1000) * 2U / LSI_VALUE;
+
+	(void)hrtc;
+	Sim_Cycles(SIM_CYC_CALL);
+	Sim_Advance(copy - sim_now % copy, SIM_ACC_CPU);
+	return HAL_OK;
+}
+
+/* Wakeup timer, reloaded every period until it is deactivated */
+static SimTime rtc_wakeup_period;
+
+static void rtc_wakeup_expire(void *ctx)
+{
+	(void)ctx;
+	RTC->ISR |= RTC_ISR_WUTF;
+	Sim_Trace(SIM_TRACE_IRQ, "rtc wakeup");
+	Sim_SetIrqPending(RTC_WKUP_IRQn);
+	Sim_Schedule(sim_now + rtc_wakeup_period, rtc_wakeup_expire, NULL);
+}
+
+/**
+ * @brief Stopping a running wakeup timer waits for WUTWF, about two RTCCLK periods.
+ */
+HAL_StatusTypeDef HAL_RTCEx_DeactivateWakeUpTimer(RTC_HandleTypeDef *hrtc)
+{
+	(void)hrtc;
+	Sim_Cycles(SIM_CYC_CALL);
+	if (rtc_wakeup_period != 0)
+	{
+		Sim_Cancel(rtc_wakeup_expire, NULL);
+		rtc_wakeup_period = 0;
+		Sim_Advance(SIM_MS(1000) * 2U / LSI_VALUE, SIM_ACC_CPU);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RTCEx_SetWakeUpTimer_IT(RTC_HandleTypeDef *hrtc, uint32_t WakeUpCounter, uint32_t WakeUpClock)
+{
+	SimTime tick;
+
+	HAL_RTCEx_DeactivateWakeUpTimer(hrtc);
+	RTC->ISR &= ~RTC_ISR_WUTF;
+
+	switch (WakeUpClock)
+	{
+		case RTC_WAKEUPCLOCK_RTCCLK_DIV16:	tick = SIM_MS(1000) * 16U / LSI_VALUE; break;
+		case RTC_WAKEUPCLOCK_RTCCLK_DIV8:	tick = SIM_MS(1000) * 8U / LSI_VALUE; break;
+		case RTC_WAKEUPCLOCK_RTCCLK_DIV4:	tick = SIM_MS(1000) * 4U / LSI_VALUE; break;
+		case RTC_WAKEUPCLOCK_RTCCLK_DIV2:	tick = SIM_MS(1000) * 2U / LSI_VALUE; break;
+		case RTC_WAKEUPCLOCK_CK_SPRE_17BITS:	WakeUpCounter += 0x10000U;	/* fall through */
+		default:							tick = SIM_MS(1000); break;
+	}
+	rtc_wakeup_period = (SimTime)((WakeUpCounter & 0x1FFFFU) + 1U) * tick;
+	Sim_Schedule(sim_now + rtc_wakeup_period, rtc_wakeup_expire, NULL);
+	return HAL_OK;
+}
+
+__weak void HAL_RTCEx_WakeUpTimerEventCallback(RTC_HandleTypeDef *hrtc)
+{
+	(void)hrtc;
+}
+
+void HAL_RTCEx_WakeUpTimerIRQHandler(RTC_HandleTypeDef *hrtc)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	if (RTC->ISR & RTC_ISR_WUTF)
+	{
+		RTC->ISR &= ~RTC_ISR_WUTF;
+		HAL_RTCEx_WakeUpTimerEventCallback(hrtc);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// SPI
+/////////////////////////////////////////////////////////////////////////////////////
+
+static SimSpiDevice *spi_devices;
+
+static SimSpiDevice *spi_selected(void)
+{
+	SimSpiDevice *found = NULL;
+
+	for (SimSpiDevice *d = spi_devices; d; d = d->next)
+	{
+		if (Sim_GpioOutput(d->cs_port, d->cs_pin) == 0)
+		{
+			if (found)
+				Sim_Fatal("bus contention on SPI1: %s and %s are both selected", found->name, d->name);
+			found = d;
+		}
+	}
+	return found;
+}
+
+static void spi_cs_changed(SimSpiDevice *device, int level)
+{
+	if (level == 0)
+		device->transactions++;
+	if (device->select)
+		device->select(level == 0);
+}
+
+/* One CS trampoline per device slot; GPIO watches take no context */
+#define SIM_SPI_SLOTS 4
+static SimSpiDevice *spi_slot[SIM_SPI_SLOTS];
+static void spi_cs0(int level) { spi_cs_changed(spi_slot[0], level); }
+static void spi_cs1(int level) { spi_cs_changed(spi_slot[1], level); }
+static void spi_cs2(int level) { spi_cs_changed(spi_slot[2], level); }
+static void spi_cs3(int level) { spi_cs_changed(spi_slot[3], level); }
+static void (*const spi_cs_watch[SIM_SPI_SLOTS])(int) = { spi_cs0, spi_cs1, spi_cs2, spi_cs3 };
+
+void Sim_SpiAttach(SimSpiDevice *device)
+{
+	int slot = 0;
+
+	while (slot < SIM_SPI_SLOTS && spi_slot[slot])
+		slot++;
+	if (slot == SIM_SPI_SLOTS)
+		Sim_Fatal("too many SPI devices");
+
+	spi_slot[slot] = device;
+	device->next = spi_devices;
+	spi_devices = device;
+	Sim_GpioWatch(device->cs_port, device->cs_pin, spi_cs_watch[slot]);
+}
+
+SimSpiDevice *Sim_SpiDevices(void)
+{
+	return spi_devices;
+}
+
+/**
+ * @brief Time of one byte on the bus at the SCLK currently set in SPI1->CR1.
+ */
+SimTime Sim_SpiByteTime(void)
+{
+	uint32_t prescaler = 2U << ((SPI1->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos);
+
+	return (SimTime)8U * prescaler * 1000000000000ULL / Sim_Pclk2();
+}
+
+/**
+ * @brief Clocks one byte through the selected slave. A bus without a selected
+ *        slave reads back 0xFF (MISO pulled up).
+ */
+uint8_t Sim_SpiExchange(uint8_t mosi)
+{
+	SimSpiDevice *device = spi_selected();
+
+	if (device == NULL)
+		return 0xFF;
+	if (device->max_sclk)
+	{
+		uint32_t sclk = Sim_Pclk2() / (2U << ((SPI1->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos));
+
+		if (sclk > device->max_sclk)
+			Sim_Fatal("SCLK %u Hz exceeds the %u Hz limit of %s", (unsigned)sclk,
+					  (unsigned)device->max_sclk, device->name);
+	}
+	device->bytes++;
+	return device->exchange(mosi);
+}
+
+static SimAccount spi_account(void)
+{
+	SimSpiDevice *device = spi_selected();
+
+	return device ? device->account : SIM_ACC_SPI_NONE;
+}
+
+/* DMA transfer in flight; DMA1 channel 2/3 move one byte per bus byte time */
+static struct
+{
+	SPI_HandleTypeDef *hspi;
+	DMA_HandleTypeDef *irq_channel;		// Channel whose transfer complete interrupt ends the transfer
+	const uint8_t *tx;
+	uint8_t *rx;
+	uint16_t size;
+	uint16_t done;
+} spi_dma;
+
+/**
+ * @brief Blocking transfer, shared by the three HAL_SPI_xxx() polling calls.
+ * @note  The HAL polling loop keeps at most one byte in flight, so a byte costs
+ *        the longer of its bus time and the loop overhead.
+ */
+static HAL_StatusTypeDef spi_blocking(SPI_HandleTypeDef *hspi, const uint8_t *tx, uint8_t *rx, uint16_t size)
+{
+	SimTime cpu_byte = (SimTime)SIM_CYC_SPI_BYTE * 1000000000000ULL / Sim_CoreClock();
+	SimTime bus_byte = Sim_SpiByteTime();
+	SimAccount account = spi_account();
+
+	if (spi_dma.hspi == hspi)
+		Sim_Fatal("blocking SPI transfer started while a DMA transfer is in flight");
+	if (hspi->State != HAL_SPI_STATE_READY)
+		return HAL_BUSY;
+	if (size == 0U)
+		return HAL_ERROR;
+
+	hspi->State = HAL_SPI_STATE_BUSY_TX_RX;
+	Sim_Cycles(SIM_CYC_SPI_CALL);
+
+	for (uint16_t i = 0; i < size; i++)
+	{
+		uint8_t miso = Sim_SpiExchange(tx ? tx[i] : 0xFF);
+
+		if (rx)
+			rx[i] = miso;
+		Sim_Advance(bus_byte, account);
+		if (cpu_byte > bus_byte)
+			Sim_Advance(cpu_byte - bus_byte, SIM_ACC_CPU);
+	}
+
+	hspi->State = HAL_SPI_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi)
+{
+	if (hspi == NULL)
+		return HAL_ERROR;
+	if (hspi->State == HAL_SPI_STATE_RESET)
+	{
+		hspi->Lock = HAL_UNLOCKED;
+		HAL_SPI_MspInit(hspi);
+	}
+	Sim_Cycles(SIM_CYC_CALL * 4);
+
+	WRITE_REG(hspi->Instance->CR1, hspi->Init.Mode | hspi->Init.Direction | hspi->Init.CLKPolarity
+			  | hspi->Init.CLKPhase | (hspi->Init.NSS & SPI_CR1_SSM) | hspi->Init.BaudRatePrescaler
+			  | hspi->Init.FirstBit | hspi->Init.CRCCalculation);
+	WRITE_REG(hspi->Instance->CR2, hspi->Init.DataSize | SPI_RXFIFO_THRESHOLD_QF);
+
+	hspi->ErrorCode = HAL_SPI_ERROR_NONE;
+	hspi->State = HAL_SPI_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_DeInit(SPI_HandleTypeDef *hspi)
+{
+	HAL_SPI_MspDeInit(hspi);
+	hspi->State = HAL_SPI_STATE_RESET;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)Timeout;
+	return spi_blocking(hspi, pData, NULL, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)Timeout;
+	// The master clocks out the receive buffer itself, as the HAL does
+	return spi_blocking(hspi, pData, pData, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData, uint16_t Size,
+										  uint32_t Timeout)
+{
+	(void)Timeout;
+	return spi_blocking(hspi, pTxData, pRxData, Size);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// DMA1 driving SPI1
+/////////////////////////////////////////////////////////////////////////////////////
+
+static IRQn_Type dma_irq(DMA_HandleTypeDef *hdma)
+{
+	uint32_t channel = ((uint32_t)(uintptr_t)hdma->Instance - DMA1_Channel1_BASE) / 0x14U;
+
+	if (channel > 6U)
+		Sim_Fatal("DMA handle %p is not on DMA1", (void *)hdma);
+	return (IRQn_Type)(DMA1_Channel1_IRQn + channel);
+}
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+	if (hdma == NULL)
+		return HAL_ERROR;
+	(void)dma_irq(hdma);
+	Sim_Cycles(SIM_CYC_CALL);
+	hdma->ErrorCode = HAL_DMA_ERROR_NONE;
+	hdma->State = HAL_DMA_STATE_READY;
+	hdma->Lock = HAL_UNLOCKED;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *hdma)
+{
+	if (hdma == NULL)
+		return HAL_ERROR;
+	hdma->State = HAL_DMA_STATE_RESET;
+	return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	if (hdma->State != HAL_DMA_STATE_BUSY)
+		return;
+	hdma->State = HAL_DMA_STATE_READY;
+	if (hdma->XferCpltCallback != NULL)
+		hdma->XferCpltCallback(hdma);
+}
+
+__attribute__((weak)) void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) { (void)hspi; }
+__attribute__((weak)) void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) { (void)hspi; }
+__attribute__((weak)) void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi) { (void)hspi; }
+__attribute__((weak)) void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) { (void)hspi; }
+
+/**
+ * @brief Transfer complete interrupt of the last channel, as SPI_DMATransmitReceiveCplt() of the HAL.
+ */
+static void spi_dma_complete(DMA_HandleTypeDef *hdma)
+{
+	SPI_HandleTypeDef *hspi = (SPI_HandleTypeDef *)hdma->Parent;
+	HAL_SPI_StateTypeDef state = hspi->State;
+
+	if (hspi->hdmatx != NULL)
+		hspi->hdmatx->State = HAL_DMA_STATE_READY;
+	if (hspi->hdmarx != NULL)
+		hspi->hdmarx->State = HAL_DMA_STATE_READY;
+	spi_dma.hspi = NULL;
+	hspi->State = HAL_SPI_STATE_READY;
+
+	if (state == HAL_SPI_STATE_BUSY_TX)
+		HAL_SPI_TxCpltCallback(hspi);
+	else if (state == HAL_SPI_STATE_BUSY_RX)
+		HAL_SPI_RxCpltCallback(hspi);
+	else
+		HAL_SPI_TxRxCpltCallback(hspi);
+}
+
+static void spi_dma_byte(void *ctx)
+{
+	uint8_t miso;
+
+	(void)ctx;
+	miso = Sim_SpiExchange(spi_dma.tx ? spi_dma.tx[spi_dma.done] : 0xFF);
+	if (spi_dma.rx)
+		spi_dma.rx[spi_dma.done] = miso;
+
+	if (++spi_dma.done < spi_dma.size)
+		Sim_Schedule(sim_now + Sim_SpiByteTime(), spi_dma_byte, NULL);
+	else
+		Sim_SetIrqPending(dma_irq(spi_dma.irq_channel));
+}
+
+static HAL_StatusTypeDef spi_dma_start(SPI_HandleTypeDef *hspi, const uint8_t *tx, uint8_t *rx, uint16_t size,
+									   HAL_SPI_StateTypeDef state)
+{
+	DMA_HandleTypeDef *last;
+
+	if (hspi->State != HAL_SPI_STATE_READY)
+		return HAL_BUSY;
+	if (size == 0U || hspi->hdmatx == NULL || (rx != NULL && hspi->hdmarx == NULL))
+		return HAL_ERROR;
+
+	last = rx ? hspi->hdmarx : hspi->hdmatx;
+	if (last->State != HAL_DMA_STATE_READY)
+		Sim_Fatal("SPI DMA started before HAL_DMA_Init() of channel %d", (int)dma_irq(last));
+
+	hspi->State = state;
+	hspi->ErrorCode = HAL_SPI_ERROR_NONE;
+	hspi->hdmatx->State = HAL_DMA_STATE_BUSY;
+	if (rx)
+		hspi->hdmarx->State = HAL_DMA_STATE_BUSY;
+	last->XferCpltCallback = spi_dma_complete;
+
+	spi_dma.hspi = hspi;
+	spi_dma.irq_channel = last;
+	spi_dma.tx = tx;
+	spi_dma.rx = rx;
+	spi_dma.size = size;
+	spi_dma.done = 0;
+
+	Sim_Cycles(SIM_CYC_DMA_SETUP);
+	Sim_Schedule(sim_now + Sim_SpiByteTime(), spi_dma_byte, NULL);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+	return spi_dma_start(hspi, pData, NULL, Size, HAL_SPI_STATE_BUSY_TX);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+	// The master clocks out the receive buffer itself, as the HAL does
+	return spi_dma_start(hspi, pData, pData, Size, HAL_SPI_STATE_BUSY_RX);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pTxData, uint8_t *pRxData,
+											  uint16_t Size)
+{
+	return spi_dma_start(hspi, pTxData, pRxData, Size, HAL_SPI_STATE_BUSY_TX_RX);
+}
+
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef *hspi)
+{
+	return hspi->State;
+}
+
+uint32_t HAL_SPI_GetError(SPI_HandleTypeDef *hspi)
+{
+	return hspi->ErrorCode;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// UART
+/////////////////////////////////////////////////////////////////////////////////////
+
+static FILE *uart_log;
+
+void Sim_UartOpen(const char *path)
+{
+	uart_log = fopen(path, "w");
+	if (uart_log == NULL)
+		Sim_Fatal("cannot open %s", path);
+}
+
+/* Bytes typed into the terminal, delivered one per character time */
+#define SIM_UART_RX_SIZE	1024
+
+static UART_HandleTypeDef *uart_rx_handle;
+static char uart_rx_queue[SIM_UART_RX_SIZE];
+static uint32_t uart_rx_head;
+static uint32_t uart_rx_tail;
+static uint8_t uart_rx_data;
+static uint8_t uart_rx_full;
+static SimTime uart_rx_next;
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	if (huart == NULL)
+		return HAL_ERROR;
+	if (huart->gState == HAL_UART_STATE_RESET)
+	{
+		huart->Lock = HAL_UNLOCKED;
+		HAL_UART_MspInit(huart);
+	}
+	Sim_Cycles(SIM_CYC_CALL * 4);
+	if (huart->Instance == USART2)
+		uart_rx_handle = huart;
+	UART_SetConfig(huart);
+	SET_BIT(huart->Instance->CR1, USART_CR1_UE);
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	return HAL_OK;
+}
+
+/**
+ * @brief Baud rate register from the APB1 clock of the moment, oversampling by 16.
+ */
+HAL_StatusTypeDef UART_SetConfig(UART_HandleTypeDef *huart)
+{
+	Sim_Cycles(SIM_CYC_CALL * 2);
+	huart->Instance->BRR = (HAL_RCC_GetPCLK1Freq() + huart->Init.BaudRate / 2U) / huart->Init.BaudRate;
+	return HAL_OK;
+}
+
+/**
+ * @brief A BRR left over from another APB1 clock garbles every byte on the line.
+ */
+static void Sim_UartCheckBaud(UART_HandleTypeDef *huart)
+{
+	uint32_t brr = huart->Instance->BRR;
+	uint32_t baud = (brr != 0U) ? HAL_RCC_GetPCLK1Freq() / brr : 0U;
+
+	if (!READ_BIT(huart->Instance->CR1, USART_CR1_UE))
+		Sim_Fatal("USART used while disabled");
+	if (baud * 100U < huart->Init.BaudRate * 97U || baud * 100U > huart->Init.BaudRate * 103U)
+		Sim_Fatal("USART at %lu baud, %lu configured (BRR %lu, PCLK1 %lu)", (unsigned long)baud,
+				  (unsigned long)huart->Init.BaudRate, (unsigned long)brr, (unsigned long)HAL_RCC_GetPCLK1Freq());
+}
+
+/**
+ * @brief Blocking transmit: 10 bit times per byte (8N1) at the configured baud rate.
+ */
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)Timeout;
+	if (huart->gState != HAL_UART_STATE_READY)
+		return HAL_BUSY;
+	if (pData == NULL || Size == 0U)
+		return HAL_ERROR;
+
+	Sim_UartCheckBaud(huart);
+	Sim_Cycles(SIM_CYC_CALL);
+	for (uint16_t i = 0; i < Size; i++)
+	{
+		if (uart_log && pData[i] != '\0')
+			fputc(pData[i], uart_log);
+	}
+	if (uart_log)
+		fflush(uart_log);
+	Sim_Trace(SIM_TRACE_UART, "uart tx %u bytes", (unsigned)Size);
+	Sim_Advance((SimTime)Size * 10U * 1000000000000ULL / huart->Init.BaudRate, SIM_ACC_UART);
+	return HAL_OK;
+}
+
+__weak void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+	(void)huart;
+}
+
+__weak void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	(void)huart;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->RxState != HAL_UART_STATE_READY)
+		return HAL_BUSY;
+	if (pData == NULL || Size == 0U)
+		return HAL_ERROR;
+
+	Sim_Cycles(SIM_CYC_CALL);
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	huart->RxXferCount = Size;
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	return HAL_OK;
+}
+
+/**
+ * @brief RXNE: the received byte goes to the buffer of HAL_UART_Receive_IT().
+ *        A byte that arrives before the previous one was read is an overrun.
+ */
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+	Sim_Cycles(SIM_CYC_CALL);
+	if (!uart_rx_full || huart->RxState != HAL_UART_STATE_BUSY_RX)
+		return;
+
+	uart_rx_full = 0;
+	*huart->pRxBuffPtr++ = uart_rx_data;
+	if (--huart->RxXferCount == 0U)
+	{
+		huart->RxState = HAL_UART_STATE_READY;
+		HAL_UART_RxCpltCallback(huart);
+	}
+}
+
+static void uart_rx_arrive(void *ctx)
+{
+	(void)ctx;
+	if (pwr_stopped)
+	{
+		// The start bit can only wake the core through an EXTI line on the RX pin (PA3)
+		Sim_Trace(SIM_TRACE_UART, "uart rx in STOP, 0x%02X lost", (uint8_t)uart_rx_queue[uart_rx_tail]);
+		if ((EXTI->IMR & EXTI_IMR_MR3) && (EXTI->FTSR & EXTI_FTSR_TR3))
+		{
+			exti_pending |= GPIO_PIN_3;
+			EXTI->PR = exti_pending;
+			Sim_SetIrqPending(EXTI3_IRQn);
+		}
+		if (++uart_rx_tail == uart_rx_head)
+			uart_rx_head = uart_rx_tail = 0;
+		else
+			Sim_Schedule(sim_now + uart_rx_next, uart_rx_arrive, NULL);
+		return;
+	}
+	if (uart_rx_handle && !READ_BIT(uart_rx_handle->Instance->CR1, USART_CR1_UE))
+	{
+		// Disabled while the clock profile is switched
+		Sim_Trace(SIM_TRACE_UART, "uart rx disabled, 0x%02X lost", (uint8_t)uart_rx_queue[uart_rx_tail]);
+		if (++uart_rx_tail == uart_rx_head)
+			uart_rx_head = uart_rx_tail = 0;
+		else
+			Sim_Schedule(sim_now + uart_rx_next, uart_rx_arrive, NULL);
+		return;
+	}
+	if (uart_rx_handle)
+		Sim_UartCheckBaud(uart_rx_handle);
+	if (uart_rx_full)
+	{
+		Sim_Trace(SIM_TRACE_UART, "uart rx overrun, 0x%02X lost", uart_rx_data);
+		if (uart_rx_handle && uart_rx_handle->RxState == HAL_UART_STATE_BUSY_RX)
+		{
+			uart_rx_handle->ErrorCode |= HAL_UART_ERROR_ORE;
+			uart_rx_handle->RxState = HAL_UART_STATE_READY;
+			HAL_UART_ErrorCallback(uart_rx_handle);
+		}
+	}
+	uart_rx_data = (uint8_t)uart_rx_queue[uart_rx_tail++];
+	uart_rx_full = 1;
+	Sim_SetIrqPending(USART2_IRQn);
+
+	if (uart_rx_tail == uart_rx_head)
+		uart_rx_head = uart_rx_tail = 0;
+	else
+		Sim_Schedule(sim_now + uart_rx_next, uart_rx_arrive, NULL);
+}
+
+/**
+ * @brief Types a line into the terminal connected to USART2, terminated by CR.
+ */
+void Sim_UartReceive(const char *line)
+{
+	size_t len = strlen(line);
+	uint32_t baud = (uart_rx_handle && uart_rx_handle->Init.BaudRate) ? uart_rx_handle->Init.BaudRate : 115200U;
+	int idle = (uart_rx_head == uart_rx_tail);
+
+	if (uart_rx_head + len + 1 > SIM_UART_RX_SIZE)
+		Sim_Fatal("too much UART input at once");
+	memcpy(uart_rx_queue + uart_rx_head, line, len);
+	uart_rx_head += (uint32_t)len;
+	uart_rx_queue[uart_rx_head++] = '\r';
+
+	Sim_Trace(SIM_TRACE_UART, "uart rx \"%s\"", line);
+	uart_rx_next = 10U * 1000000000000ULL / baud;
+	if (idle)
+		Sim_Schedule(sim_now + uart_rx_next, uart_rx_arrive, NULL);
+}
@@ -0,0 +1,385 @@
+/**
+ ******************************************************************************
+  * @file    sim_ili9163.c
+  * @brief   Virtual ILI9163 display controller on SPI1 (CS PA10, D/C PA11,
+  *          RESET PA12).
+  ******************************************************************************
+  *
+  * Keeps the graphic RAM in the column/page coordinates the firmware draws in
+  * and reads the text back from it with the firmware's own 6x8 font, so the
+  * scenario report can show what the user would see on the screen.
+  */
+
+#include <string.h>
+
+#include "sim.h"
+#include "main.h"
+#include "ili9163.h"
+
+#define fontus sim_fontus
+#include "font.h"
+#undef fontus
+
+#define LCD_COLUMNS			132
+#define LCD_PAGES			162
+#define LCD_TEXT_COLUMNS	21
+#define LCD_TEXT_ROWS		16
+#define LCD_TEXT_SIZE		(LCD_TEXT_ROWS * (LCD_TEXT_COLUMNS + 1) + 1)
+#define LCD_SETTLE			(SIM_MS(20))	// Quiet time before the screen is read back
+
+static uint16_t gram[LCD_PAGES][LCD_COLUMNS];
+
+static uint8_t command;
+static uint8_t params[4];
+static uint8_t param_count;
+static uint8_t pixel_high;
+static uint8_t pixel_half;
+
+static uint16_t col_start, col_end = LCD_COLUMNS - 1, page_start, page_end = LCD_PAGES - 1;
+static uint16_t col, page;
+static uint8_t writing;
+static uint8_t sleeping = 1;
+static uint8_t display_on;
+static SimTime sleep_out_at;
+
+static const char ocr_order[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"
+	"!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+
+static uint64_t pixels;
+static uint64_t windows;
+static char last_text[LCD_TEXT_SIZE];
+
+static void lcd_reset(void)
+{
+	command = NOP;
+	param_count = 0;
+	pixel_half = 0;
+	writing = 0;
+	sleeping = 1;
+	display_on = 0;
+	col_start = 0;
+	col_end = LCD_COLUMNS - 1;
+	page_start = 0;
+	page_end = LCD_PAGES - 1;
+}
+
+static void on_command(uint8_t cmd)
+{
+	command = cmd;
+	param_count = 0;
+	pixel_half = 0;
+	writing = 0;
+
+	switch (cmd)
+	{
+		case SOFT_RESET:
+			lcd_reset();
+			break;
+		case EXIT_SLEEP_MODE:
+			sleeping = 0;
+			sleep_out_at = sim_now;
+			break;
+		case ENTER_SLEEP_MODE:
+			sleeping = 1;
+			break;
+		case SET_DISPLAY_ON:
+			display_on = 1;
+			break;
+		case SET_DISPLAY_OFF:
+			display_on = 0;
+			break;
+		case WRITE_MEMORY_START:
+			col = col_start;
+			page = page_start;
+			writing = 1;
+			windows++;
+			if (sleeping)
+				Sim_Trace(SIM_TRACE_LCD, "lcd RAMWR while in sleep mode");
+			break;
+		case WRITE_MEMORY_CONTINUE:
+			writing = 1;
+			break;
+		default:
+			break;
+	}
+}
+
+static void on_pixel(uint16_t colour)
+{
+	if (col < LCD_COLUMNS && page < LCD_PAGES)
+		gram[page][col] = colour;
+	pixels++;
+
+	if (++col > col_end)
+	{
+		col = col_start;
+		if (++page > page_end)
+			page = page_start;
+	}
+}
+
+static void on_data(uint8_t value)
+{
+	if (writing)
+	{
+		if (!pixel_half)
+		{
+			pixel_high = value;
+			pixel_half = 1;
+		}
+		else
+		{
+			pixel_half = 0;
+			on_pixel((uint16_t)((pixel_high << 8) | value));
+		}
+		return;
+	}
+
+	if (param_count < sizeof(params))
+		params[param_count] = value;
+	param_count++;
+
+	if (param_count == 4 && (command == SET_COLUMN_ADDRESS || command == SET_PAGE_ADDRESS))
+	{
+		uint16_t start = (uint16_t)((params[0] << 8) | params[1]);
+		uint16_t end = (uint16_t)((params[2] << 8) | params[3]);
+
+		if (command == SET_COLUMN_ADDRESS)
+		{
+			col_start = start;
+			col_end = end;
+		}
+		else
+		{
+			page_start = start;
+			page_end = end;
+		}
+		if (start > end)
+			Sim_Trace(SIM_TRACE_LCD, "lcd window start %u is past its end %u", start, end);
+	}
+}
+
+/**
+ * @brief Reads a 6x8 cell back into a character of the firmware's font.
+ * @retval the character, ' ' for a plain cell, '?' for graphics.
+ */
+static char read_cell(uint16_t x, uint16_t y)
+{
+	uint16_t colours[2];
+	int distinct = 0;
+
+	for (uint16_t r = 0; r < 8; r++)
+	{
+		for (uint16_t c = 0; c < 6; c++)
+		{
+			uint16_t p = gram[y + r][x + c];
+
+			if (distinct >= 1 && p == colours[0])
+				continue;
+			if (distinct == 2 && p == colours[1])
+				continue;
+			if (distinct == 2)
+				return '?';
+			colours[distinct++] = p;
+		}
+	}
+	if (distinct == 1)
+		return ' ';
+
+	for (int fg = 0; fg < 2; fg++)
+	{
+		uint8_t glyph[6];
+
+		for (uint16_t c = 0; c < 6; c++)
+		{
+			glyph[c] = 0;
+			for (uint16_t r = 0; r < 8; r++)
+				if (gram[y + r][x + c] == colours[fg])
+					glyph[c] |= (uint8_t)(1U << r);
+		}
+		// Letters first: the font draws 'O' and '0' alike
+		for (const char *ch = ocr_order; *ch; ch++)
+			if ((unsigned char)*ch < sizeof(sim_fontus) / sizeof(sim_fontus[0])
+				&& memcmp(glyph, sim_fontus[(unsigned char)*ch], 6) == 0)
+				return *ch;
+	}
+	return '?';
+}
+
+static int numeric(char c)
+{
+	return (c >= '0' && c <= '9') || c == ':' || c == '_';
+}
+
+/**
+ * @brief 'O' and '0' share a glyph: an 'O' next to digits, ':' or '_' is
+ *        read as a zero (times, dates and UIDs).
+ */
+static void resolve_zeros(char *line, int len)
+{
+	int changed = 1;
+
+	while (changed)
+	{
+		changed = 0;
+		for (int i = 0; i < len; i++)
+		{
+			if (line[i] == 'O' && ((i > 0 && numeric(line[i - 1])) || (i + 1 < len && numeric(line[i + 1]))))
+			{
+				line[i] = '0';
+				changed = 1;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Text on the screen, one line per non-empty text row.
+ */
+void Sim_Ili9163Text(char *buf, size_t size)
+{
+	size_t used = 0;
+
+	if (size == 0)
+		return;
+	buf[0] = '\0';
+
+	for (uint16_t row = 0; row < LCD_TEXT_ROWS; row++)
+	{
+		char line[LCD_TEXT_COLUMNS + 1];
+		int len = 0;
+
+		for (uint16_t c = 0; c < LCD_TEXT_COLUMNS; c++)
+			line[len++] = read_cell((uint16_t)(c * 6), (uint16_t)(row * 8));
+		while (len > 0 && line[len - 1] == ' ')
+			len--;
+		line[len] = '\0';
+		resolve_zeros(line, len);
+		if (len == 0)
+			continue;
+
+		{
+			char *start = line;
+
+			while (*start == ' ')
+				start++;
+			used += (size_t)snprintf(buf + used, size - used, "%s%s", used ? "\n" : "", start);
+			if (used >= size)
+				return;
+		}
+	}
+}
+
+static void on_settled(void *ctx)
+{
+	char text[LCD_TEXT_SIZE];
+
+	(void)ctx;
+	Sim_Ili9163Text(text, sizeof(text));
+	if (strcmp(text, last_text) == 0)
+		return;
+
+	strcpy(last_text, text);
+	Sim_OnLcdText(text);
+	if (sim_trace & SIM_TRACE_LCD)
+	{
+		for (char *p = text; *p; p++)
+			if (*p == '\n')
+				*p = '|';
+		Sim_Trace(SIM_TRACE_LCD, "lcd shows \"%s\"", text);
+	}
+}
+
+static uint8_t dc_level;
+
+static void lcd_dc(int level)
+{
+	dc_level = (uint8_t)level;
+}
+
+static void lcd_reset_pin(int level)
+{
+	if (level == 0)
+		lcd_reset();
+}
+
+static void lcd_select(int selected)
+{
+	// A burst keeps the display selected for longer than the settle time
+	if (selected)
+		Sim_Cancel(on_settled, NULL);
+	else if (writing)
+	{
+		Sim_Cancel(on_settled, NULL);
+		Sim_Schedule(sim_now + LCD_SETTLE, on_settled, NULL);
+	}
+}
+
+static uint8_t lcd_exchange(uint8_t mosi)
+{
+	if (!Sim_GpioOutput(DISPLAY_RESET_PIN_GPIO_Port, DISPLAY_RESET_PIN_Pin))
+		return 0x00;
+	if (dc_level)
+		on_data(mosi);
+	else
+		on_command(mosi);
+	return 0x00;
+}
+
+static SimSpiDevice lcd_device = {
+	.name = "ILI9163",
+	.cs_port = DISPLAY_CS_PIN_GPIO_Port,
+	.cs_pin = DISPLAY_CS_PIN_Pin,
+	.account = SIM_ACC_SPI_LCD,
+	.max_sclk = 15000000U,
+	.select = lcd_select,
+	.exchange = lcd_exchange,
+};
+
+void Sim_Ili9163Attach(void)
+{
+	lcd_reset();
+	Sim_SpiAttach(&lcd_device);
+	Sim_GpioWatch(DISPLAY_CD_PIN_GPIO_Port, DISPLAY_CD_PIN_Pin, lcd_dc);
+	Sim_GpioWatch(DISPLAY_RESET_PIN_GPIO_Port, DISPLAY_RESET_PIN_Pin, lcd_reset_pin);
+}
+
+uint64_t Sim_Ili9163Pixels(void)
+{
+	return pixels;
+}
+
+/**
+ * @brief Writes the visible 128x128 area as a binary PPM image.
+ */
+int Sim_Ili9163DumpPpm(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL)
+		return -1;
+
+	fprintf(f, "P6\n128 128\n255\n");
+	for (int y = 0; y < 128; y++)
+	{
+		for (int x = 0; x < 128; x++)
+		{
+			uint16_t v = display_on ? gram[y][x] : 0;
+			uint8_t rgb[3] = {
+				(uint8_t)((v & 0x1F) * 255 / 31),
+				(uint8_t)(((v >> 5) & 0x3F) * 255 / 63),
+				(uint8_t)((v >> 11) * 255 / 31),
+			};
+
+			fwrite(rgb, 1, 3, f);
+		}
+	}
+	return fclose(f);
+}
+
+void Sim_Ili9163Report(FILE *out)
+{
+	fprintf(out, "  ILI9163: %llu pixels written in %llu windows%s\n", (unsigned long long)pixels,
+			(unsigned long long)windows, sleep_out_at ? "" : ", never left sleep mode");
+}
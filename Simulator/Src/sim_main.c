@@ -0,0 +1,541 @@
+/**
+ ******************************************************************************
+  * @file    sim_main.c
+  * @brief   Entry point of the host simulator: command line, scenario player
+  *          and per-swipe latency report.
+  ******************************************************************************
+  *
+  * A scenario is a text file with one event per line:
+  *
+  *   <time> press prichod|odchod     press and release a button
+  *   <time> card <UID hex> [SAK hex]  put a card on the reader
+  *   <time> remove [UID hex]          take a card (or all cards) away
+  *   <time> sd-remove | sd-insert     take the SD card out or put it back
+ *   <time> uart <text>               type a command line into the UART terminal
+  *   <time> end                       stop the simulation
+  *
+  * <time> is absolute in milliseconds, or relative to the previous event
+  * when it starts with '+'. Lines starting with '#' are comments.
+  */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "main.h"
+
+#define SIM_MAX_SWIPES		512
+#define SIM_TEXT_SIZE		160
+#define SIM_PRESS_TIME		(SIM_MS(80))
+
+extern int firmware_main(void);
+
+typedef enum
+{
+	EV_PRESS,
+	EV_RELEASE,
+	EV_CARD,
+	EV_REMOVE,
+	EV_SD_REMOVE,
+	EV_SD_INSERT,
+	EV_RTC_SKIP,
+	EV_POWER_FAIL,
+	EV_UART,
+	EV_END
+} EventType;
+
+typedef struct
+{
+	EventType type;
+	uint16_t pin;
+	uint8_t uid[SIM_UID_MAX];
+	uint8_t uid_len;
+	uint8_t sak;
+	int64_t seconds;
+	char *text;
+} Event;
+
+typedef struct
+{
+	SimTime press;
+	SimTime card;
+	SimTime read;
+	SimTime shown;			// First screen update after the UID was read
+	uint8_t direction;
+	uint8_t uid[SIM_UID_MAX];
+	uint8_t uid_len;
+	uint32_t blocks_read;
+	uint32_t blocks_written;
+	SimTime last_write;
+	char text[SIM_TEXT_SIZE];
+} Swipe;
+
+static Swipe swipes[SIM_MAX_SWIPES];
+static int swipe_count;
+static SimTime end_time = SIM_MS(60000);
+static const char *lcd_dump_path;
+static int list_sd;
+static const char *get_path;
+static const char *put_path;
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Scenario events
+/////////////////////////////////////////////////////////////////////////////////////
+
+static Swipe *current_swipe(void)
+{
+	return swipe_count ? &swipes[swipe_count - 1] : NULL;
+}
+
+static void close_swipe(void)
+{
+	Swipe *s = current_swipe();
+
+	if (s == NULL)
+		return;
+	s->blocks_read = Sim_SdBlocksRead() - s->blocks_read;
+	s->blocks_written = Sim_SdBlocksWritten() - s->blocks_written;
+	s->last_write = Sim_SdLastWrite() > s->press ? Sim_SdLastWrite() : 0;
+}
+
+static void run_event(void *ctx)
+{
+	Event *ev = ctx;
+
+	switch (ev->type)
+	{
+		case EV_PRESS:
+		{
+			Swipe *s;
+
+			close_swipe();
+			if (swipe_count == SIM_MAX_SWIPES)
+				Sim_Fatal("too many swipes in the scenario");
+			s = &swipes[swipe_count++];
+			memset(s, 0, sizeof(*s));
+			s->press = sim_now;
+			s->direction = ev->pin == PRICHOD_Pin ? 1 : 2;
+			s->blocks_read = Sim_SdBlocksRead();
+			s->blocks_written = Sim_SdBlocksWritten();
+			Sim_Trace(SIM_TRACE_IRQ, "button %s pressed", s->direction == 1 ? "prichod" : "odchod");
+			Sim_GpioDrive(GPIOA, ev->pin, 0);
+			break;
+		}
+		case EV_RELEASE:
+			Sim_GpioDrive(GPIOA, ev->pin, 1);
+			break;
+		case EV_CARD:
+			if (current_swipe() && current_swipe()->card == 0)
+				current_swipe()->card = sim_now;
+			if (Sim_PiccEnter(ev->uid, ev->uid_len, ev->sak) != 0)
+				Sim_Fatal("cannot put the card on the reader");
+			Sim_Trace(SIM_TRACE_RFID, "card placed");
+			break;
+		case EV_REMOVE:
+			if (ev->uid_len)
+				Sim_PiccLeave(ev->uid, ev->uid_len);
+			else
+				Sim_PiccLeaveAll();
+			Sim_Trace(SIM_TRACE_RFID, "card removed");
+			break;
+		case EV_SD_REMOVE:
+		case EV_SD_INSERT:
+			Sim_SdSetPresent(ev->type == EV_SD_INSERT);
+			break;
+		case EV_RTC_SKIP:
+			Sim_RtcSkip(ev->seconds);
+			break;
+		case EV_POWER_FAIL:
+			Sim_PowerFail();
+			break;
+		case EV_UART:
+			Sim_UartReceive(ev->text);
+			break;
+		case EV_END:
+			Sim_Finish(0);
+	}
+}
+
+static Event *new_event(EventType type)
+{
+	Event *ev = calloc(1, sizeof(*ev));
+
+	if (ev == NULL)
+		Sim_Fatal("out of memory");
+	ev->type = type;
+	return ev;
+}
+
+static int parse_uid(const char *hex, uint8_t *uid, uint8_t *len)
+{
+	size_t n = strlen(hex);
+
+	if (n % 2 || (n != 8 && n != 14 && n != 20))
+		return -1;
+	for (size_t i = 0; i < n / 2; i++)
+	{
+		char byte[3] = { hex[2 * i], hex[2 * i + 1], 0 };
+
+		if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1]))
+			return -1;
+		uid[i] = (uint8_t)strtoul(byte, NULL, 16);
+	}
+	*len = (uint8_t)(n / 2);
+	return 0;
+}
+
+static void schedule_press(SimTime at, uint16_t pin)
+{
+	Event *press = new_event(EV_PRESS);
+	Event *release = new_event(EV_RELEASE);
+
+	press->pin = pin;
+	release->pin = pin;
+	Sim_Schedule(at, run_event, press);
+	Sim_Schedule(at + SIM_PRESS_TIME, run_event, release);
+}
+
+static void load_scenario(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	SimTime at = 0;
+	int number = 0;
+
+	if (f == NULL)
+		Sim_Fatal("cannot open scenario %s", path);
+
+	while (fgets(line, sizeof(line), f))
+	{
+		char time_str[32], what[32], arg1[32] = "", arg2[32] = "";
+		int fields;
+		Event *ev;
+
+		number++;
+		if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+			continue;
+
+		fields = sscanf(line, "%31s %31s %31s %31s", time_str, what, arg1, arg2);
+		if (fields < 2)
+			Sim_Fatal("%s:%d: expected \"<ms> <event>\"", path, number);
+
+		if (time_str[0] == '+')
+			at += SIM_MS(strtoull(time_str + 1, NULL, 10));
+		else
+			at = SIM_MS(strtoull(time_str, NULL, 10));
+
+		if (strcmp(what, "press") == 0)
+		{
+			if (strcmp(arg1, "prichod") == 0)
+				schedule_press(at, PRICHOD_Pin);
+			else if (strcmp(arg1, "odchod") == 0)
+				schedule_press(at, ODCHOD_Pin);
+			else
+				Sim_Fatal("%s:%d: unknown button \"%s\"", path, number, arg1);
+			continue;
+		}
+
+		if (strcmp(what, "card") == 0)
+		{
+			ev = new_event(EV_CARD);
+			if (parse_uid(arg1, ev->uid, &ev->uid_len) != 0)
+				Sim_Fatal("%s:%d: UID must have 4, 7 or 10 bytes in hex", path, number);
+			ev->sak = fields >= 4 ? (uint8_t)strtoul(arg2, NULL, 16) : 0x08;
+		}
+		else if (strcmp(what, "remove") == 0)
+		{
+			ev = new_event(EV_REMOVE);
+			if (fields >= 3 && parse_uid(arg1, ev->uid, &ev->uid_len) != 0)
+				Sim_Fatal("%s:%d: bad UID", path, number);
+		}
+		else if (strcmp(what, "sd-remove") == 0)
+		{
+			ev = new_event(EV_SD_REMOVE);
+		}
+		else if (strcmp(what, "sd-insert") == 0)
+		{
+			ev = new_event(EV_SD_INSERT);
+		}
+		else if (strcmp(what, "rtc-skip") == 0)
+		{
+			ev = new_event(EV_RTC_SKIP);
+			ev->seconds = fields >= 3 ? strtoll(arg1, NULL, 10) : 0;
+		}
+		else if (strcmp(what, "power-fail") == 0)
+		{
+			ev = new_event(EV_POWER_FAIL);
+		}
+		else if (strcmp(what, "uart") == 0)
+		{
+			// The rest of the line is sent as it is
+			char *text = strstr(line + strlen(time_str), "uart") + strlen("uart");
+
+			text += strspn(text, " \t");
+			text[strcspn(text, "\r\n")] = '\0';
+			ev = new_event(EV_UART);
+			ev->text = strdup(text);
+		}
+		else if (strcmp(what, "end") == 0)
+		{
+			ev = new_event(EV_END);
+			end_time = at;
+		}
+		else
+		{
+			Sim_Fatal("%s:%d: unknown event \"%s\"", path, number, what);
+		}
+		Sim_Schedule(at, run_event, ev);
+	}
+	fclose(f);
+}
+
+/**
+ * @brief Built-in scenario: employees take turns, each swipe is a button
+ *        press followed by the card 700 ms later, held for 1.5 s.
+ */
+static void generate_scenario(int count, uint32_t interval_ms, int employees)
+{
+	SimTime at = SIM_MS(6000);
+
+	for (int i = 0; i < count; i++)
+	{
+		int who = i % employees;
+		Event *card = new_event(EV_CARD);
+		Event *remove = new_event(EV_REMOVE);
+
+		schedule_press(at, ((i / employees) % 2) ? ODCHOD_Pin : PRICHOD_Pin);
+
+		card->uid[0] = (uint8_t)(0x10 + who);
+		card->uid[1] = (uint8_t)(0xA7 ^ (who * 13));
+		card->uid[2] = 0x3C;
+		card->uid[3] = (uint8_t)(0x5A + 3 * who);
+		card->uid_len = 4;
+		card->sak = 0x08;
+		Sim_Schedule(at + SIM_MS(700), run_event, card);
+		Sim_Schedule(at + SIM_MS(2200), run_event, remove);
+
+		at += SIM_MS(interval_ms);
+	}
+	end_time = at + SIM_MS(2000);
+	Sim_Schedule(end_time, run_event, new_event(EV_END));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Observers called by the virtual devices
+/////////////////////////////////////////////////////////////////////////////////////
+
+void Sim_OnUidRead(const uint8_t *uid, uint8_t uid_len)
+{
+	Swipe *s = current_swipe();
+
+	if (s == NULL || s->read)
+		return;
+	s->read = sim_now;
+	memcpy(s->uid, uid, uid_len);
+	s->uid_len = uid_len;
+}
+
+void Sim_OnLcdText(const char *text)
+{
+	Swipe *s = current_swipe();
+	size_t used;
+
+	if (s == NULL || s->card == 0)
+		return;
+	if (s->read && s->shown == 0)
+		s->shown = sim_now;
+
+	// Keep everything shown after the card was placed, separated by '|'
+	used = strlen(s->text);
+	snprintf(s->text + used, sizeof(s->text) - used, "%s", used ? " | " : "");
+	used = strlen(s->text);
+	for (const char *p = text; *p && used + 1 < sizeof(s->text); p++)
+		s->text[used++] = *p == '\n' ? ' ' : *p;
+	s->text[used] = '\0';
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Report
+/////////////////////////////////////////////////////////////////////////////////////
+
+void Sim_Report(FILE *out)
+{
+	SimTime read_sum = 0, shown_sum = 0, commit_sum = 0;
+	int reads = 0, shown = 0, commits = 0;
+
+	close_swipe();
+	fprintf(out, "\nswipe  time [s]  button   UID                   card->read [ms]  press->read [ms]  card->LCD [ms]  press->SD [ms]  blk rd/wr  screen\n");
+	for (int i = 0; i < swipe_count; i++)
+	{
+		Swipe *s = &swipes[i];
+		char uid[3 * SIM_UID_MAX + 1] = "-";
+
+		for (int b = 0; b < s->uid_len; b++)
+			snprintf(uid + 3 * b, sizeof(uid) - 3 * b, "%02X%s", s->uid[b], b + 1 < s->uid_len ? ":" : "");
+
+		fprintf(out, "%5d  %8.3f  %-7s  %-20s", i + 1, Sim_Ms(s->press) / 1000.0,
+				s->direction == 1 ? "prichod" : "odchod", uid);
+		if (s->read && s->card)
+			fprintf(out, "  %15.1f", Sim_Ms(s->read - s->card));
+		else
+			fprintf(out, "  %15s", "-");
+		if (s->read)
+		{
+			fprintf(out, "  %16.1f", Sim_Ms(s->read - s->press));
+			read_sum += s->read - s->press;
+			reads++;
+		}
+		else
+		{
+			fprintf(out, "  %16s", "not read");
+		}
+		if (s->shown && s->card)
+		{
+			fprintf(out, "  %14.1f", Sim_Ms(s->shown - s->card));
+			shown_sum += s->shown - s->card;
+			shown++;
+		}
+		else
+		{
+			fprintf(out, "  %14s", "-");
+		}
+		if (s->last_write)
+		{
+			fprintf(out, "  %14.1f", Sim_Ms(s->last_write - s->press));
+			commit_sum += s->last_write - s->press;
+			commits++;
+		}
+		else
+		{
+			fprintf(out, "  %14s", "-");
+		}
+		fprintf(out, "  %4u/%-4u  %s\n", (unsigned)s->blocks_read, (unsigned)s->blocks_written, s->text);
+	}
+	fprintf(out, "%d of %d swipes read", reads, swipe_count);
+	if (reads)
+		fprintf(out, ", mean press->read %.1f ms", Sim_Ms(read_sum / (SimTime)reads));
+	if (shown)
+		fprintf(out, ", mean card->LCD %.1f ms", Sim_Ms(shown_sum / (SimTime)shown));
+	if (commits)
+		fprintf(out, ", mean press->SD %.1f ms", Sim_Ms(commit_sum / (SimTime)commits));
+	fprintf(out, "\n\nbus usage at %.3f s\n", Sim_Ms(sim_now) / 1000.0);
+	for (SimSpiDevice *d = Sim_SpiDevices(); d; d = d->next)
+		fprintf(out, "  %-8s %10llu bytes in %8llu transactions\n", d->name,
+				(unsigned long long)d->bytes, (unsigned long long)d->transactions);
+	Sim_Mfrc522Report(out);
+	Sim_Ili9163Report(out);
+	Sim_SdReport(out);
+
+	if (lcd_dump_path && Sim_Ili9163DumpPpm(lcd_dump_path) != 0)
+		fprintf(stderr, "rfid_sim: cannot write %s\n", lcd_dump_path);
+	if (list_sd)
+		Sim_SdList(out);
+	if (get_path)
+	{
+		const char *base = strrchr(get_path, '/');
+
+		base = base ? base + 1 : get_path;
+		if (Sim_SdGet(get_path, base) != 0)
+			fprintf(stderr, "rfid_sim: cannot copy %s from the SD image\n", get_path);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Command line
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: rfid_sim [options]\n"
+			"  --scenario FILE     play the events in FILE\n"
+			"  --swipes N          built-in scenario with N swipes (default 3)\n"
+			"  --interval MS       time between built-in swipes (default 15000)\n"
+			"  --employees K       distinct cards in the built-in scenario (default 4)\n"
+			"  --sd IMAGE          SD card image (default sd.img, created and formatted if missing)\n"
+			"  --sd-size MB        size of a new image (default 64)\n"
+			"  --format            format the image before starting\n"
+			"  --uart FILE         write the UART output to FILE\n"
+			"  --lcd-dump FILE     write the final screen as a PPM image\n"
+			"  --ls                list the SD image after the run\n"
+			"  --get PATH          copy PATH from the SD image to the current directory after the run\n"
+			"  --put FILE          copy FILE to the root of the SD image before the run\n"
+			"  --trace LIST        comma separated: sd,rfid,lcd,irq,uart,all\n");
+	exit(1);
+}
+
+static uint32_t parse_trace(const char *list)
+{
+	uint32_t mask = 0;
+	char copy[128];
+
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ","))
+	{
+		if (strcmp(tok, "sd") == 0)			mask |= SIM_TRACE_SD;
+		else if (strcmp(tok, "rfid") == 0)	mask |= SIM_TRACE_RFID;
+		else if (strcmp(tok, "lcd") == 0)	mask |= SIM_TRACE_LCD;
+		else if (strcmp(tok, "irq") == 0)	mask |= SIM_TRACE_IRQ;
+		else if (strcmp(tok, "uart") == 0)	mask |= SIM_TRACE_UART;
+		else if (strcmp(tok, "all") == 0)	mask |= 0xFFFFFFFFU;
+		else usage();
+	}
+	return mask;
+}
+
+int main(int argc, char **argv)
+{
+	const char *scenario = NULL;
+	const char *sd_image = "sd.img";
+	uint32_t sd_size = 64;
+	int swipe_total = 3, employees = 4, format = 0, created;
+	uint32_t interval = 15000;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *opt = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(opt, "--format") == 0)			{ format = 1; continue; }
+		if (strcmp(opt, "--ls") == 0)				{ list_sd = 1; continue; }
+		if (val == NULL)
+			usage();
+		i++;
+		if (strcmp(opt, "--scenario") == 0)			scenario = val;
+		else if (strcmp(opt, "--swipes") == 0)		swipe_total = atoi(val);
+		else if (strcmp(opt, "--interval") == 0)	interval = (uint32_t)atoi(val);
+		else if (strcmp(opt, "--employees") == 0)	employees = atoi(val);
+		else if (strcmp(opt, "--sd") == 0)			sd_image = val;
+		else if (strcmp(opt, "--sd-size") == 0)		sd_size = (uint32_t)atoi(val);
+		else if (strcmp(opt, "--uart") == 0)		Sim_UartOpen(val);
+		else if (strcmp(opt, "--lcd-dump") == 0)	lcd_dump_path = val;
+		else if (strcmp(opt, "--get") == 0)			get_path = val;
+		else if (strcmp(opt, "--put") == 0)			put_path = val;
+		else if (strcmp(opt, "--trace") == 0)		sim_trace = parse_trace(val);
+		else usage();
+	}
+	if (swipe_total < 0 || employees < 1)
+		usage();
+
+	Sim_MapPeripherals();
+
+	created = Sim_SdAttach(sd_image, sd_size);
+	if (created < 0)
+		Sim_Fatal("cannot open the SD image %s", sd_image);
+	if ((created || format) && Sim_SdFormat() != 0)
+		Sim_Fatal("cannot format %s", sd_image);
+	if (put_path && Sim_SdPut(put_path) != 0)
+		Sim_Fatal("cannot copy %s to the SD image", put_path);
+	Sim_Mfrc522Attach();
+	Sim_Ili9163Attach();
+
+	if (scenario)
+		load_scenario(scenario);
+	else
+		generate_scenario(swipe_total, interval, employees);
+	Sim_SetEndTime(end_time);
+
+	firmware_main();
+	Sim_Fatal("firmware main() returned");
+}
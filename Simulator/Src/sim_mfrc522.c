@@ -0,0 +1,940 @@
+/**
+ ******************************************************************************
+  * @file    sim_mfrc522.c
+  * @brief   Virtual MFRC522 reader IC on SPI1 (CS PA9) and ISO/IEC 14443-3
+  *          type A cards in its field.
+  ******************************************************************************
+  *
+  * The register file, FIFO, CRC coprocessor and timer behave as described in
+  * the MFRC522 datasheet (rev. 3.9). Frames are timed at 106 kbit/s, so a
+  * REQA round trip or a timeout costs what it costs on the bench.
+  *
+  * Cards are MIFARE Classic 1K in transport configuration: every sector has
+  * the keys FFFFFFFFFFFF and the access bits are not checked. Crypto1 only
+  * changes the bits on air, the FIFO of the reader holds plain data, so
+  * MFAuthent checks the key and the card answers READ and WRITE in plain.
+  */
+
+#include <string.h>
+
+#include "sim.h"
+#include "mfrc522.h"
+
+#define RC_FIFO_SIZE		64
+#define RC_MAX_CARDS		4
+#define RC_FRAME_MAX		(RC_FIFO_SIZE + 2)
+
+/* MIFARE Classic 1K */
+#define RC_MF_BLOCKS		64
+#define RC_MF_NONE			0xFF				// No sector authenticated, no write pending
+#define RC_MF_ACK			0x0A
+#define RC_MF_NAK			0x04
+
+/* One bit at 106 kbit/s is 128 carrier periods of 13.56 MHz */
+#define RC_BIT_TIME			(SIM_NS(9440))
+#define RC_FDT				(SIM_US(91))		// Frame delay time PCD -> PICC -> PCD (n = 9)
+
+/* Register bits used by the model */
+#define RC_COM_IRQ_SET1		0x80
+#define RC_COM_IRQ_TX		0x40
+#define RC_COM_IRQ_RX		0x20
+#define RC_COM_IRQ_IDLE		0x10
+#define RC_COM_IRQ_ERR		0x02
+#define RC_COM_IRQ_TIMER	0x01
+#define RC_DIV_IRQ_SET2		0x80
+#define RC_DIV_IRQ_CRC		0x04
+#define RC_ERR_BUFFER_OVFL	0x10
+#define RC_ERR_COLL			0x08
+#define RC_ERR_CRC			0x04
+#define RC_COLL_POS_INVALID	0x20
+#define RC_CRC_EN			0x80				// TxCRCEn / RxCRCEn
+#define RC_START_SEND		0x80
+#define RC_STATUS2_CRYPTO	0x08
+#define RC_POWER_DOWN		0x10				// CommandReg: soft power-down
+#define RC_IRQ_INV			0x80				// ComIEnReg: IRQ pin active low
+#define RC_IRQ_PUSH_PULL	0x80				// DivIEnReg: IRQ pin driven while inactive
+
+/* IRQ pin of the module, wired to PA0 */
+#define RC_IRQ_PORT			GPIOA
+#define RC_IRQ_PIN			GPIO_PIN_0
+
+typedef enum
+{
+	PICC_OFF = 0,		// Not in an energised field
+	PICC_IDLE,
+	PICC_READY,
+	PICC_ACTIVE,
+	PICC_HALT
+} PiccState;
+
+typedef struct
+{
+	uint8_t present;
+	uint8_t uid[SIM_UID_MAX];
+	uint8_t uid_len;
+	uint8_t sak;
+	PiccState state;
+	uint8_t halted;		// Entered READY from HALT, returns there on errors
+	uint8_t level;		// Cascade level being resolved in READY
+	uint8_t report;		// Last response completed the UID
+	uint8_t auth_sector;	// Sector authenticated by MFAuthent, RC_MF_NONE if none
+	uint8_t write_block;	// Block of a WRITE waiting for its data, RC_MF_NONE if none
+	uint8_t memory[RC_MF_BLOCKS][16];
+} Picc;
+
+typedef struct
+{
+	uint8_t bits[RC_FRAME_MAX * 8];
+	uint16_t len;
+} BitFrame;
+
+static uint8_t regs[64];
+static uint8_t fifo[RC_FIFO_SIZE];
+static uint8_t fifo_len;
+
+static uint8_t spi_first;
+static uint8_t spi_read;
+static uint8_t spi_addr;
+
+static uint8_t command;
+static Picc cards[RC_MAX_CARDS];
+static BitFrame rx_frame;
+static uint8_t rx_collision;
+static uint16_t rx_collision_pos;
+
+static uint32_t selections;
+static uint32_t authentications;
+static uint64_t transceives;
+static uint64_t timeouts;
+static SimTime field_since;
+static SimTime field_total;
+
+static const uint8_t reset_values[64] = {
+	[COMMAND_REG] = 0x20, [COM_I_EN_REG] = 0x80, [COM_IRQ_REG] = 0x14, [STATUS_1_REG] = 0x21,
+	[WATER_LEVEL_REG] = 0x08, [CONTROL_REG] = 0x10, [COLL_REG] = 0xA0, [MODE_REG] = 0x3F,
+	[TX_CONTROL_REG] = 0x80, [TX_SEL_REG] = 0x10, [RX_SEL_REG] = 0x84, [RX_THRESHOLD_REG] = 0x84,
+	[DEMOD_REG] = 0x4D, [MF_TX_REG] = 0x62, [0x1F] = 0xEB, [CRC_RESULT_REG_HIGH] = 0xFF,
+	[CRC_RESULT_REG_LOW] = 0xFF, [MOD_WIDTH_REG] = 0x26, [RFC_FG_REG] = 0x48, [GS_N_REG] = 0x88,
+	[CWG_SP_REG] = 0x20, [MOD_GSP_REG] = 0x20, [VERSION_REG] = 0x92,
+};
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief CRC_A of ISO/IEC 14443-3 (CRC-16/CCITT reflected, given preset).
+ */
+static uint16_t crc_a(const uint8_t *data, size_t len, uint16_t preset)
+{
+	uint16_t crc = preset;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t b = data[i] ^ (uint8_t)crc;
+
+		b ^= (uint8_t)(b << 4);
+		crc = (uint16_t)((crc >> 8) ^ ((uint16_t)b << 8) ^ ((uint16_t)b << 3) ^ (b >> 4));
+	}
+	return crc;
+}
+
+static uint16_t crc_preset(void)
+{
+	static const uint16_t presets[4] = { 0x0000, 0x6363, 0xA671, 0xFFFF };
+
+	return presets[regs[MODE_REG] & 0x03];
+}
+
+static void frame_from_bytes(BitFrame *f, const uint8_t *data, size_t len, uint8_t last_bits)
+{
+	f->len = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t n = (i == len - 1 && last_bits) ? last_bits : 8;
+
+		for (uint8_t b = 0; b < n; b++)
+			f->bits[f->len++] = (data[i] >> b) & 1U;
+	}
+}
+
+static size_t frame_to_bytes(const BitFrame *f, uint8_t *data)
+{
+	size_t bytes = (f->len + 7U) / 8U;
+
+	memset(data, 0, bytes);
+	for (uint16_t i = 0; i < f->len; i++)
+		data[i / 8U] |= (uint8_t)(f->bits[i] << (i % 8U));
+	return bytes;
+}
+
+/**
+ * @brief Air time of a frame: data bits, one parity bit per full byte, SOF and EOF.
+ */
+static SimTime air_time(uint16_t bits)
+{
+	return (SimTime)(bits + bits / 8U + 2U) * RC_BIT_TIME;
+}
+
+static int field_on(void)
+{
+	return (regs[TX_CONTROL_REG] & 0x03) != 0 && !(regs[COMMAND_REG] & RC_POWER_DOWN);
+}
+
+static void cascade_bytes(const Picc *card, uint8_t level, uint8_t out[5])
+{
+	uint8_t levels = card->uid_len == 4 ? 1 : (card->uid_len == 7 ? 2 : 3);
+
+	if (level + 1 < levels)
+	{
+		out[0] = PICC_CMD_CT;
+		memcpy(&out[1], &card->uid[level * 3], 3);
+	}
+	else
+	{
+		memcpy(out, &card->uid[level * 3], 4);
+	}
+	out[4] = out[0] ^ out[1] ^ out[2] ^ out[3];
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Card (PICC) state machine
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void picc_error(Picc *card)
+{
+	// A halted card only reacts to WUPA, frames for other cards leave it halted
+	if (card->state != PICC_HALT)
+		card->state = card->halted ? PICC_HALT : PICC_IDLE;
+	card->auth_sector = RC_MF_NONE;
+	card->write_block = RC_MF_NONE;
+}
+
+static void picc_reply_bytes(BitFrame *out, const uint8_t *data, size_t len, int with_crc)
+{
+	uint8_t buf[RC_FRAME_MAX];
+
+	memcpy(buf, data, len);
+	if (with_crc)
+	{
+		uint16_t crc = crc_a(data, len, 0x6363);
+
+		buf[len++] = (uint8_t)crc;
+		buf[len++] = (uint8_t)(crc >> 8);
+	}
+	frame_from_bytes(out, buf, len, 0);
+}
+
+/**
+ * @brief Processes a frame of a card authenticated by MFAuthent.
+ * @retval 1 if the card answers with out, 0 if it stays silent.
+ */
+static int picc_mifare(Picc *card, const uint8_t *data, size_t len, BitFrame *out)
+{
+	uint8_t reply = RC_MF_NAK;
+
+	// Without Crypto1 in the reader the card cannot decrypt the frame
+	if (!(regs[STATUS_2_REG] & RC_STATUS2_CRYPTO))
+	{
+		picc_error(card);
+		return 0;
+	}
+
+	if (card->write_block != RC_MF_NONE)
+	{
+		// Second step of WRITE: the 16 data bytes
+		if (len == 18 && crc_a(data, 18, 0x6363) == 0)
+		{
+			memcpy(card->memory[card->write_block], data, 16);
+			card->write_block = RC_MF_NONE;
+			reply = RC_MF_ACK;
+		}
+	}
+	else if (len == 4 && crc_a(data, 4, 0x6363) == 0)
+	{
+		uint8_t addr = data[1];
+		int in_sector = addr < RC_MF_BLOCKS && addr / 4 == card->auth_sector;
+
+		if (data[0] == PICC_CMD_MF_READ && in_sector)
+		{
+			uint8_t block[16];
+
+			// Key A of a sector trailer reads as zeros
+			memcpy(block, card->memory[addr], 16);
+			if (addr % 4 == 3)
+				memset(block, 0, 6);
+			picc_reply_bytes(out, block, 16, 1);
+			return 1;
+		}
+		if (data[0] == PICC_CMD_MF_WRITE && in_sector && addr != 0)
+		{
+			card->write_block = addr;
+			reply = RC_MF_ACK;
+		}
+		if (data[0] == PICC_CMD_HLTA && data[1] == 0x00)
+		{
+			card->state = PICC_HALT;
+			card->auth_sector = RC_MF_NONE;
+			return 0;
+		}
+	}
+
+	frame_from_bytes(out, &reply, 1, 4);
+	if (reply == RC_MF_NAK)
+		picc_error(card);
+	return 1;
+}
+
+/**
+ * @brief Processes one PCD frame in a card.
+ * @retval 1 if the card answers with out, 0 if it stays silent.
+ */
+static int picc_process(Picc *card, const BitFrame *in, BitFrame *out)
+{
+	uint8_t data[RC_FRAME_MAX];
+	size_t len = frame_to_bytes(in, data);
+	uint8_t levels = card->uid_len == 4 ? 1 : (card->uid_len == 7 ? 2 : 3);
+
+	card->report = 0;
+	out->len = 0;
+
+	if (card->state == PICC_OFF)
+		return 0;
+
+	// Short frames: REQA and WUPA
+	if (in->len == 7)
+	{
+		uint8_t cmd = data[0] & 0x7F;
+
+		if ((cmd == PICC_CMD_REQA && card->state == PICC_IDLE)
+			|| (cmd == PICC_CMD_WUPA && (card->state == PICC_IDLE || card->state == PICC_HALT)))
+		{
+			uint8_t atqa[2] = { (uint8_t)(0x04 | ((levels - 1) << 6)), 0x00 };
+
+			card->halted = card->state == PICC_HALT;
+			card->state = PICC_READY;
+			card->level = 0;
+			picc_reply_bytes(out, atqa, 2, 0);
+			return 1;
+		}
+		if (card->state == PICC_READY || card->state == PICC_ACTIVE)
+			picc_error(card);
+		return 0;
+	}
+
+	if (card->state == PICC_READY && in->len >= 16
+		&& data[0] == (uint8_t)(PICC_CMD_SEL_CL1 + 2 * card->level))
+	{
+		uint8_t nvb = data[1];
+		uint8_t cl[5];
+		uint16_t known = (uint16_t)(((nvb >> 4) - 2) * 8 + (nvb & 0x0F));
+
+		cascade_bytes(card, card->level, cl);
+
+		if (nvb == 0x70)
+		{
+			// SELECT: full cascade level plus CRC_A
+			if (in->len != 72 || crc_a(data, 9, 0x6363) != 0 || memcmp(&data[2], cl, 5) != 0)
+			{
+				picc_error(card);
+				return 0;
+			}
+			if (card->level + 1 < levels)
+			{
+				uint8_t sak = 0x04;
+
+				card->level++;
+				picc_reply_bytes(out, &sak, 1, 1);
+			}
+			else
+			{
+				uint8_t sak = card->sak & (uint8_t)~0x04;
+
+				card->state = PICC_ACTIVE;
+				card->report = 1;
+				selections++;
+				picc_reply_bytes(out, &sak, 1, 1);
+			}
+			return 1;
+		}
+
+		// ANTICOLLISION: answer with the bits of the cascade level not yet known
+		if (nvb < 0x20 || known > 40 || in->len != 16 + known)
+		{
+			picc_error(card);
+			return 0;
+		}
+		for (uint16_t i = 0; i < known; i++)
+		{
+			if (in->bits[16 + i] != ((cl[i / 8] >> (i % 8)) & 1U))
+				return 0;	// Not addressed, stays READY
+		}
+		for (uint16_t i = known; i < 40; i++)
+			out->bits[out->len++] = (cl[i / 8] >> (i % 8)) & 1U;
+		card->report = card->level + 1 == levels;
+		return 1;
+	}
+
+	if (card->state == PICC_ACTIVE && card->auth_sector != RC_MF_NONE)
+		return picc_mifare(card, data, len, out);
+
+	if (card->state == PICC_ACTIVE && len == 4 && data[0] == PICC_CMD_HLTA && data[1] == 0x00
+		&& crc_a(data, 4, 0x6363) == 0)
+	{
+		card->state = PICC_HALT;
+		return 0;
+	}
+
+	picc_error(card);
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Reader (PCD)
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void fifo_push(uint8_t value)
+{
+	if (fifo_len == RC_FIFO_SIZE)
+	{
+		regs[ERROR_REG] |= RC_ERR_BUFFER_OVFL;
+		return;
+	}
+	fifo[fifo_len++] = value;
+}
+
+static uint8_t fifo_pop(void)
+{
+	uint8_t value;
+
+	if (fifo_len == 0)
+		return 0;
+	value = fifo[0];
+	memmove(fifo, fifo + 1, --fifo_len);
+	return value;
+}
+
+static void field_changed(int on)
+{
+	for (int i = 0; i < RC_MAX_CARDS; i++)
+	{
+		if (!cards[i].present)
+			continue;
+		cards[i].state = on ? PICC_IDLE : PICC_OFF;
+		cards[i].halted = 0;
+		cards[i].auth_sector = RC_MF_NONE;
+		cards[i].write_block = RC_MF_NONE;
+	}
+	if (on)
+	{
+		field_since = sim_now;
+	}
+	else
+	{
+		field_total += sim_now - field_since;
+	}
+	Sim_Trace(SIM_TRACE_RFID, "rfid antenna %s", on ? "on" : "off");
+}
+
+static SimTime timer_period(void)
+{
+	uint32_t prescaler = ((uint32_t)(regs[T_MODE_REG] & 0x0F) << 8) | regs[T_PRESCALER_REG];
+	uint32_t reload = ((uint32_t)regs[T_RELOAD_REG_HIGH] << 8) | regs[T_RELOAD_REG_LOW];
+
+	return (SimTime)(reload + 1U) * (2U * prescaler + 1U) * 1000000000ULL / 13560U;	// ps
+}
+
+/**
+ * @brief Drives the IRQ pin from the enabled request bits (datasheet 9.3.1.3).
+ *        An open-drain pin that is inactive is left to the pull-up of the MCU.
+ */
+static void update_irq_pin(void)
+{
+	int active = (regs[COM_IRQ_REG] & regs[COM_I_EN_REG] & 0x7F) || (regs[DIV_IRQ_REG] & regs[DIV_I_EN_REG] & 0x14);
+	int inverted = (regs[COM_I_EN_REG] & RC_IRQ_INV) != 0;
+
+	if (!active && inverted && !(regs[DIV_I_EN_REG] & RC_IRQ_PUSH_PULL))
+		Sim_GpioDrive(RC_IRQ_PORT, RC_IRQ_PIN, 1);
+	else
+		Sim_GpioDrive(RC_IRQ_PORT, RC_IRQ_PIN, active != inverted);
+}
+
+static void on_crc_done(void *ctx)
+{
+	(void)ctx;
+	regs[DIV_IRQ_REG] |= RC_DIV_IRQ_CRC;
+	update_irq_pin();
+}
+
+static void on_tx_done(void *ctx)
+{
+	(void)ctx;
+	regs[COM_IRQ_REG] |= RC_COM_IRQ_TX;
+	update_irq_pin();
+}
+
+static void on_timer(void *ctx)
+{
+	(void)ctx;
+	regs[COM_IRQ_REG] |= RC_COM_IRQ_TIMER;
+	timeouts++;
+	update_irq_pin();
+}
+
+static void on_auth_done(void *ctx)
+{
+	(void)ctx;
+	regs[STATUS_2_REG] |= RC_STATUS2_CRYPTO;
+	command = PCD_IDLE;
+	regs[COM_IRQ_REG] |= RC_COM_IRQ_IDLE;
+	update_irq_pin();
+}
+
+/**
+ * @brief MFAuthent: the FIFO holds the command, block, key and 4 UID bytes. The
+ *        three pass authentication takes four frames; a card with another key
+ *        stays silent, so the command only ends by the timer.
+ */
+static void start_authent(void)
+{
+	uint8_t block = fifo[1];
+	Picc *card = NULL;
+	SimTime tx_end;
+
+	regs[STATUS_2_REG] &= (uint8_t)~RC_STATUS2_CRYPTO;
+	regs[ERROR_REG] &= RC_ERR_BUFFER_OVFL;
+	tx_end = sim_now + air_time(32);
+
+	if (fifo_len >= 12 && field_on() && block < RC_MF_BLOCKS)
+	{
+		for (int i = 0; i < RC_MAX_CARDS; i++)
+		{
+			if (cards[i].present && cards[i].state == PICC_ACTIVE
+				&& memcmp(&fifo[8], &cards[i].uid[cards[i].uid_len - 4], 4) == 0)
+				card = &cards[i];
+		}
+	}
+	fifo_len = 0;
+
+	if (card != NULL)
+	{
+		const uint8_t *trailer = card->memory[block | 3];
+		const uint8_t *key = (fifo[0] == PICC_CMD_MF_AUTH_KEY_B) ? &trailer[10] : trailer;
+
+		if ((fifo[0] == PICC_CMD_MF_AUTH_KEY_A || fifo[0] == PICC_CMD_MF_AUTH_KEY_B) && memcmp(&fifo[2], key, 6) == 0)
+		{
+			card->auth_sector = block / 4;
+			card->write_block = RC_MF_NONE;
+			authentications++;
+			Sim_Schedule(tx_end + air_time(32) + air_time(64) + air_time(32) + 3 * RC_FDT, on_auth_done, NULL);
+			Sim_Trace(SIM_TRACE_RFID, "rfid authenticated sector %u", (unsigned)(block / 4));
+			return;
+		}
+		picc_error(card);
+	}
+
+	Sim_Trace(SIM_TRACE_RFID, "rfid authentication of block %u failed", (unsigned)block);
+	if (regs[T_MODE_REG] & 0x80)
+		Sim_Schedule(tx_end + timer_period(), on_timer, NULL);
+}
+
+/**
+ * @brief End of reception: store the frame in the FIFO starting at RxAlign,
+ *        check the CRC if RxCRCEn is set and raise RxIRq.
+ */
+static void on_rx_done(void *ctx)
+{
+	uint8_t align = (regs[BIT_FRAMING_REG] >> 4) & 0x07;
+	uint8_t data[RC_FRAME_MAX + 1];
+	BitFrame placed;
+	size_t bytes;
+
+	(void)ctx;
+
+	placed.len = 0;
+	for (uint8_t i = 0; i < align; i++)
+		placed.bits[placed.len++] = 0;
+	for (uint16_t i = 0; i < rx_frame.len; i++)
+		placed.bits[placed.len++] = rx_frame.bits[i];
+	bytes = frame_to_bytes(&placed, data);
+
+	if (rx_collision)
+	{
+		regs[ERROR_REG] |= RC_ERR_COLL;
+		regs[COLL_REG] = (uint8_t)((regs[COLL_REG] & 0x80) | ((align + rx_collision_pos + 1) & 0x1F));
+	}
+	else
+	{
+		regs[COLL_REG] = (uint8_t)((regs[COLL_REG] & 0x80) | RC_COLL_POS_INVALID);
+	}
+
+	if ((regs[RX_MODE_REG] & RC_CRC_EN) && (placed.len % 8U) == 0U && !rx_collision)
+	{
+		if (bytes < 3 || crc_a(data, bytes, crc_preset()) != 0)
+			regs[ERROR_REG] |= RC_ERR_CRC;
+		else
+			bytes -= 2;
+	}
+
+	for (size_t i = 0; i < bytes; i++)
+		fifo_push(data[i]);
+	regs[CONTROL_REG] = (uint8_t)((regs[CONTROL_REG] & ~0x07) | (placed.len % 8U));
+
+	regs[COM_IRQ_REG] |= RC_COM_IRQ_RX;
+	if (regs[ERROR_REG] & (RC_ERR_COLL | RC_ERR_CRC | RC_ERR_BUFFER_OVFL))
+		regs[COM_IRQ_REG] |= RC_COM_IRQ_ERR;
+	update_irq_pin();
+
+	Sim_Trace(SIM_TRACE_RFID, "rfid rx %u bits%s", (unsigned)rx_frame.len, rx_collision ? " (collision)" : "");
+}
+
+static void cancel_command(void)
+{
+	Sim_Cancel(on_crc_done, NULL);
+	Sim_Cancel(on_tx_done, NULL);
+	Sim_Cancel(on_rx_done, NULL);
+	Sim_Cancel(on_timer, NULL);
+	Sim_Cancel(on_auth_done, NULL);
+}
+
+/**
+ * @brief Sends the FIFO to the cards and schedules TxIRq, RxIRq or TimerIRq.
+ */
+static void start_transceive(void)
+{
+	uint8_t data[RC_FRAME_MAX];
+	uint8_t last_bits = regs[BIT_FRAMING_REG] & 0x07;
+	uint8_t len = fifo_len;
+	BitFrame tx, answer;
+	SimTime tx_end;
+	int answered = 0;
+
+	memcpy(data, fifo, len);
+	fifo_len = 0;
+	if ((regs[TX_MODE_REG] & RC_CRC_EN) && last_bits == 0)
+	{
+		uint16_t crc = crc_a(data, len, crc_preset());
+
+		data[len++] = (uint8_t)crc;
+		data[len++] = (uint8_t)(crc >> 8);
+	}
+	frame_from_bytes(&tx, data, len, last_bits);
+
+	regs[ERROR_REG] &= RC_ERR_BUFFER_OVFL;
+	transceives++;
+	tx_end = sim_now + air_time(tx.len);
+	Sim_Schedule(tx_end, on_tx_done, NULL);
+
+	// Superpose the answers of all cards; differing bits are collisions
+	rx_frame.len = 0;
+	rx_collision = 0;
+	if (field_on() && !(regs[COMMAND_REG] & 0x20))
+	{
+		for (int i = 0; i < RC_MAX_CARDS; i++)
+		{
+			if (!cards[i].present || !picc_process(&cards[i], &tx, &answer))
+				continue;
+
+			if (!answered)
+			{
+				rx_frame = answer;
+			}
+			else
+			{
+				for (uint16_t b = 0; b < answer.len && b < rx_frame.len; b++)
+				{
+					if (answer.bits[b] != rx_frame.bits[b])
+					{
+						if (!rx_collision || b < rx_collision_pos)
+							rx_collision_pos = b;
+						rx_collision = 1;
+						rx_frame.bits[b] |= answer.bits[b];
+					}
+				}
+			}
+			answered++;
+		}
+
+		if (answered && rx_collision)
+		{
+			// Bits after the first collision are not valid
+			rx_frame.len = (uint16_t)(rx_collision_pos + 1U);
+		}
+		else if (answered == 1)
+		{
+			for (int i = 0; i < RC_MAX_CARDS; i++)
+				if (cards[i].present && cards[i].report)
+					Sim_OnUidRead(cards[i].uid, cards[i].uid_len);
+		}
+	}
+
+	Sim_Trace(SIM_TRACE_RFID, "rfid tx %u bits, %d card(s) answer", (unsigned)tx.len, answered);
+
+	if (answered)
+	{
+		SimTime rx_start = tx_end + RC_FDT;
+
+		Sim_Schedule(rx_start + air_time(rx_frame.len), on_rx_done, NULL);
+		if ((regs[T_MODE_REG] & 0x80) && tx_end + timer_period() < rx_start)
+			Sim_Schedule(tx_end + timer_period(), on_timer, NULL);
+	}
+	else if (regs[T_MODE_REG] & 0x80)
+	{
+		Sim_Schedule(tx_end + timer_period(), on_timer, NULL);
+	}
+}
+
+static void execute(uint8_t cmd)
+{
+	cancel_command();
+	command = cmd;
+
+	switch (cmd)
+	{
+		case PCD_SOFT_RESET:
+		{
+			int was_on = field_on();
+
+			memcpy(regs, reset_values, sizeof(regs));
+			fifo_len = 0;
+			command = PCD_IDLE;
+			if (was_on)
+				field_changed(0);
+			break;
+		}
+		case PCD_CALC_CRC:
+		{
+			uint16_t crc = crc_a(fifo, fifo_len, crc_preset());
+			SimTime duration = SIM_NS(600) * fifo_len + SIM_US(1);
+
+			regs[CRC_RESULT_REG_LOW] = (uint8_t)crc;
+			regs[CRC_RESULT_REG_HIGH] = (uint8_t)(crc >> 8);
+			regs[ERROR_REG] &= RC_ERR_BUFFER_OVFL;
+			fifo_len = 0;
+			Sim_Schedule(sim_now + duration, on_crc_done, NULL);
+			break;
+		}
+		case PCD_TRANSCEIVE:
+			if (regs[BIT_FRAMING_REG] & RC_START_SEND)
+				start_transceive();
+			break;
+		case PCD_MF_AUTHENT:
+			start_authent();
+			break;
+		case PCD_IDLE:
+			break;
+		default:
+			Sim_Trace(SIM_TRACE_RFID, "rfid command 0x%02X is not modelled", cmd);
+			break;
+	}
+}
+
+static uint8_t reg_read(uint8_t addr)
+{
+	switch (addr)
+	{
+		case FIFO_DATA_REG:
+			return fifo_pop();
+		case FIFO_LEVEL_REG:
+			return fifo_len;
+		case COMMAND_REG:
+			return (uint8_t)((regs[COMMAND_REG] & 0x30) | command);
+		case STATUS_1_REG:
+			return (uint8_t)(0x01 | (fifo_len == 0 ? 0x02 : 0x00)
+					| ((regs[COM_IRQ_REG] & regs[COM_I_EN_REG] & 0x7F) ? 0x10 : 0x00));
+		default:
+			return regs[addr];
+	}
+}
+
+static void reg_write(uint8_t addr, uint8_t value)
+{
+	switch (addr)
+	{
+		case COMMAND_REG:
+		{
+			int before = field_on();
+
+			regs[COMMAND_REG] = value & 0x30;
+			if (before != field_on())
+				field_changed(field_on());
+			if ((value & 0x0F) != PCD_NO_CMD_CHANGE)
+				execute(value & 0x0F);
+			break;
+		}
+		case COM_IRQ_REG:
+			if (value & RC_COM_IRQ_SET1)
+				regs[addr] |= value & 0x7F;
+			else
+				regs[addr] &= (uint8_t)~value;
+			break;
+		case DIV_IRQ_REG:
+			if (value & RC_DIV_IRQ_SET2)
+				regs[addr] |= value & 0x14;
+			else
+				regs[addr] &= (uint8_t)~value;
+			break;
+		case FIFO_DATA_REG:
+			fifo_push(value);
+			break;
+		case FIFO_LEVEL_REG:
+			if (value & 0x80)
+			{
+				fifo_len = 0;
+				regs[ERROR_REG] &= (uint8_t)~RC_ERR_BUFFER_OVFL;
+			}
+			break;
+		case ERROR_REG:
+		case STATUS_1_REG:
+		case VERSION_REG:
+			break;
+		case STATUS_2_REG:
+			regs[addr] = (uint8_t)((regs[addr] & ~0xC8) | (value & 0xC8));
+			break;
+		case CONTROL_REG:
+			regs[addr] = (uint8_t)((regs[addr] & 0x07) | (value & 0xC0) | 0x10);
+			break;
+		case BIT_FRAMING_REG:
+			regs[addr] = value;
+			if ((value & RC_START_SEND) && command == PCD_TRANSCEIVE)
+				start_transceive();
+			break;
+		case TX_CONTROL_REG:
+		{
+			int before = field_on();
+
+			regs[addr] = value;
+			if (before != field_on())
+				field_changed(field_on());
+			break;
+		}
+		default:
+			regs[addr] = value;
+			break;
+	}
+	update_irq_pin();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// SPI slave
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void rc_select(int selected)
+{
+	spi_first = (uint8_t)selected;
+}
+
+/**
+ * @brief SPI framing of the MFRC522 (datasheet 8.1.2): the first byte holds the
+ *        address, bit 7 set for a read. While reading, every further MOSI byte
+ *        is the address of the next read.
+ */
+static uint8_t rc_exchange(uint8_t mosi)
+{
+	if (spi_first)
+	{
+		spi_first = 0;
+		spi_read = (mosi & 0x80) != 0;
+		spi_addr = (mosi >> 1) & 0x3F;
+		return 0x00;
+	}
+
+	if (spi_read)
+	{
+		uint8_t value = reg_read(spi_addr);
+
+		if (mosi & 0x80)
+			spi_addr = (mosi >> 1) & 0x3F;
+		return value;
+	}
+
+	reg_write(spi_addr, mosi);
+	return 0x00;
+}
+
+static SimSpiDevice rc_device = {
+	.name = "MFRC522",
+	.cs_port = GPIOA,
+	.cs_pin = GPIO_PIN_9,
+	.account = SIM_ACC_SPI_RFID,
+	.max_sclk = 10000000U,
+	.select = rc_select,
+	.exchange = rc_exchange,
+};
+
+void Sim_Mfrc522Attach(void)
+{
+	memcpy(regs, reset_values, sizeof(regs));
+	Sim_SpiAttach(&rc_device);
+	update_irq_pin();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Scenario interface
+/////////////////////////////////////////////////////////////////////////////////////
+
+int Sim_PiccEnter(const uint8_t *uid, uint8_t uid_len, uint8_t sak)
+{
+	if (uid_len != 4 && uid_len != 7 && uid_len != 10)
+		return -1;
+
+	for (int i = 0; i < RC_MAX_CARDS; i++)
+	{
+		if (cards[i].present)
+			continue;
+		memset(&cards[i], 0, sizeof(cards[i]));
+		cards[i].present = 1;
+		memcpy(cards[i].uid, uid, uid_len);
+		cards[i].uid_len = uid_len;
+		cards[i].sak = sak;
+		cards[i].state = field_on() ? PICC_IDLE : PICC_OFF;
+		cards[i].auth_sector = RC_MF_NONE;
+		cards[i].write_block = RC_MF_NONE;
+
+		// Manufacturer block, transport keys and access bits in every sector trailer
+		memcpy(cards[i].memory[0], uid, uid_len);
+		if (uid_len == 4)
+			cards[i].memory[0][4] = uid[0] ^ uid[1] ^ uid[2] ^ uid[3];
+		cards[i].memory[0][5] = sak;
+		for (int b = 3; b < RC_MF_BLOCKS; b += 4)
+		{
+			static const uint8_t trailer[16] = {
+				0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+			};
+
+			memcpy(cards[i].memory[b], trailer, 16);
+		}
+		return 0;
+	}
+	return -1;
+}
+
+void Sim_PiccLeave(const uint8_t *uid, uint8_t uid_len)
+{
+	for (int i = 0; i < RC_MAX_CARDS; i++)
+		if (cards[i].present && cards[i].uid_len == uid_len && memcmp(cards[i].uid, uid, uid_len) == 0)
+			cards[i].present = 0;
+}
+
+void Sim_PiccLeaveAll(void)
+{
+	for (int i = 0; i < RC_MAX_CARDS; i++)
+		cards[i].present = 0;
+}
+
+uint32_t Sim_PiccSelections(void)
+{
+	return selections;
+}
+
+/**
+ * @brief Reader statistics for the final report.
+ */
+void Sim_Mfrc522Report(FILE *out)
+{
+	SimTime field = field_total + (field_on() ? sim_now - field_since : 0);
+
+	fprintf(out, "  MFRC522: %llu transceives, %llu timeouts, %u selections, %u authentications, RF field on %.1f ms (%.1f %%)\n",
+			(unsigned long long)transceives, (unsigned long long)timeouts, (unsigned)selections, (unsigned)authentications,
+			Sim_Ms(field), sim_now ? 100.0 * (double)field / (double)sim_now : 0.0);
+}
@@ -0,0 +1,710 @@
+/**
+ ******************************************************************************
+  * @file    sim_sdcard.c
+  * @brief   Virtual SDHC card in SPI mode on SPI1 (CS PA8), backed by an
+  *          image file.
+  ******************************************************************************
+  *
+  * Implements the SPI-mode command set the FatFs driver uses (SD Physical
+  * Layer Simplified Specification, chapter 7) with time based read latency
+  * and programming busy, so CMD24 per sector and CMD25 bursts cost what they
+  * cost on a typical class 10 card.
+  */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "main.h"
+#include "ff_gen_drv.h"
+
+#define SD_BLOCK			512U
+#define SD_OUT_SIZE			2048U
+
+#define SD_READ_LATENCY		(SIM_US(100))	// Nac for a block read
+#define SD_BLOCK_GAP		(SIM_US(20))	// Between blocks of CMD18
+#define SD_PROG_SINGLE		(SIM_US(750))	// Busy after a CMD24 block
+#define SD_PROG_MULTI		(SIM_US(300))	// Busy after each CMD25 block
+#define SD_PROG_STOP		(SIM_US(500))	// Busy after the stop tran token
+#define SD_INIT_TIME		(SIM_MS(20))	// ACMD41 keeps answering "idle" this long
+
+#define R1_IDLE				0x01
+#define R1_ILLEGAL			0x04
+#define R1_PARAM			0x40
+
+typedef enum
+{
+	SD_CMD = 0,			// Waiting for a command
+	SD_WAIT_TOKEN,		// CMD24 accepted, waiting for 0xFE
+	SD_WAIT_MTOKEN,		// CMD25 running, waiting for 0xFC or 0xFD
+	SD_RX_DATA,			// Receiving a data block
+	SD_STREAM			// CMD18 running
+} SdState;
+
+static uint8_t *image;
+static uint32_t blocks;
+static int image_fd = -1;
+
+static SdState state;
+static uint8_t cmd_buf[6];
+static uint8_t cmd_len;
+static uint8_t app_cmd;
+static uint8_t idle = 1;
+static SimTime init_ready_at;
+static uint8_t multi_write;
+
+static uint8_t present = 1;
+
+static uint8_t out[SD_OUT_SIZE];
+static SimTime out_at[SD_OUT_SIZE];		// Earliest time each byte may leave
+static uint16_t out_head, out_count;
+static SimTime busy_until;
+
+static uint8_t rx_block[SD_BLOCK + 2];
+static uint16_t rx_count;
+static uint32_t rx_address;
+static uint32_t stream_address;
+static uint32_t erase_start, erase_end;
+
+static uint32_t blocks_read;
+static uint32_t blocks_written;
+static uint32_t commands;
+static uint32_t write_commands;
+static SimTime last_write;
+static SimTime busy_total;
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Output queue
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void out_byte_at(uint8_t value, SimTime at)
+{
+	uint16_t tail = (uint16_t)((out_head + out_count) % SD_OUT_SIZE);
+
+	if (out_count == SD_OUT_SIZE)
+		Sim_Fatal("SD response queue overflow");
+	out[tail] = value;
+	out_at[tail] = at;
+	out_count++;
+}
+
+static void out_byte(uint8_t value)
+{
+	out_byte_at(value, 0);
+}
+
+static void out_data_block(const uint8_t *data, uint16_t len, SimTime latency)
+{
+	out_byte_at(0xFE, sim_now + latency);
+	for (uint16_t i = 0; i < len; i++)
+		out_byte(data[i]);
+	out_byte(0xFF);		// CRC16, not checked by the driver
+	out_byte(0xFF);
+}
+
+static void set_busy(SimTime duration)
+{
+	busy_until = sim_now + duration;
+	busy_total += duration;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Commands
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void csd_v2(uint8_t csd[16])
+{
+	uint32_t c_size = blocks / 1024U - 1U;
+
+	memset(csd, 0, 16);
+	csd[0] = 0x40;				// CSD_STRUCTURE = 1
+	csd[1] = 0x0E;				// TAAC
+	csd[3] = 0x32;				// TRAN_SPEED 25 MHz
+	csd[4] = 0x5B;				// CCC
+	csd[5] = 0x59;				// READ_BL_LEN = 9
+	csd[7] = (uint8_t)((c_size >> 16) & 0x3F);
+	csd[8] = (uint8_t)(c_size >> 8);
+	csd[9] = (uint8_t)c_size;
+	csd[10] = 0x7F;				// ERASE_BLK_EN, SECTOR_SIZE
+	csd[11] = 0x80;
+	csd[12] = 0x0A;				// WRITE_BL_LEN = 9
+	csd[13] = 0x40;
+	csd[15] = 0x01;
+}
+
+static int block_valid(uint32_t address)
+{
+	return address < blocks;
+}
+
+static void command(uint8_t index, uint32_t arg)
+{
+	uint8_t r1 = idle ? R1_IDLE : 0x00;
+	uint8_t acmd = app_cmd;
+
+	commands++;
+	app_cmd = 0;
+	out_count = 0;
+	out_byte(0xFF);		// Ncr
+
+	if (idle && index != 0 && index != 8 && index != 55 && index != 58 && !(acmd && index == 41))
+	{
+		out_byte(R1_IDLE | R1_ILLEGAL);
+		return;
+	}
+
+	switch (index)
+	{
+		case 0:
+			idle = 1;
+			state = SD_CMD;
+			out_byte(R1_IDLE);
+			break;
+		case 8:
+			out_byte(r1);
+			out_byte(0x00);
+			out_byte(0x00);
+			out_byte((uint8_t)((arg >> 8) & 0x0F));
+			out_byte((uint8_t)arg);
+			break;
+		case 55:
+			app_cmd = 1;
+			out_byte(r1);
+			break;
+		case 41:
+			if (init_ready_at == 0)
+				init_ready_at = sim_now + SD_INIT_TIME;
+			if (sim_now >= init_ready_at)
+				idle = 0;
+			out_byte(idle ? R1_IDLE : 0x00);
+			break;
+		case 58:
+			out_byte(r1);
+			out_byte(idle ? 0x40 : 0xC0);	// Busy (power up done) and CCS
+			out_byte(0xFF);
+			out_byte(0x80);
+			out_byte(0x00);
+			break;
+		case 9:
+		{
+			uint8_t csd[16];
+
+			csd_v2(csd);
+			out_byte(r1);
+			out_data_block(csd, 16, SIM_US(10));
+			break;
+		}
+		case 10:
+		{
+			static const uint8_t cid[16] = { 0x03, 'S', 'D', 'S', 'I', 'M', '6', '4', 0x10, 0, 0, 0, 1, 0x01, 0x7A, 0x01 };
+
+			out_byte(r1);
+			out_data_block(cid, 16, SIM_US(10));
+			break;
+		}
+		case 12:
+			state = SD_CMD;
+			out_count = 0;
+			out_byte(0xFF);		// Stuff byte
+			out_byte(0xFF);
+			out_byte(0x00);
+			set_busy(SIM_US(20));
+			break;
+		case 13:
+			if (acmd)
+			{
+				uint8_t status[64];
+
+				memset(status, 0, sizeof(status));
+				status[8] = 0x04;		// SPEED_CLASS 10
+				status[10] = 0x90;		// AU_SIZE = 9 (4 MB)
+				out_byte(0x00);
+				out_byte(0x00);
+				out_data_block(status, sizeof(status), SIM_US(50));
+			}
+			else
+			{
+				out_byte(0x00);
+				out_byte(0x00);
+			}
+			break;
+		case 16:
+			out_byte(arg == SD_BLOCK ? 0x00 : R1_PARAM);
+			break;
+		case 17:
+			if (!block_valid(arg))
+			{
+				out_byte(R1_PARAM);
+				break;
+			}
+			out_byte(0x00);
+			out_data_block(&image[(size_t)arg * SD_BLOCK], SD_BLOCK, SD_READ_LATENCY);
+			blocks_read++;
+			Sim_Trace(SIM_TRACE_SD, "sd read block %u", (unsigned)arg);
+			break;
+		case 18:
+			if (!block_valid(arg))
+			{
+				out_byte(R1_PARAM);
+				break;
+			}
+			out_byte(0x00);
+			stream_address = arg;
+			state = SD_STREAM;
+			Sim_Trace(SIM_TRACE_SD, "sd read from block %u (multiple)", (unsigned)arg);
+			break;
+		case 23:
+			out_byte(0x00);		// ACMD23: pre-erase hint, accepted
+			break;
+		case 24:
+		case 25:
+			if (!block_valid(arg))
+			{
+				out_byte(R1_PARAM);
+				break;
+			}
+			out_byte(0x00);
+			rx_address = arg;
+			multi_write = index == 25;
+			state = multi_write ? SD_WAIT_MTOKEN : SD_WAIT_TOKEN;
+			write_commands++;
+			break;
+		case 32:
+			erase_start = arg;
+			out_byte(0x00);
+			break;
+		case 33:
+			erase_end = arg;
+			out_byte(0x00);
+			break;
+		case 38:
+			if (!block_valid(erase_start) || !block_valid(erase_end) || erase_end < erase_start)
+			{
+				out_byte(R1_PARAM);
+				break;
+			}
+			memset(&image[(size_t)erase_start * SD_BLOCK], 0, (size_t)(erase_end - erase_start + 1U) * SD_BLOCK);
+			out_byte(0x00);
+			set_busy(SIM_MS(1) + SIM_US(2) * (erase_end - erase_start + 1U));
+			break;
+		default:
+			out_byte(r1 | R1_ILLEGAL);
+			break;
+	}
+}
+
+static void block_received(void)
+{
+	memcpy(&image[(size_t)rx_address * SD_BLOCK], rx_block, SD_BLOCK);
+	blocks_written++;
+	last_write = sim_now;
+	Sim_Trace(SIM_TRACE_SD, "sd write block %u%s", (unsigned)rx_address, multi_write ? " (multiple)" : "");
+
+	out_count = 0;
+	out_byte(0xE5);		// Data accepted
+	if (multi_write)
+	{
+		set_busy(SD_PROG_MULTI);
+		rx_address++;
+		state = block_valid(rx_address) ? SD_WAIT_MTOKEN : SD_CMD;
+	}
+	else
+	{
+		set_busy(SD_PROG_SINGLE);
+		state = SD_CMD;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// SPI slave
+/////////////////////////////////////////////////////////////////////////////////////
+
+static uint8_t next_miso(void)
+{
+	if (out_count == 0 && state == SD_STREAM)
+	{
+		if (block_valid(stream_address))
+		{
+			out_data_block(&image[(size_t)stream_address * SD_BLOCK], SD_BLOCK, SD_BLOCK_GAP);
+			stream_address++;
+			blocks_read++;
+		}
+	}
+
+	// The data token only leaves once the access latency has passed
+	if (out_count && sim_now >= out_at[out_head])
+	{
+		uint8_t value = out[out_head];
+
+		out_head = (uint16_t)((out_head + 1U) % SD_OUT_SIZE);
+		out_count--;
+		return value;
+	}
+	if (out_count)
+		return 0xFF;
+	if (sim_now < busy_until)
+		return 0x00;
+	return 0xFF;
+}
+
+static uint8_t sd_exchange(uint8_t mosi)
+{
+	uint8_t miso;
+
+	// MISO is pulled up in an empty socket
+	if (!present)
+		return 0xFF;
+	miso = next_miso();
+
+	switch (state)
+	{
+		case SD_RX_DATA:
+			rx_block[rx_count++] = mosi;
+			if (rx_count == SD_BLOCK + 2U)
+				block_received();
+			return miso;
+		case SD_WAIT_TOKEN:
+			if (mosi == 0xFE)
+			{
+				state = SD_RX_DATA;
+				rx_count = 0;
+			}
+			return miso;
+		case SD_WAIT_MTOKEN:
+			if (mosi == 0xFC)
+			{
+				state = SD_RX_DATA;
+				rx_count = 0;
+			}
+			else if (mosi == 0xFD)
+			{
+				state = SD_CMD;
+				out_count = 0;
+				set_busy(SD_PROG_STOP);
+			}
+			return miso;
+		default:
+			break;
+	}
+
+	// Command framing: 01xxxxxx, 4 argument bytes, CRC7
+	if (cmd_len == 0 && (mosi & 0xC0) != 0x40)
+		return miso;
+	cmd_buf[cmd_len++] = mosi;
+	if (cmd_len == 6)
+	{
+		cmd_len = 0;
+		if (state == SD_STREAM && (cmd_buf[0] & 0x3F) != 12)
+			return miso;
+		command(cmd_buf[0] & 0x3F, ((uint32_t)cmd_buf[1] << 24) | ((uint32_t)cmd_buf[2] << 16)
+				| ((uint32_t)cmd_buf[3] << 8) | cmd_buf[4]);
+	}
+	return miso;
+}
+
+static void sd_select(int selected)
+{
+	if (!selected)
+		cmd_len = 0;
+}
+
+/**
+ * @brief Takes the card out of the socket or puts it back. A card that is
+ *        put back starts in idle state and has to be initialized again.
+ */
+void Sim_SdSetPresent(int inserted)
+{
+	present = (uint8_t)(inserted != 0);
+	state = SD_CMD;
+	cmd_len = 0;
+	app_cmd = 0;
+	idle = 1;
+	init_ready_at = 0;
+	multi_write = 0;
+	out_count = 0;
+	busy_until = 0;
+	Sim_Trace(SIM_TRACE_SD, "card %s", present ? "inserted" : "removed");
+}
+
+static SimSpiDevice sd_device = {
+	.name = "SD card",
+	.cs_port = SD_CS_GPIO_Port,
+	.cs_pin = SD_CS_Pin,
+	.account = SIM_ACC_SPI_SD,
+	.max_sclk = 25000000U,
+	.select = sd_select,
+	.exchange = sd_exchange,
+};
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Image
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Maps the image file, creating it with size_mb megabytes if missing.
+ * @retval 1 if the image was created and needs formatting, 0 if it existed, -1 on error.
+ */
+int Sim_SdAttach(const char *path, uint32_t size_mb)
+{
+	struct stat st;
+	int created = 0;
+	off_t size;
+
+	image_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (image_fd < 0 || fstat(image_fd, &st) != 0)
+		return -1;
+
+	size = st.st_size;
+	if (size == 0)
+	{
+		size = (off_t)size_mb * 1024 * 1024;
+		if (ftruncate(image_fd, size) != 0)
+			return -1;
+		created = 1;
+	}
+	if (size < 8 * 1024 * 1024 || size % (512 * 1024) != 0)
+		Sim_Fatal("%s: the image must be a multiple of 512 KB and at least 8 MB", path);
+
+	image = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+	if (image == MAP_FAILED)
+		return -1;
+	blocks = (uint32_t)(size / SD_BLOCK);
+
+	Sim_SpiAttach(&sd_device);
+	return created;
+}
+
+void Sim_SdFlush(void)
+{
+	if (image)
+		msync(image, (size_t)blocks * SD_BLOCK, MS_SYNC);
+}
+
+uint32_t Sim_SdBlocksWritten(void)
+{
+	return blocks_written;
+}
+
+uint32_t Sim_SdBlocksRead(void)
+{
+	return blocks_read;
+}
+
+SimTime Sim_SdLastWrite(void)
+{
+	return last_write;
+}
+
+void Sim_SdReport(FILE *out_file)
+{
+	fprintf(out_file, "  SD card: %u commands, %u write commands, %u blocks read, %u blocks written, busy %.1f ms\n",
+			(unsigned)commands, (unsigned)write_commands, (unsigned)blocks_read, (unsigned)blocks_written,
+			Sim_Ms(busy_total));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Direct image access for formatting and listing from the host side
+/////////////////////////////////////////////////////////////////////////////////////
+
+static DSTATUS image_initialize(BYTE lun) { (void)lun; return 0; }
+static DSTATUS image_status(BYTE lun) { (void)lun; return 0; }
+
+static DRESULT image_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+	(void)lun;
+	if (sector + count > blocks)
+		return RES_PARERR;
+	memcpy(buff, &image[(size_t)sector * SD_BLOCK], (size_t)count * SD_BLOCK);
+	return RES_OK;
+}
+
+static DRESULT image_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+	(void)lun;
+	if (sector + count > blocks)
+		return RES_PARERR;
+	memcpy(&image[(size_t)sector * SD_BLOCK], buff, (size_t)count * SD_BLOCK);
+	return RES_OK;
+}
+
+static DRESULT image_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+	(void)lun;
+	switch (cmd)
+	{
+		case CTRL_SYNC:
+			return RES_OK;
+		case GET_SECTOR_COUNT:
+			*(DWORD *)buff = blocks;
+			return RES_OK;
+		case GET_SECTOR_SIZE:
+			*(WORD *)buff = SD_BLOCK;
+			return RES_OK;
+		case GET_BLOCK_SIZE:
+			*(DWORD *)buff = 8192;	// 4 MB allocation unit
+			return RES_OK;
+		default:
+			return RES_PARERR;
+	}
+}
+
+static Diskio_drvTypeDef image_driver = {
+	image_initialize, image_status, image_read, image_write, image_ioctl
+};
+
+/**
+ * @brief Creates a FAT file system on the image with the firmware's own FatFs.
+ * @note  Runs before the firmware links its driver to the only volume.
+ */
+int Sim_SdFormat(void)
+{
+	static FATFS fs;
+	char path[4];
+	FRESULT res;
+
+	if (FATFS_LinkDriver(&image_driver, path) != 0)
+		return -1;
+	res = f_mount(&fs, path, 0);	// f_mkfs() needs a registered work area
+	if (res == FR_OK)
+		res = f_mkfs(path, 0, 0);
+	f_mount(NULL, path, 0);
+	FATFS_UnLinkDriver(path);
+	return res == FR_OK ? 0 : -1;
+}
+
+static void list_dir(FILE *out_file, char *path, size_t size, int depth)
+{
+	DIR dir;
+	FILINFO info;
+	char lfn[_MAX_LFN + 1];
+	size_t len = strlen(path);
+
+	info.lfname = lfn;
+	info.lfsize = sizeof(lfn);
+
+	if (f_opendir(&dir, path) != FR_OK)
+		return;
+	while (f_readdir(&dir, &info) == FR_OK && info.fname[0])
+	{
+		const char *name = lfn[0] ? lfn : info.fname;
+
+		fprintf(out_file, "  %*s%s%s", depth * 2, "", name, (info.fattrib & AM_DIR) ? "/" : "");
+		if (!(info.fattrib & AM_DIR))
+			fprintf(out_file, "  (%lu bytes)", (unsigned long)info.fsize);
+		fputc('\n', out_file);
+
+		if ((info.fattrib & AM_DIR) && len + strlen(name) + 2 < size)
+		{
+			snprintf(path + len, size - len, "/%s", name);
+			list_dir(out_file, path, size, depth + 1);
+			path[len] = '\0';
+		}
+	}
+	f_closedir(&dir);
+}
+
+/**
+ * @brief Prints the directory tree of the image with file sizes.
+ */
+void Sim_SdList(FILE *out_file)
+{
+	static FATFS fs;
+	extern char USERPath[4];
+	char drive[4];
+	char path[256];
+
+	FATFS_UnLinkDriver(USERPath);
+	if (FATFS_LinkDriver(&image_driver, drive) != 0)
+		return;
+	if (f_mount(&fs, drive, 1) != FR_OK)
+	{
+		fprintf(out_file, "\nSD image: no FAT file system\n");
+		return;
+	}
+
+	fprintf(out_file, "\nSD image contents:\n");
+	snprintf(path, sizeof(path), "%s", drive);
+	path[strlen(path) - 1] = '\0';		// "0:/" -> "0:", list_dir adds the separators
+	list_dir(out_file, path, sizeof(path), 0);
+	f_mount(NULL, drive, 0);
+	FATFS_UnLinkDriver(drive);
+}
+
+/**
+ * @brief Copies a file of the image to the host, e.g. a journal for journal2txt.
+ * @retval 0 on success
+ */
+int Sim_SdGet(const char *name, const char *host_path)
+{
+	static FATFS fs;
+	extern char USERPath[4];
+	char drive[4];
+	char path[256];
+	uint8_t buffer[SD_BLOCK];
+	FILE *out = NULL;
+	FIL fil;
+	UINT got;
+	int status = -1;
+
+	FATFS_UnLinkDriver(USERPath);
+	if (FATFS_LinkDriver(&image_driver, drive) != 0)
+		return -1;
+	snprintf(path, sizeof(path), "%s%s", drive, name[0] == '/' ? name + 1 : name);
+	if (f_mount(&fs, drive, 1) == FR_OK && f_open(&fil, path, FA_READ) == FR_OK)
+	{
+		out = fopen(host_path, "wb");
+		status = out != NULL ? 0 : -1;
+		while (out != NULL && f_read(&fil, buffer, sizeof(buffer), &got) == FR_OK && got > 0)
+			fwrite(buffer, 1, got, out);
+		if (out != NULL)
+			fclose(out);
+		f_close(&fil);
+	}
+	f_mount(NULL, drive, 0);
+	FATFS_UnLinkDriver(drive);
+	return status;
+}
+
+/**
+ * @brief Copies a host file to the root of the image before the firmware
+ *        starts, e.g. the employee directory.
+ * @retval 0 on success
+ */
+int Sim_SdPut(const char *host_path)
+{
+	static FATFS fs;
+	const char *base = strrchr(host_path, '/');
+	char drive[4];
+	char path[256];
+	uint8_t buffer[SD_BLOCK];
+	FILE *in = fopen(host_path, "rb");
+	FIL fil;
+	size_t got;
+	UINT written;
+	int status = -1;
+
+	if (in == NULL)
+		return -1;
+	if (FATFS_LinkDriver(&image_driver, drive) != 0)
+	{
+		fclose(in);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s%s", drive, base ? base + 1 : host_path);
+	if (f_mount(&fs, drive, 1) == FR_OK && f_open(&fil, path, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK)
+	{
+		status = 0;
+		while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+			if (f_write(&fil, buffer, (UINT)got, &written) != FR_OK || written != got)
+				status = -1;
+		if (f_close(&fil) != FR_OK)
+			status = -1;
+	}
+	f_mount(NULL, drive, 0);
+	FATFS_UnLinkDriver(drive);
+	fclose(in);
+	return status;
+}
@@ -0,0 +1,85 @@
+/**
+ ******************************************************************************
+  * @file    journal2txt.c
+  * @brief   Converts the binary attendance journal back to the text log.
+  ******************************************************************************
+  *
+  * Reads the YYYY_MM_DD.BIN files copied from the card and prints one line
+  * per record in the format of the text log:
+  *
+  *   UID,YYYY_MM_DD,HH:MM:SS,direction;
+  *
+  * The zeroed tail of a journal that is still preallocated ends the file.
+  * Records with a bad CRC, e.g. the last one after a power loss, are reported
+  * on stderr and skipped.
+  */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log_journal.h"
+
+static int convert(const char *name, FILE *in, FILE *out)
+{
+	LogRecord record;
+	long index = 0;
+	int bad = 0;
+	size_t got;
+
+	while ((got = fread(&record, 1, sizeof(record), in)) == sizeof(record))
+	{
+		char uid[3 * LOG_RECORD_UID_MAX + 1] = "";
+		time_t time = (time_t)record.time;
+		struct tm tm;
+
+		if (record.uid_len == 0)
+			return bad;
+		if (!logJournalCheck(&record))
+		{
+			fprintf(stderr, "journal2txt: %s: record %ld has a bad CRC\n", name, index++);
+			bad = 1;
+			continue;
+		}
+
+		for (uint8_t i = 0; i < record.uid_len; i++)
+			snprintf(uid + strlen(uid), sizeof(uid) - strlen(uid), "%s%X", i ? "_" : "", record.uid[i]);
+
+		// The journal keeps the RTC time as it is, without a time zone
+		gmtime_r(&time, &tm);
+		fprintf(out, "%s,%04d_%02d_%02d,%02d:%02d:%02d,%d;\n", uid,
+				tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+				record.direction);
+		index++;
+	}
+	if (got != 0)
+		fprintf(stderr, "journal2txt: %s: %zu bytes of a torn record at the end\n", name, got);
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	int status = 0;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: journal2txt FILE.BIN...\n");
+		return 2;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		FILE *in = fopen(argv[i], "rb");
+
+		if (in == NULL)
+		{
+			perror(argv[i]);
+			status = 1;
+			continue;
+		}
+		if (convert(argv[i], in, stdout))
+			status = 1;
+		fclose(in);
+	}
+	return status;
+}